@@ -0,0 +1,60 @@
+#include "BufferPool.hpp"
+
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+BufferPool::BufferPool(size_t buffer_size, size_t buffer_count) :
+        m_buffer_size(buffer_size), m_buffer_count(buffer_count), m_storage(new uint8_t[buffer_size * buffer_count]), m_next(
+                new atomic<uint32_t> [buffer_count]) {
+    for (size_t i = 0; i < buffer_count; i++)
+        m_next[i] = (i + 1 < buffer_count) ? uint32_t(i + 1) : NONE;
+    m_head = buffer_count ? 0 : NONE;
+    m_available = buffer_count;
+}
+
+uint8_t* BufferPool::acquire() {
+    uint64_t head = m_head.load(memory_order_acquire);
+    while (true) {
+        uint32_t index = uint32_t(head);
+        if (index == NONE)
+            return nullptr;
+        uint64_t next = ((head >> 32) + 1) << 32 | m_next[index].load(memory_order_relaxed);
+        if (m_head.compare_exchange_weak(head, next, memory_order_acquire, memory_order_acquire)) {
+            m_available.fetch_sub(1, memory_order_relaxed);
+            return m_storage.get() + index * m_buffer_size;
+        }
+    }
+}
+
+void BufferPool::release(uint8_t *buffer) {
+    if (!buffer)
+        return;
+    uint32_t index = uint32_t((buffer - m_storage.get()) / m_buffer_size);
+    uint64_t head = m_head.load(memory_order_relaxed);
+    while (true) {
+        m_next[index].store(uint32_t(head), memory_order_relaxed);
+        uint64_t next = ((head >> 32) + 1) << 32 | index;
+        if (m_head.compare_exchange_weak(head, next, memory_order_release, memory_order_relaxed)) {
+            m_available.fetch_add(1, memory_order_relaxed);
+            return;
+        }
+    }
+}
+
+bool BufferPool::lock() {
+    size_t size = m_buffer_size * m_buffer_count;
+    if (!size)
+        return true;
+    // The buffers are not in use yet, their contents do not matter
+    memset(m_storage.get(), 0, size);
+#ifdef _WIN32
+    return VirtualLock(m_storage.get(), size) != 0;
+#else
+    return !mlock(m_storage.get(), size);
+#endif
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <stdint.h>
+#include <stddef.h>
+
+using namespace std;
+
+// Pool of fixed size transfer buffers
+//
+// All buffers are allocated in one block at construction. acquire() and
+// release() are lock-free and may be called from any thread, so a buffer
+// filled on the libusb events thread can be handed to the receive queue
+// thread and returned to the pool from there, or from the completion of the
+// OUT transfer it was sent with.
+class BufferPool {
+public:
+    BufferPool(size_t buffer_size, size_t buffer_count);
+
+    // Returns nullptr when the pool is exhausted
+    uint8_t* acquire();
+    void release(uint8_t *buffer);
+
+    bool owns(const uint8_t *buffer) const {
+        return buffer >= m_storage.get() && buffer < m_storage.get() + m_buffer_size * m_buffer_count;
+    }
+
+    size_t bufferSize() const {
+        return m_buffer_size;
+    }
+    size_t bufferCount() const {
+        return m_buffer_count;
+    }
+    size_t available() const {
+        return m_available.load(memory_order_relaxed);
+    }
+
+    // Touches every page of the buffers and locks them in memory, so using a
+    // buffer never page faults. Clears the buffers, so call it before any is
+    // acquired. Returns false when locking is refused, the pages are still touched.
+    bool lock();
+
+private:
+    static const uint32_t NONE = 0xFFFFFFFF;
+
+    size_t m_buffer_size;
+    size_t m_buffer_count;
+    unique_ptr<uint8_t[]> m_storage;
+
+    // Free list as a stack of buffer indices. The head holds the index of the
+    // top buffer in the lower 32 bits and a tag, incremented on every change,
+    // in the upper 32 bits to prevent ABA problems.
+    unique_ptr<atomic<uint32_t>[]> m_next;
+    atomic<uint64_t> m_head;
+    atomic<size_t> m_available;
+};
@@ -0,0 +1,215 @@
+#include "Capture.hpp"
+#include "Log.hpp"
+
+#include <new>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+MappedFile::~MappedFile() {
+    close(m_size);
+}
+
+bool MappedFile::create(const string &path, size_t size) {
+    close(m_size);
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    // Mapping beyond the end of the file extends it
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, DWORD(uint64_t(size) >> 32), DWORD(size),
+            nullptr);
+    void *data = mapping ? MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size) : nullptr;
+    if (!data) {
+        if (mapping)
+            CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+    m_file = file;
+    m_mapping = mapping;
+#else
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    void *data = MAP_FAILED;
+    if (!ftruncate(fd, off_t(size)))
+        data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        ::close(fd);
+        return false;
+    }
+    m_fd = fd;
+#endif
+    m_data = (uint8_t*) data;
+    m_size = size;
+    m_writable = true;
+    return true;
+}
+
+bool MappedFile::open(const string &path) {
+    close(m_size);
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER file_size;
+    HANDLE mapping = nullptr;
+    void *data = nullptr;
+    if (GetFileSizeEx(file, &file_size) && file_size.QuadPart)
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping)
+        data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!data) {
+        if (mapping)
+            CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+    m_file = file;
+    m_mapping = mapping;
+    size_t size = size_t(file_size.QuadPart);
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (!fstat(fd, &st) && st.st_size)
+        data = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        ::close(fd);
+        return false;
+    }
+    m_fd = fd;
+    size_t size = size_t(st.st_size);
+#endif
+    m_data = (uint8_t*) data;
+    m_size = size;
+    m_writable = false;
+    return true;
+}
+
+void MappedFile::close(size_t size) {
+    if (!m_data)
+        return;
+#ifdef _WIN32
+    UnmapViewOfFile(m_data);
+    CloseHandle(m_mapping);
+    if (m_writable) {
+        LARGE_INTEGER end;
+        end.QuadPart = LONGLONG(size);
+        if (SetFilePointerEx(m_file, end, nullptr, FILE_BEGIN))
+            SetEndOfFile(m_file);
+    }
+    CloseHandle(m_file);
+    m_file = nullptr;
+    m_mapping = nullptr;
+#else
+    munmap(m_data, m_size);
+    if (m_writable && ftruncate(m_fd, off_t(size)))
+        LOG_WARNING("Cannot cut the capture file to size");
+    ::close(m_fd);
+    m_fd = -1;
+#endif
+    m_data = nullptr;
+    m_size = 0;
+}
+
+CaptureWriter::CaptureWriter(const string &path, size_t capacity, const char *serial) {
+    size_t data_offset = (sizeof(CaptureFileHeader) + 63) & ~size_t(63);
+    // Leaves room for the end marker
+    if (!m_file.create(path, data_offset + capacity + sizeof(CaptureRecord)))
+        return;
+
+    m_start = chrono::steady_clock::now();
+    m_header = new (m_file.data()) CaptureFileHeader();
+    m_header->magic = CaptureFileHeader::MAGIC;
+    m_header->version = CaptureFileHeader::VERSION;
+    m_header->start_unix_ns = chrono::duration_cast < chrono::nanoseconds
+            > (chrono::system_clock::now().time_since_epoch()).count();
+    if (serial)
+        strncpy(m_header->serial, serial, sizeof(m_header->serial) - 1);
+    m_header->data_offset = data_offset;
+    m_pos = data_offset;
+}
+
+CaptureWriter::~CaptureWriter() {
+    if (!m_header)
+        return;
+    // No append() is running any more, so every claimed record is complete
+    size_t end = m_pos.load();
+    m_header->data_end = end;
+    m_file.close(end + sizeof(CaptureRecord));
+}
+
+bool CaptureWriter::append(const struct libusb_transfer *transfer) {
+    return append(transfer->endpoint, transfer->status, transfer->buffer,
+            transfer->actual_length > 0 ? uint32_t(transfer->actual_length) : 0, chrono::steady_clock::now());
+}
+
+bool CaptureWriter::append(uint8_t endpoint, enum libusb_transfer_status status, const uint8_t *data,
+        uint32_t length, chrono::steady_clock::time_point time) {
+    if (!m_header)
+        return false;
+    size_t size = (sizeof(CaptureRecord) + length + 7) & ~size_t(7);
+    size_t limit = m_file.size() - sizeof(CaptureRecord);
+    size_t pos = m_pos.load(memory_order_relaxed);
+    do {
+        if (pos + size > limit) {
+            m_dropped.fetch_add(1, memory_order_relaxed);
+            return false;
+        }
+    } while (!m_pos.compare_exchange_weak(pos, pos + size, memory_order_relaxed));
+
+    CaptureRecord *record = (CaptureRecord*) (m_file.data() + pos);
+    record->length = length;
+    record->time_ns = chrono::duration_cast < chrono::nanoseconds > (time - m_start).count();
+    record->endpoint = endpoint;
+    record->status = uint8_t(status);
+    record->reserved = 0;
+    record->reserved2 = 0;
+    memcpy((uint8_t*) (record + 1), data, length);
+    // A reader stops at a record that is not complete yet
+    record->size.store(uint32_t(size), memory_order_release);
+    m_records.fetch_add(1, memory_order_relaxed);
+    return true;
+}
+
+bool CaptureReader::open(const string &path) {
+    m_header = nullptr;
+    if (!m_file.open(path) || m_file.size() < sizeof(CaptureFileHeader))
+        return false;
+    const CaptureFileHeader *header = (const CaptureFileHeader*) m_file.data();
+    if (header->magic != CaptureFileHeader::MAGIC || header->version != CaptureFileHeader::VERSION
+            || header->data_offset < sizeof(CaptureFileHeader) || header->data_offset > m_file.size())
+        return false;
+    m_header = header;
+    m_end = header->data_end && header->data_end <= m_file.size() ? size_t(header->data_end) : m_file.size();
+    rewind();
+    return true;
+}
+
+void CaptureReader::rewind() {
+    m_pos = m_header ? size_t(m_header->data_offset) : 0;
+}
+
+const CaptureRecord* CaptureReader::next() {
+    if (!m_header || m_pos + sizeof(CaptureRecord) > m_end)
+        return nullptr;
+    const CaptureRecord *record = (const CaptureRecord*) (m_file.data() + m_pos);
+    uint32_t size = record->size.load(memory_order_acquire);
+    if (size < sizeof(CaptureRecord) || size > m_end - m_pos || record->length > size - sizeof(CaptureRecord))
+        return nullptr;
+    m_pos += size;
+    return record;
+}
@@ -0,0 +1,155 @@
+#pragma once
+extern "C" {
+#include "libusb.h"
+}
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+
+using namespace std;
+
+// Capture file of transfer completions
+//
+// A header followed by records, each record a CaptureRecord followed by the
+// payload and padded to 8 bytes. A record with size 0 ends the capture, which
+// is also what the rest of the file looks like when the process died while
+// capturing: everything written up to then is readable.
+
+struct CaptureFileHeader {
+    static const uint32_t MAGIC = 0x50414355; // "UCAP"
+    static const uint32_t VERSION = 1;
+
+    uint32_t magic;
+    uint32_t version;
+    // When the capture started, record times are relative to this. The
+    // system time is for tools that show absolute times, such as Wireshark.
+    uint64_t start_unix_ns;
+    // Serial number string of the device, 0 terminated
+    char serial[48];
+    // Size of the header, records start here
+    uint64_t data_offset;
+    // End of the last record, set when the capture is closed. 0 when it was not.
+    uint64_t data_end;
+};
+
+struct CaptureRecord {
+    // Record size including header and padding, stored last
+    atomic<uint32_t> size;
+    uint32_t length;
+    // Time of the completion since the capture started
+    uint64_t time_ns;
+    uint8_t endpoint;
+    // libusb_transfer_status
+    uint8_t status;
+    uint16_t reserved;
+    uint32_t reserved2;
+
+    const uint8_t* payload() const {
+        return (const uint8_t*) (this + 1);
+    }
+};
+
+static_assert(sizeof(CaptureRecord) == 24, "CaptureRecord is a file format");
+
+// File mapped into memory, for the capture writer and reader
+class MappedFile {
+public:
+    MappedFile() {
+    }
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // Creates or truncates the file and sizes it to size bytes, or maps an
+    // existing file read-only with the size it has
+    bool create(const string &path, size_t size);
+    bool open(const string &path);
+    // Unmaps the file and cuts it to the given size
+    void close(size_t size);
+
+    uint8_t* data() const {
+        return m_data;
+    }
+    size_t size() const {
+        return m_size;
+    }
+
+private:
+    uint8_t *m_data = nullptr;
+    size_t m_size = 0;
+    bool m_writable = false;
+#ifdef _WIN32
+    void *m_file = nullptr;
+    void *m_mapping = nullptr;
+#else
+    int m_fd = -1;
+#endif
+};
+
+// Appends transfer completions to a capture file
+//
+// The file is sized to its capacity up front and mapped, so appending is a
+// copy into memory without system calls. append() may be called from several
+// threads at once, each record is claimed with a compare-exchange on the end
+// position. Completions that do not fit any more are dropped and counted. On
+// destruction the file is cut to what was written.
+class CaptureWriter {
+public:
+    CaptureWriter(const string &path, size_t capacity, const char *serial);
+    ~CaptureWriter();
+
+    bool valid() const {
+        return m_header != nullptr;
+    }
+
+    // Records the transfer as completed now, with the first actual_length
+    // bytes of its buffer
+    bool append(const struct libusb_transfer *transfer);
+    bool append(uint8_t endpoint, enum libusb_transfer_status status, const uint8_t *data, uint32_t length,
+            chrono::steady_clock::time_point time);
+
+    size_t size() const {
+        return m_pos.load(memory_order_relaxed);
+    }
+    uint64_t records() const {
+        return m_records.load(memory_order_relaxed);
+    }
+    uint64_t dropped() const {
+        return m_dropped.load(memory_order_relaxed);
+    }
+
+private:
+    MappedFile m_file;
+    CaptureFileHeader *m_header = nullptr;
+    chrono::steady_clock::time_point m_start;
+    atomic<size_t> m_pos { 0 };
+    atomic<uint64_t> m_records { 0 };
+    atomic<uint64_t> m_dropped { 0 };
+};
+
+// Reads a capture file front to back
+//
+//     CaptureReader reader;
+//     if (reader.open("usb-00000001.cap"))
+//         while (const CaptureRecord *record = reader.next())
+//             ... record->payload(), record->length ...
+class CaptureReader {
+public:
+    bool open(const string &path);
+
+    const CaptureFileHeader* header() const {
+        return m_header;
+    }
+    // nullptr at the end of the capture. Records stay valid as long as the reader.
+    const CaptureRecord* next();
+    void rewind();
+
+private:
+    MappedFile m_file;
+    const CaptureFileHeader *m_header = nullptr;
+    size_t m_pos = 0;
+    size_t m_end = 0;
+};
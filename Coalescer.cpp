@@ -0,0 +1,43 @@
+#include "Coalescer.hpp"
+
+#include <string.h>
+
+Coalescer::Coalescer(BufferPool &pool, size_t capacity, chrono::microseconds budget) :
+        m_pool(pool), m_capacity(capacity < pool.bufferSize() ? capacity : pool.bufferSize()), m_budget(budget) {
+}
+
+Coalescer::~Coalescer() {
+    m_pool.release(m_buffer);
+}
+
+bool Coalescer::add(const uint8_t *data, size_t size) {
+    if (m_size + HEADER_SIZE + size > m_capacity || size > 0xFFFF)
+        return false;
+
+    if (!m_buffer) {
+        m_buffer = m_pool.acquire();
+        if (!m_buffer)
+            return false;
+        m_started = chrono::steady_clock::now();
+    }
+
+    m_buffer[m_size++] = uint8_t(size);
+    m_buffer[m_size++] = uint8_t(size >> 8);
+    memcpy(m_buffer + m_size, data, size);
+    m_size += size;
+    m_count++;
+    return true;
+}
+
+uint8_t* Coalescer::take(size_t &size) {
+    uint8_t *buffer = m_buffer;
+    size = m_size;
+    if (buffer) {
+        payloads.fetch_add(m_count, memory_order_relaxed);
+        transfers.fetch_add(1, memory_order_relaxed);
+    }
+    m_buffer = nullptr;
+    m_size = 0;
+    m_count = 0;
+    return buffer;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "BufferPool.hpp"
+
+using namespace std;
+
+// Packs small payloads for one OUT endpoint into a single bulk transfer
+//
+// Every payload is preceded by its length as a 2 byte little endian header, so
+// the firmware can split the transfer again. A transfer is pending from the
+// first add() until take(), and should be taken once it is full or its time
+// budget has passed, whichever comes first.
+//
+// Only used from the device's packet processing, which runs on one executor
+// worker at a time, apart from the counters.
+class Coalescer {
+public:
+    static const size_t HEADER_SIZE = 2;
+
+    Coalescer(BufferPool &pool, size_t capacity, chrono::microseconds budget);
+    ~Coalescer();
+
+    // Appends a payload to the pending transfer. Returns false when it does
+    // not fit, or no buffer could be obtained for a new transfer.
+    bool add(const uint8_t *data, size_t size);
+
+    // Hands over the pending transfer, returns nullptr when there is none
+    uint8_t* take(size_t &size);
+
+    bool empty() const {
+        return !m_buffer;
+    }
+    // True when no further payload of the given size fits
+    bool full(size_t size) const {
+        return m_buffer && m_size + HEADER_SIZE + size > m_capacity;
+    }
+    chrono::steady_clock::time_point deadline() const {
+        return m_started + m_budget;
+    }
+    // When the first payload of the pending transfer was added
+    chrono::steady_clock::time_point started() const {
+        return m_started;
+    }
+
+    size_t capacity() const {
+        return m_capacity;
+    }
+
+    // Number of payloads and transfers taken, payloads / transfers is the
+    // average number of payloads per transfer
+    atomic<uint64_t> payloads { 0 };
+    atomic<uint64_t> transfers { 0 };
+
+private:
+    BufferPool &m_pool;
+    size_t m_capacity;
+    chrono::microseconds m_budget;
+
+    uint8_t *m_buffer = nullptr;
+    size_t m_size = 0;
+    size_t m_count = 0;
+    chrono::steady_clock::time_point m_started;
+};
@@ -0,0 +1,90 @@
+#include "ContextShards.hpp"
+
+#include "DeviceRegistry.hpp"
+
+ContextShards::ContextShards(const ContextShardsConfig &config) :
+        m_config(config) {
+    if (!m_config.shards)
+        m_config.shards = 1;
+}
+
+ContextShards::~ContextShards() {
+    for (size_t i = 0; i < m_hotplug_handles.size(); i++)
+        libusb_hotplug_deregister_callback(m_contexts[i], m_hotplug_handles[i]);
+    // The event loops stop before their context goes away
+    m_event_loops.clear();
+    for (auto ctx : m_contexts)
+        libusb_exit(ctx);
+}
+
+int ContextShards::init() {
+    for (size_t i = m_contexts.size(); i < m_config.shards; i++) {
+        libusb_context *ctx = nullptr;
+        int res = libusb_init(&ctx);
+        if (res)
+            return res;
+        m_contexts.push_back(ctx);
+
+        EventLoopConfig config = m_config.event_loop;
+        if (!m_config.cpus.empty())
+            config.cpu = m_config.cpus[i % m_config.cpus.size()];
+        m_event_loops.push_back(unique_ptr<EventLoop>(new EventLoop(ctx, config)));
+    }
+    return 0;
+}
+
+void ContextShards::start() {
+    for (auto &event_loop : m_event_loops)
+        event_loop->start();
+}
+
+int ContextShards::shardOf(libusb_context *ctx) const {
+    for (size_t i = 0; i < m_contexts.size(); i++)
+        if (m_contexts[i] == ctx)
+            return int(i);
+    return -1;
+}
+
+int ContextShards::registerHotplug(libusb_hotplug_event events, int vendor_id, int product_id,
+        libusb_hotplug_callback_fn callback, void *user_data) {
+    for (size_t i = m_hotplug_handles.size(); i < m_contexts.size(); i++) {
+        libusb_hotplug_callback_handle handle;
+        int res = libusb_hotplug_register_callback(m_contexts[i], events, LIBUSB_HOTPLUG_ENUMERATE, vendor_id,
+                product_id, LIBUSB_HOTPLUG_MATCH_ANY, callback, user_data, &handle);
+        if (res)
+            return res;
+        m_hotplug_handles.push_back(handle);
+    }
+    return 0;
+}
+
+bool ContextShards::arrived(libusb_context *ctx, libusb_device *dev) {
+    int shard = shardOf(ctx);
+    if (shard < 0 || m_contexts.size() == 1)
+        return true;
+
+    string path = DeviceRegistry::portPath(dev);
+    unique_lock < mutex > lk(m_mutex);
+    auto it = m_assigned.find(path);
+    if (it == m_assigned.end()) {
+        size_t assigned =
+                m_config.assignment == ContextShardsConfig::BY_BUS ?
+                        libusb_get_bus_number(dev) % m_contexts.size() : m_next_shard++ % m_contexts.size();
+        it = m_assigned.emplace(path, assigned).first;
+    }
+    return it->second == size_t(shard);
+}
+
+bool ContextShards::left(libusb_context *ctx, libusb_device *dev) {
+    int shard = shardOf(ctx);
+    if (shard < 0 || m_contexts.size() == 1)
+        return true;
+
+    string path = DeviceRegistry::portPath(dev);
+    unique_lock < mutex > lk(m_mutex);
+    auto it = m_assigned.find(path);
+    if (it == m_assigned.end() || it->second != size_t(shard))
+        return false;
+    m_assigned.erase(it);
+    return true;
+}
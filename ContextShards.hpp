@@ -0,0 +1,85 @@
+#pragma once
+extern "C" {
+#include "libusb.h"
+}
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stddef.h>
+
+#include "EventLoop.hpp"
+
+using namespace std;
+
+struct ContextShardsConfig {
+    // Number of libusb contexts, each with an event thread of its own
+    size_t shards = 1;
+
+    // How devices are spread over the shards: in the order they arrive, or
+    // all devices on a bus together
+    enum Assignment {
+        ROUND_ROBIN, BY_BUS
+    } assignment = ROUND_ROBIN;
+
+    // Pins the event thread of shard i to core cpus[i % cpus.size()]. Empty
+    // leaves the event threads unpinned.
+    vector<int> cpus;
+
+    EventLoopConfig event_loop;
+};
+
+// Several libusb contexts, so the completions of many devices are handled by
+// several event threads instead of all going through one
+//
+// Every context enumerates every device, a device is opened in the context of
+// the shard it is assigned to. The assignment is keyed by port path, which is
+// the same in every context, so the hotplug callbacks of all contexts agree
+// on which one the device belongs to and the others ignore it.
+class ContextShards {
+public:
+    explicit ContextShards(const ContextShardsConfig &config = ContextShardsConfig());
+    ~ContextShards();
+
+    // Returns the first libusb error, the contexts that could be created are
+    // kept
+    int init();
+    // Starts the event threads
+    void start();
+
+    size_t size() const {
+        return m_contexts.size();
+    }
+    libusb_context* context(size_t shard) const {
+        return m_contexts[shard];
+    }
+    EventLoop& eventLoop(size_t shard) {
+        return *m_event_loops[shard];
+    }
+    // -1 when ctx is not one of the shards
+    int shardOf(libusb_context *ctx) const;
+
+    // Registers the callback with every context. Returns the first error.
+    int registerHotplug(libusb_hotplug_event events, int vendor_id, int product_id, libusb_hotplug_callback_fn callback,
+            void *user_data);
+
+    // For an arrival reported by ctx, whether it is the context the device is
+    // to be opened in. Assigns the device to a shard the first time. Devices
+    // of contexts that are not shards are always accepted.
+    bool arrived(libusb_context *ctx, libusb_device *dev);
+    // For a departure reported by ctx, whether the device was assigned to
+    // that context. Forgets the assignment when it was.
+    bool left(libusb_context *ctx, libusb_device *dev);
+
+private:
+    ContextShardsConfig m_config;
+    vector<libusb_context*> m_contexts;
+    vector<unique_ptr<EventLoop>> m_event_loops;
+    vector<libusb_hotplug_callback_handle> m_hotplug_handles;
+
+    mutex m_mutex;
+    map<string, size_t> m_assigned;
+    size_t m_next_shard = 0;
+};
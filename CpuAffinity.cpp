@@ -0,0 +1,39 @@
+#include "CpuAffinity.hpp"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+bool pinCurrentThread(int cpu) {
+    if (cpu < 0)
+        return false;
+#ifdef _WIN32
+    if (cpu >= int(sizeof(DWORD_PTR) * 8))
+        return false;
+    return SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << cpu) != 0;
+#elif defined(__linux__)
+    if (cpu >= CPU_SETSIZE)
+        return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return !pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    return false;
+#endif
+}
+
+bool setRealtimePriority(int priority) {
+    if (priority <= 0)
+        return false;
+#ifdef _WIN32
+    return SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL) != 0;
+#else
+    struct sched_param param = { };
+    param.sched_priority = priority;
+    return !pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+#endif
+}
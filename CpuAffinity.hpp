@@ -0,0 +1,10 @@
+#pragma once
+
+// Pins the calling thread to one core. Returns false when that is not
+// possible, the thread then keeps running wherever it did before.
+bool pinCurrentThread(int cpu);
+
+// Moves the calling thread to real-time scheduling: SCHED_FIFO at the given
+// priority (1-99) on Linux, time critical priority on Windows. Usually needs
+// elevated privileges, returns false when refused.
+bool setRealtimePriority(int priority);
@@ -0,0 +1,134 @@
+#include "DescriptorCache.hpp"
+
+#include <ctype.h>
+#include <string.h>
+
+#include "DeviceRegistry.hpp"
+
+libusb_device* DescriptorCache::findBySerial(libusb_device **list, ssize_t count, uint16_t vid, uint16_t pid,
+        const string &serial) {
+    string key = lowerCase(serial);
+    string path;
+    {
+        unique_lock < mutex > lk(m_mutex);
+        auto it = m_by_serial.find(key);
+        if (it != m_by_serial.end())
+            path = it->second;
+    }
+
+    CachedDescriptors descriptors;
+    if (!path.empty()) {
+        for (ssize_t i = 0; i < count; i++) {
+            if (DeviceRegistry::portPath(list[i]) != path)
+                continue;
+            if (lookup(list[i], true, descriptors) && descriptors.device.idVendor == vid
+                    && descriptors.device.idProduct == pid && lowerCase(descriptors.serial) == key)
+                return list[i];
+            break;
+        }
+    }
+
+    // Not seen before, read the strings of the devices with our VID/PID that
+    // are not cached yet
+    for (ssize_t i = 0; i < count; i++) {
+        if (!lookup(list[i], false, descriptors))
+            continue;
+        if (descriptors.device.idVendor != vid || descriptors.device.idProduct != pid)
+            continue;
+        if (!lookup(list[i], true, descriptors))
+            continue;
+        // Microsoft Windows is case insensitive. It even changes case for device's serial numbers
+        // so we cannot use mixed case in serial numbers on our devices
+        if (lowerCase(descriptors.serial) == key)
+            return list[i];
+    }
+    return NULL;
+}
+
+bool DescriptorCache::lookup(libusb_device *dev, bool want_strings, CachedDescriptors &descriptors) {
+    struct libusb_device_descriptor device_desc;
+    if (libusb_get_device_descriptor(dev, &device_desc))
+        return false;
+    string path = DeviceRegistry::portPath(dev);
+
+    {
+        unique_lock < mutex > lk(m_mutex);
+        auto it = m_by_path.find(path);
+        if (it != m_by_path.end()) {
+            if (memcmp(&it->second.device, &device_desc, sizeof(device_desc))) {
+                // Another device on the same port
+                erase(path);
+            } else if (it->second.strings || !want_strings) {
+                hits.fetch_add(1, memory_order_relaxed);
+                descriptors = it->second;
+                return true;
+            }
+        }
+    }
+    misses.fetch_add(1, memory_order_relaxed);
+
+    CachedDescriptors entry;
+    entry.device = device_desc;
+    if (want_strings) {
+        libusb_device_handle *handle = NULL;
+        if (!libusb_open(dev, &handle)) {
+            opens.fetch_add(1, memory_order_relaxed);
+            uint8_t string_descriptor[256];
+            int retval = 0;
+            if (device_desc.iSerialNumber) {
+                retval = libusb_get_string_descriptor_ascii(handle, device_desc.iSerialNumber, string_descriptor,
+                        sizeof(string_descriptor));
+                if (retval > 0)
+                    entry.serial.assign((const char*) string_descriptor, retval);
+            }
+            // When reading the serial number fails it is tried again on the
+            // next lookup, a device that has none is not asked again
+            entry.strings = retval >= 0;
+            if (device_desc.iProduct) {
+                int length = libusb_get_string_descriptor_ascii(handle, device_desc.iProduct, string_descriptor,
+                        sizeof(string_descriptor));
+                if (length > 0)
+                    entry.product.assign((const char*) string_descriptor, length);
+            }
+            libusb_close(handle);
+        }
+    }
+
+    unique_lock < mutex > lk(m_mutex);
+    erase(path);
+    m_by_path[path] = entry;
+    if (!entry.serial.empty())
+        m_by_serial[lowerCase(entry.serial)] = path;
+    descriptors = entry;
+    return true;
+}
+
+void DescriptorCache::invalidate(libusb_device *dev) {
+    string path = DeviceRegistry::portPath(dev);
+    unique_lock < mutex > lk(m_mutex);
+    erase(path);
+}
+
+void DescriptorCache::invalidateSerial(const string &serial) {
+    unique_lock < mutex > lk(m_mutex);
+    auto it = m_by_serial.find(lowerCase(serial));
+    if (it != m_by_serial.end())
+        erase(string(it->second));
+}
+
+void DescriptorCache::erase(const string &path) {
+    auto it = m_by_path.find(path);
+    if (it == m_by_path.end())
+        return;
+    auto serial = m_by_serial.find(lowerCase(it->second.serial));
+    if (serial != m_by_serial.end() && serial->second == path)
+        m_by_serial.erase(serial);
+    m_by_path.erase(it);
+}
+
+string DescriptorCache::lowerCase(const string &s) {
+    string lower(s);
+    for (auto &c : lower)
+        c = tolower((unsigned char) c);
+    return lower;
+}
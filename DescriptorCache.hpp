@@ -0,0 +1,58 @@
+#pragma once
+extern "C" {
+#include "libusb.h"
+}
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <stdint.h>
+
+using namespace std;
+
+struct CachedDescriptors {
+    struct libusb_device_descriptor device;
+    // Only read, which means opening the device, for devices matching the
+    // wanted VID/PID
+    bool strings = false;
+    string serial;
+    string product;
+};
+
+// Descriptors and string descriptors of the devices on the bus, keyed by
+// port path, kept across enumerations
+//
+// The device descriptor comes from libusb's copy and needs no I/O, a cached
+// entry is dropped when it no longer matches the device on that port. A
+// serial number index makes finding an arrived device a hash lookup, a
+// device that is not ours is never opened.
+class DescriptorCache {
+public:
+    // Returns the device in list with the given VID/PID and serial number,
+    // compared case-insensitively, or NULL when it is not there (yet)
+    libusb_device* findBySerial(libusb_device **list, ssize_t count, uint16_t vid, uint16_t pid, const string &serial);
+
+    // Returns false when the device descriptor cannot be read. Strings are
+    // read when want_strings is set and they were not cached yet.
+    bool lookup(libusb_device *dev, bool want_strings, CachedDescriptors &descriptors);
+
+    // To be called when a device leaves
+    void invalidate(libusb_device *dev);
+    void invalidateSerial(const string &serial);
+
+    atomic<uint64_t> hits { 0 };
+    atomic<uint64_t> misses { 0 };
+    // Times a device was opened to read its strings
+    atomic<uint64_t> opens { 0 };
+
+private:
+    mutex m_mutex;
+    unordered_map<string, CachedDescriptors> m_by_path;
+    // Lower case serial number to port path
+    unordered_map<string, string> m_by_serial;
+
+    // Call with m_mutex held
+    void erase(const string &path);
+    static string lowerCase(const string &s);
+};
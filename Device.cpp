@@ -1,4 +1,5 @@
 #include "Device.hpp"
+#include "Log.hpp"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -9,44 +10,326 @@ using namespace std;
 
 void Device::send(int ep, void *data, size_t size) {
     if (!size)
-        size = sizeof(m_recv_buffers);
-    struct libusb_transfer *xfr;
-    xfr = libusb_alloc_transfer(0);
-    libusb_fill_bulk_transfer(xfr, this->m_handle, 0x7F & ep, // Endpoint ID
-    (unsigned char*) data, size, libusb_transfer_cb, this, 5000);
+        size = m_config.transfer_size;
+    if (size > m_buffer_pool.bufferSize()) {
+        LOG_ERROR("Send of %d bytes exceeds buffer size %d.", (int) size, (int) m_buffer_pool.bufferSize());
+        return;
+    }
+    // The caller's buffer is not guaranteed to outlive the transfer, so the
+    // data is copied into a pooled buffer.
+    uint8_t *buffer = m_buffer_pool.acquire();
+    if (!buffer) {
+        m_send_dropped++;
+        return;
+    }
+    memcpy(buffer, data, size);
+    sendBuffer(ep, buffer, size);
+}
+
+void Device::sendBuffer(int ep, uint8_t *buffer, size_t size) {
+    sendBuffer(ep, buffer, size, chrono::steady_clock::now());
+}
+
+void Device::sendBuffer(int ep, uint8_t *buffer, size_t size, chrono::steady_clock::time_point queued) {
+    SendQueue *queue = m_send_queues[ep & 0x0F].get();
+    if (!queue) {
+        LOG_ERROR("No send queue for endpoint 0x%02X.", ep & 0x7F);
+        releaseBuffer(buffer);
+        return;
+    }
+
+    PendingSend pending = { buffer, size, queued };
+    bool block = m_config.send_queue_full == DeviceConfig::SEND_QUEUE_BLOCK && !Executor::onWorker();
+    switch (queue->push(pending, block)) {
+    case SendQueue::SUBMIT:
+        submitOut(ep, pending);
+        break;
+    case SendQueue::QUEUED:
+        break;
+    case SendQueue::FULL:
+    case SendQueue::STOPPED:
+        m_send_dropped++;
+        releaseBuffer(buffer);
+        break;
+    }
+}
+
+void Device::submitOut(int ep, PendingSend pending) {
+    SendQueue *queue = m_send_queues[ep & 0x0F].get();
+    while (true) {
+        struct libusb_transfer *xfr;
+        xfr = m_transfer_pool.acquire();
+        TransferContext *context = TransferPool::context(xfr);
+        context->owner = this;
+        context->queued = pending.queued;
+        context->retries = 0;
+        libusb_fill_bulk_transfer(xfr, m_transport->handle(), 0x7F & ep, // Endpoint ID
+        pending.buffer, pending.size, libusb_transfer_cb, context, m_config.timeout);
+
+        // A coalesced transfer that ends on a packet boundary gets a zero
+        // length packet, see DeviceConfig::coalesce. Pooled transfers keep
+        // their flags, so it is cleared otherwise.
+        int max_packet_size = m_max_packet_sizes[ep & 0x0F];
+        if (max_packet_size && pending.size % max_packet_size == 0 && m_coalesce_pool->owns(pending.buffer)
+                && m_zero_packets.load(memory_order_relaxed))
+            xfr->flags |= LIBUSB_TRANSFER_ADD_ZERO_PACKET;
+        else
+            xfr->flags &= ~LIBUSB_TRANSFER_ADD_ZERO_PACKET;
+
+        // Less frequent crash
+        // io.c  Line 1417
+        //       add_to_flying_list(usbi_transfer * transfer)
+        libusb_error status = (libusb_error) submit(xfr);
+        if (status == LIBUSB_ERROR_NOT_SUPPORTED && (xfr->flags & LIBUSB_TRANSFER_ADD_ZERO_PACKET)) {
+            if (m_zero_packets.exchange(false))
+                LOG_WARNING("Zero length packets are not supported, coalesced transfers are sent without");
+            xfr->flags &= ~LIBUSB_TRANSFER_ADD_ZERO_PACKET;
+            status = (libusb_error) submit(xfr);
+        }
+        if (!status)
+            return;
+
+        LOG_WARNING("Submit transfer error %s %s", libusb_error_name(status), libusb_strerror(status));
+        m_send_errors++;
+        releaseOutTransfer(xfr);
+
+        // Our credit passes on to the next queued send, if any
+        if (!queue->complete(pending))
+            return;
+    }
+}
+
+void Device::coalesce(int ep, uint8_t *buffer, size_t size) {
+    Coalescer *coalescer = m_coalescers[ep & 0x0F].get();
+    if (coalescer->full(size)) {
+        // The send latency includes the time the payloads waited to be coalesced
+        auto started = coalescer->started();
+        size_t coalesced_size;
+        uint8_t *coalesced = coalescer->take(coalesced_size);
+        sendBuffer(ep, coalesced, coalesced_size, started);
+    }
+    if (!coalescer->add(buffer, size))
+        m_send_dropped++;
+    releaseBuffer(buffer);
+}
+
+chrono::steady_clock::time_point Device::flushCoalescers(chrono::steady_clock::time_point now) {
+    chrono::steady_clock::time_point next = chrono::steady_clock::time_point::max();
+    for (int ep = 0; ep < 16; ep++) {
+        Coalescer *coalescer = m_coalescers[ep].get();
+        if (!coalescer || coalescer->empty())
+            continue;
+        if (coalescer->deadline() <= now) {
+            auto started = coalescer->started();
+            size_t size;
+            uint8_t *buffer = coalescer->take(size);
+            sendBuffer(ep, buffer, size, started);
+        } else if (coalescer->deadline() < next) {
+            next = coalescer->deadline();
+        }
+    }
+    return next;
+}
+
+void Device::releaseBuffer(uint8_t *buffer) {
+    if (m_coalesce_pool && m_coalesce_pool->owns(buffer))
+        m_coalesce_pool->release(buffer);
+    else
+        m_buffer_pool.release(buffer);
+}
+
+void Device::releaseOutTransfer(struct libusb_transfer *transfer) {
+    releaseBuffer(transfer->buffer);
+    m_transfer_pool.release(transfer);
+}
+
+void Device::completeOut(struct libusb_transfer *transfer) {
+    SendQueue *queue = m_send_queues[transfer->endpoint & 0x0F].get();
+    int ep = transfer->endpoint;
+    queue->latency.record(
+            chrono::duration_cast < chrono::microseconds
+                    > (chrono::steady_clock::now() - TransferPool::context(transfer)->queued).count());
+    releaseOutTransfer(transfer);
+
+    PendingSend next;
+    if (queue->complete(next))
+        submitOut(ep, next);
+
+    // A send queue has room again
+    if (m_recv_deferred.load() && m_recv_deferred.exchange(false))
+        scheduleRecv();
+}
+
+int Device::submit(struct libusb_transfer *transfer) {
+    TransferContext *context = TransferPool::context(transfer);
+    context->submitted = chrono::steady_clock::now();
+
+    // Submitting under the lock makes sure close() either sees the transfer
+    // in flight, or the transfer sees the device closing
+    unique_lock < mutex > lk(m_in_flight_mutex);
+    if (m_closing)
+        return LIBUSB_ERROR_NO_DEVICE;
+    // Written before the transfer can complete
+    if (m_pcap)
+        m_pcap->submitted(transfer);
+    int status = m_transport->submit(transfer);
+    if (status && m_pcap)
+        m_pcap->submitFailed(transfer, status);
+    if (!status) {
+        context->slot = m_in_flight.size();
+        m_in_flight.push_back(transfer);
+    }
+    return status;
+}
+
+void Device::callbackEntered(struct libusb_transfer *transfer) {
+    unique_lock < mutex > lk(m_in_flight_mutex);
+    size_t slot = TransferPool::context(transfer)->slot;
+    if (slot < m_in_flight.size() && m_in_flight[slot] == transfer) {
+        m_in_flight[slot] = m_in_flight.back();
+        TransferPool::context(m_in_flight[slot])->slot = slot;
+        m_in_flight.pop_back();
+    }
+    m_active_callbacks++;
+}
+
+void Device::callbackLeft() {
+    unique_lock < mutex > lk(m_in_flight_mutex);
+    m_active_callbacks--;
+    checkClosed(lk);
+}
 
-    // Less frequent crash
-    // io.c  Line 1417
-    //       add_to_flying_list(usbi_transfer * transfer)
-    libusb_submit_transfer(xfr);
+void Device::checkClosed(unique_lock<mutex> &lk) {
+    if (!m_closing || m_closed || !m_in_flight.empty() || m_active_callbacks)
+        return;
+    m_closed = true;
+    function<void()> on_closed;
+    on_closed.swap(m_on_closed);
+    m_closed_cv.notify_all();
+    lk.unlock();
+
+    // The device may be destroyed from here on
+    LOG_INFO("All transfers finished");
+    if (on_closed)
+        on_closed();
+}
+
+void Device::close(function<void()> on_closed) {
+    unique_lock < mutex > lk(m_in_flight_mutex);
+    if (m_closing)
+        return;
+    m_closing = true;
+    m_on_closed = move(on_closed);
+
+    // The packet processing might be blocked waiting for send credits,
+    // and queued sends must not take over the credits of cancelled transfers.
+    // Those will never be sent, so their buffers go back to the pool.
+    for (auto &queue : m_send_queues) {
+        if (!queue)
+            continue;
+        queue->stop();
+        PendingSend pending;
+        while (queue->discard(pending)) {
+            m_send_dropped++;
+            releaseBuffer(pending.buffer);
+        }
+    }
+    // A run waiting for room takes the packets left on the receive queue,
+    // their sends are refused now
+    if (m_recv_deferred.exchange(false))
+        scheduleRecv();
+
+    LOG_INFO("Cancelling %d transfers", (int) m_in_flight.size());
+    for (auto xfr : m_in_flight)
+        m_transport->cancel(xfr);
+    checkClosed(lk);
+}
+
+MetricsSnapshot Device::metrics() const {
+    MetricsSnapshot snapshot;
+    snapshot.time = chrono::steady_clock::now();
+    for (auto &metrics : m_metrics) {
+        if (!metrics)
+            continue;
+        MetricsSnapshot::Endpoint ep;
+        ep.endpoint = metrics->endpoint;
+        ep.transfers = metrics->transfers.load(memory_order_relaxed);
+        ep.bytes = metrics->bytes.load(memory_order_relaxed);
+        for (int i = 0; i < EndpointMetrics::STATUSES; i++)
+            ep.status[i] = metrics->status[i].load(memory_order_relaxed);
+        ep.latency = metrics->latency.snapshot();
+        SendQueue *queue = (ep.endpoint & 0x80) ? nullptr : m_send_queues[ep.endpoint & 0x0F].get();
+        if (queue) {
+            ep.queue_depth = queue->depth();
+            ep.in_flight = queue->inFlight();
+            ep.queue_latency = queue->latency.snapshot();
+        }
+        snapshot.endpoints.push_back(ep);
+    }
+    snapshot.echo_turnaround = m_echo_turnaround.snapshot();
+    snapshot.recv_dropped = m_recv_dropped.load();
+    snapshot.shared_ring_dropped = m_shared_ring ? m_shared_ring->dropped() : 0;
+    snapshot.capture_dropped = m_capture ? m_capture->dropped() : 0;
+    snapshot.pcap_dropped = m_pcap ? m_pcap->dropped() : 0;
+    if (m_parser) {
+        snapshot.messages_decoded = m_parser->messages.load(memory_order_relaxed);
+        snapshot.bad_checksums = m_parser->bad_checksums.load(memory_order_relaxed);
+        snapshot.unknown_types = m_parser->unknown_types.load(memory_order_relaxed);
+        snapshot.skipped_bytes = m_parser->skipped_bytes.load(memory_order_relaxed);
+    }
+    snapshot.send_dropped = m_send_dropped.load();
+    snapshot.send_errors = m_send_errors.load();
+    snapshot.recv_queue_depth = m_recv_queue.size();
+    snapshot.buffers_available = m_buffer_pool.available();
+    return snapshot;
 }
 
 void Device::libusb_transfer_cb(struct libusb_transfer *transfer) {
-    Device *md = (Device*) (transfer->user_data);
+    TransferContext *context = TransferPool::context(transfer);
+    Device *md = (Device*) context->owner;
+    md->callbackEntered(transfer);
+    EndpointMetrics *metrics = md->m_metrics[metricsIndex(transfer->endpoint)].get();
+    if (metrics)
+        metrics->record(transfer, context->submitted);
+    // Before the buffer is handed on
+    if (md->m_capture)
+        md->m_capture->append(transfer);
+    if (md->m_pcap)
+        md->m_pcap->completed(transfer);
+
     switch (transfer->status) {
     case LIBUSB_TRANSFER_COMPLETED:
 
         if (transfer->endpoint & 0x80) {
-            printf("Received %d bytes on EP %02X\n", transfer->actual_length, transfer->endpoint);
-
-            vector < uint8_t > recvData;
-            recvData.resize(1 + transfer->actual_length);
-            memcpy(1 + recvData.data(), transfer->buffer, transfer->actual_length);
-            recvData[0] = transfer->endpoint;
-            unique_lock < mutex > lk(md->m_process_recv_queue_mutex);
-            md->m_recv_queue.push_back(recvData);
-            md->m_process_recv_queue_cv.notify_all();
+            LOG_DEBUG("Received %d bytes on EP %02X", transfer->actual_length, transfer->endpoint);
+
+            // The filled buffer is loaned to the packet processing and the
+            // transfer is re-armed with a fresh buffer from the pool. When either
+            // the pool or the queue is exhausted the packet is dropped and the
+            // transfer keeps its buffer.
+            Packet packet;
+            packet.endpoint = transfer->endpoint;
+            packet.length = transfer->actual_length;
+            packet.data = transfer->buffer;
+            packet.received = chrono::steady_clock::now();
+            uint8_t *fresh = md->m_buffer_pool.acquire();
+            if (fresh && md->m_recv_queue.push(packet)) {
+                transfer->buffer = fresh;
+                md->scheduleRecv();
+            } else {
+                md->m_buffer_pool.release(fresh);
+                md->m_recv_dropped++;
+            }
 
-            libusb_error status = (libusb_error) libusb_submit_transfer(transfer);
+            libusb_error status = md->m_closing ? LIBUSB_SUCCESS : (libusb_error) md->submit(transfer);
             if (status) {
-                printf("Re-issue receive transfer error %s %s\n", libusb_error_name(status), libusb_strerror(status));
+                LOG_WARNING("Re-issue receive transfer error %s %s", libusb_error_name(status), libusb_strerror(status));
             }
         } else {
-            printf("Transmitted %d bytes on EP %02X\n", transfer->actual_length, transfer->endpoint);
+            LOG_DEBUG("Transmitted %d bytes on EP %02X", transfer->actual_length, transfer->endpoint);
 
-            transfer->buffer[0] = 0;
-            // Free transfer
-            libusb_free_transfer(transfer);
+            // Return the buffer and transfer to their pools
+            md->completeOut(transfer);
         }
 
         break;
@@ -56,112 +339,384 @@ void Device::libusb_transfer_cb(struct libusb_transfer *transfer) {
     case LIBUSB_TRANSFER_ERROR:
 
         if (transfer->endpoint & 0x80) {
-            libusb_error status = (libusb_error) libusb_submit_transfer(transfer);
+            libusb_error status = md->m_closing ? LIBUSB_SUCCESS : (libusb_error) md->submit(transfer);
             if (status) {
-                printf("Re-issue receive transfer error %s %s\n", libusb_error_name(status), libusb_strerror(status));
+                LOG_WARNING("Re-issue receive transfer error %s %s", libusb_error_name(status), libusb_strerror(status));
             }
         } else {
-            transfer->buffer[0] = 0;
-
-            libusb_error status = (libusb_error) libusb_submit_transfer(transfer);
-            if (status) {
-                printf("Transmit transfer error %s %s\n", libusb_error_name(status), libusb_strerror(status));
+            // Nothing gets through a stalled endpoint until its halt is cleared
+            if (transfer->status == LIBUSB_TRANSFER_STALL && !md->m_closing) {
+                int status = md->m_transport->clearHalt(transfer->endpoint);
+                if (status)
+                    LOG_WARNING("Clear halt on EP %02X error %s", transfer->endpoint,
+                            libusb_error_name(status));
             }
 
-            // Free transfer
-            libusb_free_transfer(transfer);
+            bool retried = false;
+            if (context->retries < md->m_config.out_retries) {
+                context->retries++;
+                libusb_error status = (libusb_error) md->submit(transfer);
+                if (status)
+                    LOG_WARNING("Transmit transfer error %s %s", libusb_error_name(status), libusb_strerror(status));
+                retried = !status;
+            } else {
+                LOG_WARNING("Transmit transfer on EP %02X given up after %d retries, status %d", transfer->endpoint,
+                        context->retries, transfer->status);
+            }
+            if (!retried) {
+                // The transfer is only ours to release when it could not be retried
+                md->m_send_errors++;
+                md->completeOut(transfer);
+            }
         }
 
         break;
-
-        printf("Other USB STATUS %d\n", transfer->status);
-        break;
     case LIBUSB_TRANSFER_NO_DEVICE:
-        printf("LIBUSB_TRANSFER_NO_DEVICE\n");
+        LOG_INFO("LIBUSB_TRANSFER_NO_DEVICE");
+        if (!(transfer->endpoint & 0x80))
+            md->completeOut(transfer);
         break;
     case LIBUSB_TRANSFER_CANCELLED:
-        printf("LIBUSB_TRANSFER_CANCELLED\n");
+        LOG_INFO("LIBUSB_TRANSFER_CANCELLED");
+        if (!(transfer->endpoint & 0x80))
+            md->completeOut(transfer);
+        break;
+    default:
+        LOG_WARNING("Other USB STATUS %d", transfer->status);
+        if (!(transfer->endpoint & 0x80)) {
+            md->m_send_errors++;
+            md->completeOut(transfer);
+        }
         break;
     }
+
+    // Must be the last use of md, it might be destroyed as soon as all transfers have finished
+    md->callbackLeft();
 }
 
-void Device::process_recv_queue_code(Device *md) {
-    while (md->m_process_recv_queue_running) {
-        unique_lock < mutex > lk(md->m_process_recv_queue_mutex);
-        md->m_process_recv_queue_cv.wait(lk);
-        if (!md->m_process_recv_queue_running)
-            return;
+void Device::echo(Packet *packets, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        Packet &packet = packets[i];
+
+        // The handlers see the messages in the loaned buffer before it is sent on
+        if (m_parser)
+            m_parser->parse(packet.endpoint, packet.data, packet.length);
+
+        // For this demo, we return the data received. The loaned buffer is
+        // sent as is and goes back to the pool when the OUT transfer completes,
+        // a consumer that keeps the data must call releaseBuffer() instead.
+        m_echo_turnaround.record(
+                chrono::duration_cast < chrono::microseconds > (chrono::steady_clock::now() - packet.received).count());
+        if (m_coalescers[packet.endpoint & 0x0F])
+            coalesce(packet.endpoint, packet.data, packet.length);
+        else
+            sendBuffer(packet.endpoint, packet.data, packet.length);
+    }
+}
 
-        while (md->m_recv_queue.size()) {
-            auto data = md->m_recv_queue.front();
+void Device::scheduleRecv() {
+    if (!m_recv_scheduled.exchange(true))
+        m_executor->post([this]() {
+            processRecvQueue();
+        });
+}
 
-            // For this demo, we return the data received
-            //md->parse(*data.data(), data.data() + 1, data.size()-1);
-            md->send(*data.data(), data.data() + 1, data.size() - 1);
+size_t Device::sendRoom() {
+    size_t room = SIZE_MAX;
+    for (int i = 0; i < 16; i++) {
+        if (!m_send_queues[i])
+            continue;
+        size_t queue_room = m_send_queues[i]->room();
+        // A pending coalesced transfer can be sent on top of the packets
+        if (m_coalescers[i])
+            queue_room = queue_room > 1 ? queue_room - 1 : 0;
+        room = min(room, queue_room);
+    }
+    return room;
+}
 
-            md->m_recv_queue.pop_front();
+void Device::processRecvQueue() {
+    size_t batch_size = m_recv_batch.size();
+    bool deferred = false;
+    for (int i = 0; i < m_config.recv_batches_per_run && !m_recv_stopping; i++) {
+        size_t room = batch_size;
+        if (m_config.send_queue_full == DeviceConfig::SEND_QUEUE_BLOCK) {
+            room = min(room, sendRoom());
+            if (!room) {
+                // Flagged before looking again, so that a completion either
+                // finds the flag or has made room by now
+                m_recv_deferred = true;
+                room = min(batch_size, sendRoom());
+            }
+            if (!room) {
+                deferred = true;
+                break;
+            }
         }
+        size_t count = m_recv_queue.pop(m_recv_batch.data(), room);
+        if (!count)
+            break;
+
+        if (m_shared_ring)
+            for (size_t j = 0; j < count; j++) {
+                Packet &packet = m_recv_batch[j];
+                m_shared_ring->write(packet.endpoint, packet.data, packet.length,
+                        chrono::duration_cast < chrono::nanoseconds > (packet.received.time_since_epoch()).count());
+            }
+
+        // Everything that arrived since the last run is handed over at once
+        if (m_config.on_packets)
+            m_config.on_packets(*this, m_recv_batch.data(), count);
+        else
+            echo(m_recv_batch.data(), count);
+
+        // Under constant load the queue never runs dry, so the time budget
+        // has to be checked here as well
+        flushCoalescers(chrono::steady_clock::now());
+    }
+
+    // More to do, go to the back of the line so other devices get their turn
+    if (!m_recv_stopping && !deferred && !m_recv_queue.empty()) {
+        m_executor->post([this]() {
+            processRecvQueue();
+        });
+        return;
+    }
+
+    // Nothing left to join the pending coalesced transfers, those that are
+    // not due yet are flushed by a timer. When waiting for room, the run the
+    // next completion posts flushes them.
+    chrono::steady_clock::time_point deadline = chrono::steady_clock::time_point::max();
+    if (!m_recv_stopping && !deferred)
+        deadline = flushCoalescers(chrono::steady_clock::now());
+
+    unique_lock < mutex > lk(m_recv_mutex);
+    m_recv_scheduled = false;
+    if (m_recv_stopping) {
+        m_recv_cv.notify_all();
+        return;
+    }
+    // A packet pushed before the flag was cleared did not post a run, nor
+    // did a completion that cleared m_recv_deferred meanwhile
+    if (!m_recv_queue.empty() && (!deferred || !m_recv_deferred))
+        scheduleRecv();
+    else if (deadline != chrono::steady_clock::time_point::max() && !m_recv_timer_pending) {
+        m_recv_timer_pending = true;
+        m_executor->postAt(deadline, [this]() {
+            unique_lock < mutex > lk(m_recv_mutex);
+            m_recv_timer_pending = false;
+            if (!m_recv_stopping)
+                scheduleRecv();
+            m_recv_cv.notify_all();
+        });
     }
 }
 
-Device::Device(libusb_device_handle *handle) {
+#ifdef DEVICE_COROUTINES
+bool TransferAwaiter::await_suspend(coroutine_handle<> handle) {
     m_handle = handle;
-    m_device = libusb_get_device(handle);
+    struct libusb_transfer *xfr = m_device.m_transfer_pool.acquire();
+    TransferContext *context = TransferPool::context(xfr);
+    context->owner = &m_device;
+    context->waiter = this;
+    libusb_fill_bulk_transfer(xfr, m_device.m_transport->handle(), m_endpoint, m_buffer, (int) m_length,
+            Device::awaited_transfer_cb, context, m_device.m_config.timeout);
+
+    // Once submitted the coroutine can be resumed on the events thread before
+    // submit() even returns, so on success the awaiter must not be touched
+    int status = m_device.submit(xfr);
+    if (!status)
+        return true;
+    m_device.m_transfer_pool.release(xfr);
+    m_result.error = status;
+    return false;
+}
+
+void Device::awaited_transfer_cb(struct libusb_transfer *transfer) {
+    TransferContext *context = TransferPool::context(transfer);
+    Device *md = (Device*) context->owner;
+    TransferAwaiter *awaiter = (TransferAwaiter*) context->waiter;
+    md->callbackEntered(transfer);
+    EndpointMetrics *metrics = md->m_metrics[metricsIndex(transfer->endpoint)].get();
+    if (metrics)
+        metrics->record(transfer, context->submitted);
+    if (md->m_pcap)
+        md->m_pcap->completed(transfer);
+
+    awaiter->m_result.status = transfer->status;
+    awaiter->m_result.length = transfer->actual_length;
+    md->m_transfer_pool.release(transfer);
+
+    // The coroutine runs up to its next co_await from here, submitting its
+    // next transfer before this one counts as finished, so a close() in
+    // between cannot complete without it
+    awaiter->m_handle.resume();
+
+    // Must be the last use of md, it might be destroyed as soon as all transfers have finished
+    md->callbackLeft();
+}
+#endif
+
+Device::Device(libusb_device_handle *handle, const DeviceConfig &config) :
+        Device(unique_ptr<UsbTransport>(new LibusbTransport(handle)), config) {
+}
+
+Device::Device(unique_ptr<UsbTransport> transport, const DeviceConfig &config) :
+        m_transport(move(transport)), m_config(config), m_recv_queue(config.recv_queue_size), m_executor(
+                config.executor ? config.executor : &Executor::shared()), m_recv_batch(
+                config.recv_batch_size ? config.recv_batch_size : 1), m_buffer_pool(config.transfer_size,
+                config.buffer_pool_size ?
+                        config.buffer_pool_size :
+                        config.in_endpoints.size() * config.in_ring_depth + config.recv_queue_size + config.echo_seed_packets), m_transfer_pool(
+                config.transfer_pool_size) {
+    for (auto ep : m_config.out_endpoints) {
+        m_send_queues[ep & 0x0F].reset(new SendQueue(m_config.send_queue_size, m_config.max_out_in_flight));
+        m_metrics[metricsIndex(ep)].reset(new EndpointMetrics(ep));
+    }
+    for (auto ep : m_config.in_endpoints)
+        m_metrics[metricsIndex(ep)].reset(new EndpointMetrics(ep));
+    if (m_config.lock_memory && !m_buffer_pool.lock())
+        LOG_WARNING("Cannot lock the buffer pool in memory");
+
     int retval;
 
-    retval = libusb_claim_interface(handle, 0);
+    retval = m_transport->claimInterface(0);
     if (retval)
-        fprintf(stderr, "Error claiming interface %d: %s.\n", 0, libusb_strerror((libusb_error) retval));
-
-    struct libusb_device_descriptor device_desc;
-    retval = libusb_get_device_descriptor(m_device, &device_desc);
-
-    if (retval) {
-        printf("Error. Cannot Obtain Device Descriptor:%s %s\n Trying again...\n ", libusb_error_name(retval),
-                libusb_strerror((libusb_error) retval));
-        retval = libusb_get_device_descriptor(m_device, &device_desc);
-        if (retval) {
-            printf("Error. Cannot Obtain Device Descriptor:%s %s\n Bailing out...\n ", libusb_error_name(retval),
-                    libusb_strerror((libusb_error) retval));
-            return;
+        LOG_ERROR("Error claiming interface %d: %s.", 0, libusb_strerror((libusb_error) retval));
+
+    retval = m_transport->getSerial(sSerial, sizeof(sSerial));
+    if (retval < 0)
+        return;
+    iSerial = (int) strtol((const char*) sSerial, nullptr, 10);
+
+    if (!m_config.shared_ring_prefix.empty()) {
+        m_shared_ring.reset(
+                new SharedRingWriter(m_config.shared_ring_prefix + "-" + (const char*) sSerial,
+                        m_config.shared_ring_size));
+        if (!m_shared_ring->valid()) {
+            LOG_WARNING("Cannot create the shared ring of device %d", iSerial);
+            m_shared_ring.reset();
+        }
+    }
+    if (!m_config.capture_prefix.empty()) {
+        m_capture.reset(
+                new CaptureWriter(m_config.capture_prefix + "-" + (const char*) sSerial + ".cap",
+                        m_config.capture_size, (const char*) sSerial));
+        if (!m_capture->valid()) {
+            LOG_WARNING("Cannot create the capture file of device %d", iSerial);
+            m_capture.reset();
+        }
+    }
+    if (m_config.make_parser)
+        m_parser = m_config.make_parser(*this);
+    if (!m_config.pcap_prefix.empty()) {
+        libusb_device *device = m_transport->device();
+        m_pcap.reset(
+                new PcapWriter(m_config.pcap_prefix + "-" + (const char*) sSerial + ".pcap",
+                        device ? libusb_get_bus_number(device) : 0, device ? libusb_get_device_address(device) : 0));
+        if (!m_pcap->valid()) {
+            LOG_WARNING("Cannot create the pcap file of device %d", iSerial);
+            m_pcap.reset();
         }
     }
 
-    retval = libusb_get_string_descriptor_ascii(handle, device_desc.iSerialNumber, sSerial, sizeof(sSerial));
-    sscanf_s((const char*) sSerial, "%d", &iSerial);
-
-    m_transfer_in = libusb_alloc_transfer(0);
-
-    libusb_fill_bulk_transfer(m_transfer_in, handle, 0x81, m_recv_buffers, sizeof(m_recv_buffers), libusb_transfer_cb, this, 5000);
+    if (m_config.coalesce) {
+        vector<size_t> capacities;
+        size_t buffer_size = 0;
+        for (auto ep : m_config.out_endpoints) {
+            int max_packet_size = m_transport->getMaxPacketSize(ep);
+            if (max_packet_size <= 0)
+                max_packet_size = 64;
+            m_max_packet_sizes[ep & 0x0F] = max_packet_size;
+            size_t capacity = max_packet_size * m_config.coalesce_packets;
+            // A single payload must always fit
+            if (capacity < m_config.transfer_size + Coalescer::HEADER_SIZE)
+                capacity = m_config.transfer_size + Coalescer::HEADER_SIZE;
+            capacities.push_back(capacity);
+            if (capacity > buffer_size)
+                buffer_size = capacity;
+        }
+        // Enough for every send the send queues can hold, plus one pending per endpoint
+        size_t count = m_config.out_endpoints.size() * (m_config.max_out_in_flight + m_config.send_queue_size + 1);
+        m_coalesce_pool.reset(new BufferPool(buffer_size, count));
+        if (m_config.lock_memory && !m_coalesce_pool->lock())
+            LOG_WARNING("Cannot lock the coalesce buffer pool in memory");
+        for (size_t i = 0; i < m_config.out_endpoints.size(); i++)
+            m_coalescers[m_config.out_endpoints[i] & 0x0F].reset(
+                    new Coalescer(*m_coalesce_pool, capacities[i], chrono::microseconds(m_config.coalesce_budget_us)));
+    }
 
-    retval = libusb_submit_transfer(m_transfer_in);
-    if (retval)
-        fprintf(stderr, "Error submitting transfer 0x81: %s.\n", libusb_strerror((libusb_error) retval));
+    // Allocate the IN ring up front, every slot gets its own buffer from the
+    // pool so all transfers can be queued at the same time.
+    size_t ring_size = m_config.in_endpoints.size() * m_config.in_ring_depth;
+    m_transfers_in.reserve(ring_size);
+    for (size_t i = 0; i < ring_size; i++) {
+        uint8_t ep = m_config.in_endpoints[i / m_config.in_ring_depth];
+        struct libusb_transfer *xfr = TransferPool::allocate();
+        TransferPool::context(xfr)->owner = this;
+        libusb_fill_bulk_transfer(xfr, m_transport->handle(), ep, m_buffer_pool.acquire(),
+                m_config.transfer_size, libusb_transfer_cb, xfr->user_data, m_config.timeout);
+        m_transfers_in.push_back(xfr);
+    }
 
-    m_process_recv_queue_running = true;
-    m_process_recv_queue_thread = thread(process_recv_queue_code, this);
+    for (auto xfr : m_transfers_in) {
+        retval = submit(xfr);
+        if (retval)
+            LOG_ERROR("Error submitting transfer 0x%02X: %s.", xfr->endpoint, libusb_strerror((libusb_error) retval));
+    }
 
-    send(0x01, m_recv_buffers, sizeof(m_recv_buffers));
+    // Firmware that splits coalesced transfers expects the seed packets
+    // coalesced as well. They are packed apart from the endpoint's own
+    // Coalescer, which the packet processing may be using by now.
+    vector<uint8_t> seed(m_config.transfer_size);
+    Coalescer *coalescer = m_coalescers[0x01].get();
+    if (coalescer) {
+        Coalescer seeds(*m_coalesce_pool, coalescer->capacity(), chrono::microseconds(0));
+        for (int i = 0; i < m_config.echo_seed_packets; i++) {
+            if (seeds.full(seed.size())) {
+                size_t size;
+                uint8_t *buffer = seeds.take(size);
+                sendBuffer(0x01, buffer, size);
+            }
+            seeds.add(seed.data(), seed.size());
+        }
+        size_t size;
+        uint8_t *buffer = seeds.take(size);
+        if (buffer)
+            sendBuffer(0x01, buffer, size);
+    } else {
+        for (int i = 0; i < m_config.echo_seed_packets; i++)
+            send(0x01, seed.data(), seed.size());
+    }
 }
 
 Device::~Device() {
-    printf("Device::~Device()\n");
-    fflush (stdout);
+    LOG_INFO("Device::~Device()");
+
+    // Normally close() has finished by now. Otherwise wait for the
+    // cancellations, this needs the events thread to keep running. Once
+    // closed no transfer calls back, so no more packet processing is posted.
+    close(nullptr);
+    {
+        unique_lock < mutex > lk(m_in_flight_mutex);
+        m_closed_cv.wait(lk, [this] {
+            return m_closed;
+        });
+    }
 
-    printf("Stopping Receive Thread\n");
-    fflush(stdout);
-    if (m_process_recv_queue_running) {
-        m_process_recv_queue_running = false;
-        m_process_recv_queue_cv.notify_all();
-        m_process_recv_queue_thread.join();
+    LOG_INFO("Stopping packet processing");
+    {
+        unique_lock < mutex > lk(m_recv_mutex);
+        m_recv_stopping = true;
+        m_recv_cv.wait(lk, [this] {
+            return !m_recv_scheduled && !m_recv_timer_pending;
+        });
     }
 
-    printf("Cancelling receive transfer\n");
-    fflush(stdout);
-    libusb_cancel_transfer(m_transfer_in);
-    libusb_free_transfer(m_transfer_in);
+    // None of the transfers is in flight any more
+    for (auto xfr : m_transfers_in)
+        TransferPool::destroy(xfr);
 
-    printf("Releasing Interface\n");
-    fflush(stdout);
-    libusb_release_interface(m_handle, 0);
+    LOG_INFO("Releasing Interface");
+    m_transport->releaseInterface(0);
 }
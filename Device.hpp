@@ -6,40 +6,325 @@ extern "C" {
 #include <vector>
 #include <mutex>
 #include <condition_variable>
-#include <deque>
 #include <string>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <functional>
+
+#include "SpscQueue.hpp"
+#include "BufferPool.hpp"
+#include "TransferPool.hpp"
+#include "SendQueue.hpp"
+#include "Coalescer.hpp"
+#include "UsbTransport.hpp"
+#include "Metrics.hpp"
+#include "Executor.hpp"
+#include "TransferAwaiter.hpp"
+#include "SharedRing.hpp"
+#include "Capture.hpp"
+#include "PcapWriter.hpp"
+#include "FrameParser.hpp"
 
 using namespace std;
 
+class Device;
+
+// A received packet as passed from the libusb events thread to the packet processing task.
+// data points to a buffer loaned from the device's buffer pool, the consumer
+// either sends it on with sendBuffer() or returns it with releaseBuffer().
+struct Packet {
+    uint8_t endpoint;
+    uint16_t length;
+    uint8_t *data;
+    // When the IN transfer completed
+    chrono::steady_clock::time_point received;
+};
+
+struct DeviceConfig {
+    // IN endpoints on which a ring of transfers is kept queued
+    vector<uint8_t> in_endpoints = { 0x81 };
+
+    // Number of IN transfers kept queued per endpoint. With more than one
+    // transfer pending the host controller can complete the next packet
+    // while we are still handling the previous one.
+    int in_ring_depth = 4;
+
+    // Size of each IN transfer buffer
+    int transfer_size = 60;
+
+    // Number of packets sent on OUT1 at start up to get the echo loop going.
+    // A single packet keeps one packet circulating, to benefit from a deeper
+    // ring there must be more packets in the loop.
+    int echo_seed_packets = 1;
+
+    // Number of packets the receive queue can hold before packets are dropped
+    size_t recv_queue_size = 1024;
+
+    // Maximum number of packets handed to the consumer in one call
+    size_t recv_batch_size = 64;
+
+    // Consumer of received packets, called on the executor with all packets
+    // taken from the receive queue in one go (see Packet for the ownership of
+    // the data). Calls for one device never overlap and see the packets in
+    // the order they were received. When not set the packets are echoed back.
+    function<void(Device &device, Packet *packets, size_t count)> on_packets;
+
+    // Number of transfer buffers in the pool. 0 sizes the pool to cover the
+    // IN ring, a full receive queue and the seed packets.
+    size_t buffer_pool_size = 0;
+
+    // Number of pre-allocated OUT transfers. Sends beyond this number of
+    // transfers in flight fall back to allocating one.
+    size_t transfer_pool_size = 64;
+
+    // OUT endpoints that can be sent to, each gets its own send queue
+    vector<uint8_t> out_endpoints = { 0x01 };
+
+    // Maximum number of OUT transfers in flight per endpoint. Further sends
+    // wait in the endpoint's send queue until a transfer completes.
+    int max_out_in_flight = 8;
+
+    // Number of sends that can wait for a credit per endpoint
+    size_t send_queue_size = 256;
+
+    // What to do with a send when the send queue is full: block the sender
+    // until a transfer completes, or drop the send and count it. Blocking
+    // would hold up an executor worker and every device behind it, so sends
+    // made on a worker are dropped instead, and the packet processing only
+    // takes as many packets off the receive queue as the send queues have
+    // room for. The rest waits there for a transfer to complete.
+    enum SendQueueFull {
+        SEND_QUEUE_BLOCK, SEND_QUEUE_DROP
+    } send_queue_full = SEND_QUEUE_BLOCK;
+
+    // Pack echoed payloads into larger OUT transfers, each payload preceded by
+    // its length (see Coalescer). Off by default as the firmware has to split them.
+    // A coalesced transfer whose length is a multiple of the endpoint's
+    // wMaxPacketSize ends without a short packet, so it is sent with
+    // LIBUSB_TRANSFER_ADD_ZERO_PACKET for the firmware to see where it ends.
+    // libusb only supports that on Linux, elsewhere the first refused
+    // submission turns it off and the firmware has to do without.
+    bool coalesce = false;
+
+    // Maximum size of a coalesced transfer, in max-size packets of the endpoint
+    int coalesce_packets = 8;
+
+    // How long a payload may wait for others to join it. With 0 whatever has
+    // been collected is sent as soon as the receive queue runs dry.
+    unsigned int coalesce_budget_us = 0;
+
+    unsigned int timeout = 5000;
+
+    // Times an OUT transfer that stalled, timed out or failed is submitted
+    // again before its send is given up and counted in send_errors. A
+    // stalled endpoint has its halt cleared first, on the libusb events
+    // thread, as it does when the send is given up.
+    int out_retries = 3;
+
+    // Runs the packet processing, Executor::shared() when not set. Must
+    // outlive the device.
+    Executor *executor = nullptr;
+
+    // Batches handled per run of the packet processing task before it makes
+    // way for the tasks of other devices
+    int recv_batches_per_run = 4;
+
+    // Pre-fault the buffer pools and lock them in memory (see BufferPool::lock)
+    bool lock_memory = false;
+
+    // When set every received packet is also written to a SharedRing named
+    // <prefix>-<serial>, for other processes to read, before it is handed
+    // to the consumer
+    string shared_ring_prefix;
+    size_t shared_ring_size = 1 << 20;
+
+    // When set every transfer completion is appended to the capture file
+    // <prefix>-<serial>.cap (see CaptureWriter), which ReplayTransport plays
+    // back. capture_size bounds the file, later completions are dropped.
+    string capture_prefix;
+    size_t capture_size = 256 << 20;
+
+    // When set every submission and completion is also written to
+    // <prefix>-<serial>.pcap in the usbmon format Wireshark reads (see PcapWriter)
+    string pcap_prefix;
+
+    // Sets up the parser the default consumer runs the received data through
+    // before echoing it, with its format and message handlers. Called once
+    // per device. When not set the data is not decoded.
+    function<unique_ptr<FrameParser>(Device &device)> make_parser;
+};
+
 class Device {
 public:
-    Device(libusb_device_handle *handle);
+    Device(libusb_device_handle *handle, const DeviceConfig &config = DeviceConfig());
+    // For a device that is not opened through libusb, such as LoopbackTransport
+    Device(unique_ptr<UsbTransport> transport, const DeviceConfig &config = DeviceConfig());
     ~Device();static void LIBUSB_CALL libusb_transfer_cb(struct libusb_transfer* transfer);
 
     int getSerial() {
         return iSerial;
     }
+    // nullptr when the transport has no libusb device
     libusb_device* getLibUsbDevice() {
-        return m_device;
+        return m_transport->device();
+    }
+    const TransferPool& getTransferPool() const {
+        return m_transfer_pool;
+    }
+    // Returns nullptr for endpoints that are not in DeviceConfig::out_endpoints
+    SendQueue* getSendQueue(int ep) {
+        return m_send_queues[ep & 0x0F].get();
+    }
+    // Can be called from any thread
+    MetricsSnapshot metrics() const;
+
+    // Cancels every transfer in flight, for when the device is gone. Returns
+    // right away, on_closed is called once the last transfer has called back,
+    // usually on the libusb events thread. The device must not be destroyed
+    // before then, and not from within on_closed: on_closed must not hold the
+    // last reference to it either, or destroying on_closed destroys it.
+    void close(function<void()> on_closed);
+
+    // nullptr unless DeviceConfig::make_parser is set
+    FrameParser* getParser() {
+        return m_parser.get();
+    }
+
+    // Returns nullptr unless coalescing is enabled
+    const Coalescer* getCoalescer(int ep) const {
+        return m_coalescers[ep & 0x0F].get();
+    }
+
+    // Sends a pooled buffer without copying, the buffer returns to the pool on completion.
+    // Subject to the flow control of the endpoint's send queue.
+    void sendBuffer(int ep, uint8_t *buffer, size_t size);
+    // Returns a buffer loaned by the receive path to the pool
+    void releaseBuffer(uint8_t *buffer);
+
+#ifdef DEVICE_COROUTINES
+    // Transfers for coroutines, see TransferAwaiter. The buffer is used as is
+    // and must stay valid until the transfer completes. Reads are meant for
+    // endpoints that are not in DeviceConfig::in_endpoints, writes bypass the
+    // send queue. Closing the device completes them as cancelled.
+    TransferAwaiter read(uint8_t ep, span<uint8_t> buffer) {
+        return TransferAwaiter(*this, ep | 0x80, buffer.data(), buffer.size());
     }
+    TransferAwaiter write(uint8_t ep, span<const uint8_t> data) {
+        return TransferAwaiter(*this, ep & 0x7F, const_cast<uint8_t*>(data.data()), data.size());
+    }
+#endif
 private:
-    libusb_device_handle *m_handle = nullptr;
-    libusb_device *m_device = nullptr;
+#ifdef DEVICE_COROUTINES
+    friend class TransferAwaiter;
+    static void LIBUSB_CALL awaited_transfer_cb(struct libusb_transfer *transfer);
+#endif
+
+    unique_ptr<UsbTransport> m_transport;
 
-    struct libusb_transfer *m_transfer_in = nullptr;
+    DeviceConfig m_config;
+
+    // Ring of IN transfers, in_ring_depth transfers for each configured endpoint.
+    // Each transfer holds a buffer from m_buffer_pool.
+    vector<struct libusb_transfer*> m_transfers_in;
 
-    uint8_t m_recv_buffers[60];
     uint8_t sSerial[20];
-    int iSerial;
-    mutex m_process_recv_queue_mutex;
-    condition_variable m_process_recv_queue_cv;
-    deque<vector<uint8_t>> m_recv_queue;
+    int iSerial = 0;
+
+    // Filled by libusb_transfer_cb, drained in batches by processRecvQueue(),
+    // which runs on the executor. At most one run is posted at a time, which
+    // keeps the packets of the device in order and the queue single consumer.
+    // Pushing a packet only posts a run when none is posted yet, and never locks.
+    SpscQueue<Packet> m_recv_queue;
+    atomic<uint64_t> m_recv_dropped { 0 };
+    Executor *m_executor;
+    vector<Packet> m_recv_batch;
+    atomic<bool> m_recv_scheduled { false };
+    // Set when a timer is posted to flush the coalescers once they are due
+    bool m_recv_timer_pending = false;
+    // Guards m_recv_timer_pending and m_recv_stopping, the destructor waits
+    // on m_recv_cv for the last run and timer
+    mutex m_recv_mutex;
+    condition_variable m_recv_cv;
+    atomic<bool> m_recv_stopping { false };
+    // Set by a run that left packets queued because a send queue was full,
+    // the next OUT completion posts a run again
+    atomic<bool> m_recv_deferred { false };
 
-    bool m_process_recv_queue_running;
-    thread m_process_recv_queue_thread;
+    // Written by processRecvQueue(), so never from two threads at once
+    unique_ptr<SharedRingWriter> m_shared_ring;
+    // Appended to by libusb_transfer_cb
+    unique_ptr<CaptureWriter> m_capture;
+    unique_ptr<PcapWriter> m_pcap;
+    // Used by echo()
+    unique_ptr<FrameParser> m_parser;
 
+    BufferPool m_buffer_pool;
+    TransferPool m_transfer_pool;
+    unique_ptr<SendQueue> m_send_queues[16];
+    atomic<uint64_t> m_send_dropped { 0 };
+    atomic<uint64_t> m_send_errors { 0 };
+
+    // Indexed by metricsIndex(), only present for configured endpoints
+    unique_ptr<EndpointMetrics> m_metrics[32];
+    Histogram m_echo_turnaround;
+
+    static int metricsIndex(uint8_t ep) {
+        return (ep & 0x0F) | ((ep & 0x80) >> 3);
+    }
+    // Stamps the transfer with the submit time for the latency metrics and
+    // adds it to m_in_flight. Fails once the device is closing.
+    int submit(struct libusb_transfer *transfer);
+
+    // Every transfer submitted and not yet called back, so close() can cancel
+    // them all. A transfer is removed when its callback starts, the callback
+    // itself is counted in m_active_callbacks until it is done with the device.
+    mutex m_in_flight_mutex;
+    vector<struct libusb_transfer*> m_in_flight;
+    int m_active_callbacks = 0;
+    atomic<bool> m_closing { false };
+    bool m_closed = false;
+    condition_variable m_closed_cv;
+    function<void()> m_on_closed;
+
+    void callbackEntered(struct libusb_transfer *transfer);
+    void callbackLeft();
+    // Finishes closing when nothing is in flight any more, unlocks lk when it does
+    void checkClosed(unique_lock<mutex> &lk);
+
+    // Coalesced transfers are larger than received packets, so they get
+    // buffers from a pool of their own
+    unique_ptr<BufferPool> m_coalesce_pool;
+    unique_ptr<Coalescer> m_coalescers[16];
+    // wMaxPacketSize of the endpoints that coalesce, for the zero length packets
+    int m_max_packet_sizes[16] = { };
+    // Cleared when the transport refuses LIBUSB_TRANSFER_ADD_ZERO_PACKET
+    atomic<bool> m_zero_packets { true };
+
+    // Copies data into a pooled buffer and sends it
     void send(int ep, void *data, size_t size);
+    // As the public one, for a send requested earlier, such as a coalesced
+    // transfer whose first payload has been waiting since queued
+    void sendBuffer(int ep, uint8_t *buffer, size_t size, chrono::steady_clock::time_point queued);
+    // Submits a send that holds a credit
+    void submitOut(int ep, PendingSend pending);
+    // Finishes an OUT transfer and hands its credit on
+    void completeOut(struct libusb_transfer *transfer);
+    // Copies a loaned buffer into the endpoint's pending coalesced transfer and returns it
+    void coalesce(int ep, uint8_t *buffer, size_t size);
+    // Sends the coalesced transfers that are past their time budget, returns
+    // the earliest deadline of those still pending
+    chrono::steady_clock::time_point flushCoalescers(chrono::steady_clock::time_point now);
+    // Returns a finished OUT transfer and its buffer to the pools
+    void releaseOutTransfer(struct libusb_transfer *transfer);
 
-    static void process_recv_queue_code(Device *mc);
-};
+    // Default consumer, sends the packets back
+    void echo(Packet *packets, size_t count);
 
+    // Posts a run of processRecvQueue() unless one is posted already
+    void scheduleRecv();
+    void processRecvQueue();
+    // Number of packets the packet processing can echo without a send queue
+    // overflowing, see DeviceConfig::send_queue_full
+    size_t sendRoom();
+};
@@ -0,0 +1,175 @@
+#include "DeviceIdentity.hpp"
+
+#include <string.h>
+
+static char lowerCase(char c) {
+    return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+// Windows is case-insensitive and actually might use different cases when called during start up and hotplug events
+static bool startsWith(const char *p, const char *end, const char *prefix) {
+    for (; *prefix; p++, prefix++)
+        if (p == end || lowerCase(*p) != lowerCase(*prefix))
+            return false;
+    return true;
+}
+
+// At least one, at most max_digits hex digits
+static bool parseHex(const char *&p, const char *end, int max_digits, uint16_t &value) {
+    value = 0;
+    int digits = 0;
+    for (; p != end && digits < max_digits; p++, digits++) {
+        char c = lowerCase(*p);
+        if (c >= '0' && c <= '9')
+            value = value << 4 | (c - '0');
+        else if (c >= 'a' && c <= 'f')
+            value = value << 4 | (c - 'a' + 10);
+        else
+            break;
+    }
+    return digits > 0;
+}
+
+static bool copy(char *destination, size_t capacity, const char *begin, const char *end) {
+    size_t length = end - begin;
+    if (length >= capacity)
+        return false;
+    memcpy(destination, begin, length);
+    destination[length] = 0;
+    return true;
+}
+
+bool parseWindowsInterfacePath(const char *path, size_t length, DeviceIdentity &identity) {
+    const char *p = path;
+    const char *end = (const char*) memchr(path, 0, length);
+    if (!end)
+        end = path + length;
+    identity = DeviceIdentity();
+
+    if (startsWith(p, end, "\\\\?\\") || startsWith(p, end, "\\??\\"))
+        p += 4;
+    if (!startsWith(p, end, "USB#"))
+        return false; // Not a USB device
+    p += 4;
+
+    // Hardware id, VID_DEAD&PID_BEEF, followed by &MI_00 for an interface of
+    // a composite device
+    bool vid = false, pid = false;
+    while (p != end && *p != '#') {
+        if (startsWith(p, end, "VID_")) {
+            p += 4;
+            vid = parseHex(p, end, 4, identity.vid);
+        } else if (startsWith(p, end, "PID_")) {
+            p += 4;
+            pid = parseHex(p, end, 4, identity.pid);
+        }
+        while (p != end && *p != '&' && *p != '#')
+            p++;
+        if (p != end && *p == '&')
+            p++;
+    }
+    if (!vid || !pid)
+        return false;
+
+    // Instance id, the serial number of the device. For devices without one
+    // Windows makes one up, those contain a '&'.
+    if (p != end)
+        p++;
+    const char *instance = p;
+    while (p != end && *p != '#')
+        p++;
+    if (!memchr(instance, '&', p - instance) && !copy(identity.serial, sizeof(identity.serial), instance, p))
+        return false;
+    return true;
+}
+
+// Name of a USB device in sysfs, "1-2.3". The name of an interface has its
+// configuration and interface number added, "1-2.3:1.0", which is dropped.
+static void parseDevpath(const char *begin, const char *end, DeviceIdentity &identity) {
+    const char *name = begin;
+    for (const char *p = begin; p != end; p++)
+        if (*p == '/')
+            name = p + 1;
+    const char *name_end = (const char*) memchr(name, ':', end - name);
+    if (!name_end)
+        name_end = end;
+
+    // Root hubs are named usb1, usb2, ...
+    if (name == name_end || !memchr(name, '-', name_end - name))
+        return;
+    for (const char *p = name; p != name_end; p++)
+        if ((*p < '0' || *p > '9') && *p != '-' && *p != '.')
+            return;
+    copy(identity.port_path, sizeof(identity.port_path), name, name_end);
+}
+
+// prefix, hex VID, separator, hex PID
+static bool parseVidPid(const char *p, const char *end, const char *prefix, char separator, DeviceIdentity &identity) {
+    uint16_t vid, pid;
+    if (!startsWith(p, end, prefix))
+        return false;
+    p += strlen(prefix);
+    if (!parseHex(p, end, 4, vid) || p == end || lowerCase(*p++) != separator || !parseHex(p, end, 4, pid))
+        return false;
+    identity.vid = vid;
+    identity.pid = pid;
+    return true;
+}
+
+static void parseAction(const char *begin, const char *end, DeviceIdentity &identity) {
+    if (end - begin == 3 && !memcmp(begin, "add", 3))
+        identity.action = DeviceIdentity::ADD;
+    else if (end - begin == 6 && !memcmp(begin, "remove", 6))
+        identity.action = DeviceIdentity::REMOVE;
+}
+
+bool parseUevent(const char *uevent, size_t length, DeviceIdentity &identity) {
+    const char *p = uevent;
+    const char *end = uevent + length;
+    identity = DeviceIdentity();
+
+    bool product = false, modalias = false;
+    while (p != end) {
+        const char *line = p;
+        while (p != end && *p && *p != '\n')
+            p++;
+        const char *line_end = p;
+        if (p != end)
+            p++;
+
+        const char *equals = (const char*) memchr(line, '=', line_end - line);
+        if (!equals) {
+            // Netlink header, add@/devices/pci0000:00/0000:00:14.0/usb1/1-2
+            const char *at = (const char*) memchr(line, '@', line_end - line);
+            if (at) {
+                parseAction(line, at, identity);
+                parseDevpath(at + 1, line_end, identity);
+            }
+            continue;
+        }
+
+        const char *value = equals + 1;
+        size_t key = equals - line;
+        if (key == 6 && !memcmp(line, "ACTION", 6)) {
+            parseAction(value, line_end, identity);
+        } else if (key == 7 && !memcmp(line, "DEVPATH", 7)) {
+            parseDevpath(value, line_end, identity);
+        } else if (key == 7 && !memcmp(line, "PRODUCT", 7)) {
+            // dead/beef/100, hex without leading zeros
+            product = parseVidPid(value, line_end, "", '/', identity);
+        } else if (key == 8 && !memcmp(line, "MODALIAS", 8) && !product) {
+            // usb:vDEADpBEEFd0100dc00...
+            modalias = parseVidPid(value, line_end, "usb:v", 'p', identity);
+        } else if (key == 15 && !memcmp(line, "ID_SERIAL_SHORT", 15)) {
+            if (!copy(identity.serial, sizeof(identity.serial), value, line_end))
+                identity.serial[0] = 0;
+        }
+    }
+    return product || modalias;
+}
+
+bool parseDeviceIdentity(const char *s, size_t length, DeviceIdentity &identity) {
+    if (length && (s[0] == '\\' || startsWith(s, s + length, "USB#")))
+        return parseWindowsInterfacePath(s, length, identity);
+    return parseUevent(s, length, identity);
+}
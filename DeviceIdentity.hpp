@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Identity of a USB device as found in a device notification
+struct DeviceIdentity {
+    enum Action {
+        UNKNOWN, ADD, REMOVE
+    };
+
+    // A string descriptor holds at most 126 characters
+    static const size_t MAX_SERIAL = 126;
+    static const size_t MAX_PORT_PATH = 31;
+
+    Action action = UNKNOWN;
+    uint16_t vid = 0;
+    uint16_t pid = 0;
+    // Empty when the notification does not carry one
+    char serial[MAX_SERIAL + 1] = { };
+    // Bus number and port numbers, as DeviceRegistry::portPath(). Empty when
+    // the notification does not carry one.
+    char port_path[MAX_PORT_PATH + 1] = { };
+};
+
+// Parsers for device notifications
+//
+// They read no further than length, stop at a NUL where that ends the
+// string, and never allocate. They return false when the string does not
+// describe a USB device with a VID and PID, identity is then unspecified.
+
+// Windows device interface path, such as
+// "\\?\USB#VID_DEAD&PID_BEEF#F6D0D4CE5854242A#{a5dcbf10-6530-11d2-901f-00c04fb951ed}"
+bool parseWindowsInterfacePath(const char *path, size_t length, DeviceIdentity &identity);
+
+// Linux uevent, either a netlink message ("add@/devices/...", then
+// KEY=VALUE fields separated by NULs) or the contents of a sysfs uevent file
+// (KEY=VALUE lines). Uses ACTION, PRODUCT or MODALIAS, DEVPATH and, when
+// udev added it, ID_SERIAL_SHORT.
+bool parseUevent(const char *uevent, size_t length, DeviceIdentity &identity);
+
+// Either of the above, whichever the string looks like
+bool parseDeviceIdentity(const char *s, size_t length, DeviceIdentity &identity);
@@ -0,0 +1,34 @@
+#include "DeviceRegistry.hpp"
+
+#include <stdio.h>
+
+bool DeviceRegistry::insert(shared_ptr<Device> device) {
+    if (!m_by_device.insert(device->getLibUsbDevice(), device))
+        return false;
+    // Secondary keys are best effort, a later device with the same serial or
+    // port path replaces an earlier one. Readers see one or the other, never
+    // a missing key.
+    m_by_serial.assign(device->getSerial(), device);
+    m_by_port_path.assign(portPath(device->getLibUsbDevice()), device);
+    return true;
+}
+
+shared_ptr<Device> DeviceRegistry::remove(libusb_device *dev) {
+    shared_ptr<Device> device = m_by_device.erase(dev);
+    if (!device)
+        return nullptr;
+    // Only remove the secondary keys when they still refer to this device
+    m_by_serial.erase(device->getSerial(), device);
+    m_by_port_path.erase(portPath(dev), device);
+    return device;
+}
+
+string DeviceRegistry::portPath(libusb_device *dev) {
+    uint8_t ports[8];
+    int count = libusb_get_port_numbers(dev, ports, sizeof(ports));
+    char buffer[64];
+    int length = snprintf(buffer, sizeof(buffer), "%d", libusb_get_bus_number(dev));
+    for (int i = 0; i < count; i++)
+        length += snprintf(buffer + length, sizeof(buffer) - length, i ? ".%d" : "-%d", ports[i]);
+    return buffer;
+}
@@ -0,0 +1,57 @@
+#pragma once
+extern "C" {
+#include "libusb.h"
+}
+
+#include <functional>
+#include <memory>
+#include <string>
+
+#include "Device.hpp"
+#include "ShardedMap.hpp"
+
+using namespace std;
+
+// The devices currently in use, indexed by libusb device, serial number and
+// port path
+//
+// Lookups take no lock and may be done from any thread, see ShardedMap. A
+// Device stays alive as long as someone holds the shared_ptr returned by a
+// lookup, so a device removed on the hotplug thread is not destroyed under a
+// reader. Changes wait for the lookups under way, they belong on the hotplug
+// thread.
+class DeviceRegistry {
+public:
+    // Returns false when the libusb device is already registered
+    bool insert(shared_ptr<Device> device);
+    // Returns the removed device, nullptr when it was not registered
+    shared_ptr<Device> remove(libusb_device *dev);
+
+    shared_ptr<Device> findByDevice(libusb_device *dev) const {
+        return m_by_device.find(dev);
+    }
+    shared_ptr<Device> findBySerial(int serial) const {
+        return m_by_serial.find(serial);
+    }
+    shared_ptr<Device> findByPortPath(const string &path) const {
+        return m_by_port_path.find(path);
+    }
+
+    size_t size() const {
+        return m_by_device.size();
+    }
+
+    void forEach(const function<void(const shared_ptr<Device>&)> &f) const {
+        m_by_device.forEach([&f](libusb_device*, const shared_ptr<Device> &device) {
+            f(device);
+        });
+    }
+
+    // Bus number and port numbers of a device, as "1-2.3"
+    static string portPath(libusb_device *dev);
+
+private:
+    ShardedMap<libusb_device*, shared_ptr<Device>> m_by_device;
+    ShardedMap<int, shared_ptr<Device>> m_by_serial;
+    ShardedMap<string, shared_ptr<Device>> m_by_port_path;
+};
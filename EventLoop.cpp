@@ -0,0 +1,173 @@
+#include "EventLoop.hpp"
+
+#include <chrono>
+#include "Log.hpp"
+#include "CpuAffinity.hpp"
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+
+EventLoop::EventLoop(libusb_context *ctx, const EventLoopConfig &config) :
+        m_ctx(ctx), m_config(config) {
+#ifdef __linux__
+    m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    m_wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    struct epoll_event event = { };
+    event.events = EPOLLIN;
+    event.data.fd = m_wakeup_fd;
+    epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_wakeup_fd, &event);
+
+    // Register the descriptors libusb already has, and follow the ones it adds later
+    const struct libusb_pollfd **pollfds = libusb_get_pollfds(m_ctx);
+    if (pollfds) {
+        for (int i = 0; pollfds[i]; i++)
+            pollfdAdded(pollfds[i]->fd, pollfds[i]->events, this);
+        libusb_free_pollfds(pollfds);
+    }
+    libusb_set_pollfd_notifiers(m_ctx, pollfdAdded, pollfdRemoved, this);
+#endif
+}
+
+EventLoop::~EventLoop() {
+    stop();
+#ifdef __linux__
+    libusb_set_pollfd_notifiers(m_ctx, nullptr, nullptr, nullptr);
+    close(m_wakeup_fd);
+    close(m_epoll_fd);
+#endif
+}
+
+#ifdef __linux__
+void EventLoop::pollfdAdded(int fd, short events, void *user_data) {
+    EventLoop *loop = (EventLoop*) user_data;
+    struct epoll_event event = { };
+    if (events & POLLIN)
+        event.events |= EPOLLIN;
+    if (events & POLLOUT)
+        event.events |= EPOLLOUT;
+    event.data.fd = fd;
+    if (epoll_ctl(loop->m_epoll_fd, EPOLL_CTL_ADD, fd, &event))
+        epoll_ctl(loop->m_epoll_fd, EPOLL_CTL_MOD, fd, &event);
+}
+
+void EventLoop::pollfdRemoved(int fd, void *user_data) {
+    EventLoop *loop = (EventLoop*) user_data;
+    epoll_ctl(loop->m_epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+}
+#endif
+
+void EventLoop::start() {
+    if (m_running)
+        return;
+    m_running = true;
+    m_thread = thread(&EventLoop::run, this);
+}
+
+void EventLoop::stop() {
+    if (!m_running)
+        return;
+    m_running = false;
+    wakeup();
+    m_thread.join();
+
+    unique_lock < mutex > lk(m_tasks_mutex);
+    m_tasks.clear();
+}
+
+void EventLoop::post(function<void()> task) {
+    {
+        unique_lock < mutex > lk(m_tasks_mutex);
+        m_tasks.push_back(move(task));
+    }
+    wakeup();
+}
+
+void EventLoop::wakeup() {
+#ifdef __linux__
+    uint64_t one = 1;
+    if (write(m_wakeup_fd, &one, sizeof(one)) != sizeof(one))
+        LOG_ERROR("Error waking up event loop.");
+#else
+    libusb_interrupt_event_handler(m_ctx);
+#endif
+}
+
+void EventLoop::runTasks() {
+    vector<function<void()>> pending;
+    {
+        unique_lock < mutex > lk(m_tasks_mutex);
+        pending.swap(m_tasks);
+    }
+    for (auto &task : pending)
+        task();
+    tasks.fetch_add(pending.size(), memory_order_relaxed);
+}
+
+int EventLoop::waitTimeout() {
+    int timeout = m_config.timeout_ms;
+    struct timeval tv;
+    if (libusb_get_next_timeout(m_ctx, &tv) == 1) {
+        int due = int(tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000);
+        if (due < timeout)
+            timeout = due;
+    }
+    return timeout;
+}
+
+void EventLoop::run() {
+    if (m_config.cpu >= 0 && !pinCurrentThread(m_config.cpu))
+        LOG_WARNING("Cannot pin the event thread to cpu %d", m_config.cpu);
+    if (m_config.realtime_priority > 0 && !setRealtimePriority(m_config.realtime_priority))
+        LOG_WARNING("Cannot give the event thread real-time priority %d", m_config.realtime_priority);
+
+    while (m_running) {
+        int timeout = waitTimeout();
+        auto begin = chrono::steady_clock::now();
+        bool handle = false;
+
+#ifdef __linux__
+        struct epoll_event ready[16];
+        int count = epoll_wait(m_epoll_fd, ready, 16, timeout);
+        for (int i = 0; i < count; i++) {
+            if (ready[i].data.fd == m_wakeup_fd) {
+                uint64_t value;
+                if (read(m_wakeup_fd, &value, sizeof(value)) != sizeof(value))
+                    LOG_ERROR("Error reading event loop wake up.");
+            } else {
+                handle = true;
+            }
+        }
+        // Nothing ready means a libusb timeout might be due
+        if (!count)
+            handle = true;
+        auto woken = chrono::steady_clock::now();
+
+        if (handle) {
+            struct timeval zero = { 0, 0 };
+            libusb_handle_events_timeout_completed(m_ctx, &zero, nullptr);
+        }
+#else
+        struct timeval tv = { long(timeout / 1000), long(timeout % 1000) * 1000 };
+        // This is where the crash might occur when there is a transfer active when unplugging the device.
+        // The crash occurs in windows_winusb.c line 1890
+        // winusb_get_transfer_fd(usbi_transfer * itransfer)
+        libusb_handle_events_timeout_completed(m_ctx, &tv, nullptr);
+        handle = true;
+        auto woken = chrono::steady_clock::now();
+#endif
+
+        runTasks();
+        auto end = chrono::steady_clock::now();
+
+        iterations.fetch_add(1, memory_order_relaxed);
+        if (handle)
+            events.fetch_add(1, memory_order_relaxed);
+        blocked.record(chrono::duration_cast < chrono::microseconds > (woken - begin).count());
+        dispatch.record(chrono::duration_cast < chrono::microseconds > (end - woken).count());
+    }
+}
@@ -0,0 +1,88 @@
+#pragma once
+extern "C" {
+#include "libusb.h"
+}
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+#include "Histogram.hpp"
+
+using namespace std;
+
+struct EventLoopConfig {
+    // Longest time to block waiting for events. A libusb timeout that is due
+    // earlier takes precedence. Shorter values only matter for the fallback
+    // backend, the epoll backend is woken up for tasks and shutdown.
+    unsigned int timeout_ms = 100;
+
+    // Core to pin the event thread to, -1 for none
+    int cpu = -1;
+
+    // SCHED_FIFO priority of the event thread (see setRealtimePriority), 0
+    // for normal scheduling
+    int realtime_priority = 0;
+};
+
+// Thread running libusb event handling
+//
+// On Linux the loop waits on the libusb file descriptors with epoll, together
+// with an eventfd used to wake it up for shutdown or posted tasks, and only
+// calls into libusb when there is something to handle. Elsewhere it falls
+// back to libusb_handle_events_timeout_completed(), woken up with
+// libusb_interrupt_event_handler().
+//
+// Tasks passed to post() run on the event thread after the events of the
+// current iteration have been handled.
+class EventLoop {
+public:
+    EventLoop(libusb_context *ctx, const EventLoopConfig &config = EventLoopConfig());
+    ~EventLoop();
+
+    void start();
+    // Wakes up the loop and waits for it to finish, pending tasks are dropped
+    void stop();
+
+    void post(function<void()> task);
+
+    bool isEventThread() const {
+        return this_thread::get_id() == m_thread.get_id();
+    }
+
+    // Loop iterations, wake ups with libusb events to handle, and tasks run
+    atomic<uint64_t> iterations { 0 };
+    atomic<uint64_t> events { 0 };
+    atomic<uint64_t> tasks { 0 };
+    // Time spent waiting for events, in microseconds. The fallback backend
+    // cannot tell waiting and handling apart, there it covers both.
+    Histogram blocked;
+    // Time spent handling events and running tasks per iteration, in microseconds
+    Histogram dispatch;
+
+private:
+    libusb_context *m_ctx;
+    EventLoopConfig m_config;
+
+    atomic<bool> m_running { false };
+    thread m_thread;
+
+    mutex m_tasks_mutex;
+    vector<function<void()>> m_tasks;
+
+#ifdef __linux__
+    int m_epoll_fd = -1;
+    int m_wakeup_fd = -1;
+
+    static void LIBUSB_CALL pollfdAdded(int fd, short events, void *user_data);
+    static void LIBUSB_CALL pollfdRemoved(int fd, void *user_data);
+#endif
+
+    void run();
+    void wakeup();
+    void runTasks();
+    int waitTimeout();
+};
@@ -0,0 +1,132 @@
+#include "Executor.hpp"
+
+#include "CpuAffinity.hpp"
+#include "Log.hpp"
+
+// The executor and worker index of the current thread, when it is a worker
+static thread_local Executor *current_executor = nullptr;
+static thread_local size_t current_worker = 0;
+
+Executor::Executor(size_t workers, const vector<int> &cpus, int realtime_priority) :
+        m_cpus(cpus), m_realtime_priority(realtime_priority), m_next_timer(chrono::steady_clock::time_point::max().time_since_epoch().count()) {
+    if (!workers)
+        workers = 1;
+    for (size_t i = 0; i < workers; i++)
+        m_workers.push_back(unique_ptr<Worker>(new Worker()));
+    // Only start once every queue exists, workers steal from all of them
+    for (size_t i = 0; i < workers; i++)
+        m_workers[i]->worker_thread = thread(&Executor::run, this, i);
+}
+
+Executor::~Executor() {
+    {
+        unique_lock < mutex > lk(m_mutex);
+        m_running = false;
+        m_cv.notify_all();
+    }
+    for (auto &worker : m_workers)
+        worker->worker_thread.join();
+}
+
+Executor& Executor::shared() {
+    static Executor *executor = new Executor();
+    return *executor;
+}
+
+void Executor::post(function<void()> task) {
+    size_t index = current_executor == this ? current_worker : m_next_worker++ % m_workers.size();
+    Worker &worker = *m_workers[index];
+    {
+        unique_lock < mutex > lk(worker.queue_mutex);
+        worker.tasks.push_back(move(task));
+    }
+    // A worker going to sleep counts itself as sleeping before it checks
+    // m_pending, so either it sees this task or we see it sleeping
+    m_pending++;
+    if (m_sleeping.load()) {
+        unique_lock < mutex > lk(m_mutex);
+        m_cv.notify_one();
+    }
+}
+
+void Executor::postAt(chrono::steady_clock::time_point when, function<void()> task) {
+    unique_lock < mutex > lk(m_mutex);
+    auto it = m_timers.emplace(when, move(task));
+    if (it == m_timers.begin()) {
+        m_next_timer = when.time_since_epoch().count();
+        // The sleeping workers might be waiting for a later timer
+        m_cv.notify_one();
+    }
+}
+
+bool Executor::onWorker() {
+    return current_executor != nullptr;
+}
+
+bool Executor::take(size_t index, function<void()> &task) {
+    for (size_t i = 0; i < m_workers.size(); i++) {
+        Worker &worker = *m_workers[(index + i) % m_workers.size()];
+        unique_lock < mutex > lk(worker.queue_mutex);
+        if (worker.tasks.empty())
+            continue;
+        // Our own tasks in order, stolen ones from the other end
+        if (!i) {
+            task = move(worker.tasks.front());
+            worker.tasks.pop_front();
+        } else {
+            task = move(worker.tasks.back());
+            worker.tasks.pop_back();
+        }
+        m_pending--;
+        return true;
+    }
+    return false;
+}
+
+bool Executor::takeTimer(function<void()> &task) {
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    if (now.time_since_epoch().count() < m_next_timer.load())
+        return false;
+    unique_lock < mutex > lk(m_mutex);
+    if (m_timers.empty() || m_timers.begin()->first > now)
+        return false;
+    task = move(m_timers.begin()->second);
+    m_timers.erase(m_timers.begin());
+    m_next_timer = (m_timers.empty() ? chrono::steady_clock::time_point::max() : m_timers.begin()->first).time_since_epoch().count();
+    return true;
+}
+
+void Executor::run(size_t index) {
+    current_executor = this;
+    current_worker = index;
+    if (!m_cpus.empty() && !pinCurrentThread(m_cpus[index % m_cpus.size()]))
+        LOG_WARNING("Cannot pin executor worker %d to cpu %d", (int) index, m_cpus[index % m_cpus.size()]);
+    if (m_realtime_priority > 0 && !setRealtimePriority(m_realtime_priority))
+        LOG_WARNING("Cannot give executor worker %d real-time priority %d", (int) index, m_realtime_priority);
+
+    function<void()> task;
+    while (true) {
+        if (takeTimer(task) || take(index, task)) {
+            task();
+            task = nullptr;
+            continue;
+        }
+
+        unique_lock < mutex > lk(m_mutex);
+        m_sleeping++;
+        while (m_pending.load() <= 0 && m_running) {
+            if (m_timers.empty())
+                m_cv.wait(lk);
+            else {
+                // A copy, another worker can run and erase the timer while we wait
+                chrono::steady_clock::time_point next = m_timers.begin()->first;
+                if (next <= chrono::steady_clock::now())
+                    break;
+                m_cv.wait_until(lk, next);
+            }
+        }
+        m_sleeping--;
+        if (!m_running && m_pending.load() <= 0)
+            return;
+    }
+}
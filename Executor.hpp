@@ -0,0 +1,84 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <stddef.h>
+
+using namespace std;
+
+// Work-stealing executor for short tasks
+//
+// Every worker has a queue of its own. A task posted from a worker goes to
+// that worker's queue, tasks posted from other threads are spread over the
+// queues round robin. A worker runs the tasks of its own queue in order and
+// steals from the other queues once its own is empty. Tasks posted together
+// may therefore run in any order and in parallel, callers that need an order
+// keep at most one task of theirs posted at a time.
+//
+// A task holds up its worker for as long as it runs, it should not block.
+//
+// The destructor runs the tasks still queued, timed tasks that are not due
+// yet are dropped.
+class Executor {
+public:
+    // Worker i is pinned to cpus[i % cpus.size()] when cpus are given, and
+    // gets real-time scheduling when realtime_priority is above 0
+    explicit Executor(size_t workers = thread::hardware_concurrency(), const vector<int> &cpus = vector<int>(),
+            int realtime_priority = 0);
+    ~Executor();
+
+    void post(function<void()> task);
+    // Runs task once when is reached, on the first worker to notice
+    void postAt(chrono::steady_clock::time_point when, function<void()> task);
+
+    size_t size() const {
+        return m_workers.size();
+    }
+
+    // Whether the calling thread is a worker of any executor, where tasks
+    // must not block
+    static bool onWorker();
+
+    // For the devices that are not given an executor of their own. Created on
+    // first use with a worker per core, and never destroyed, so devices can
+    // still use it while static objects are destroyed.
+    static Executor& shared();
+
+private:
+    struct Worker {
+        mutex queue_mutex;
+        deque<function<void()>> tasks;
+        thread worker_thread;
+    };
+
+    vector<unique_ptr<Worker>> m_workers;
+    vector<int> m_cpus;
+    int m_realtime_priority;
+    atomic<size_t> m_next_worker { 0 };
+
+    // Tasks posted and not taken yet. Briefly negative when a task is taken
+    // before post() counted it.
+    atomic<long> m_pending { 0 };
+    atomic<int> m_sleeping { 0 };
+    atomic<bool> m_running { true };
+
+    // Workers sleep on m_cv, m_mutex also guards m_timers
+    mutex m_mutex;
+    condition_variable m_cv;
+    multimap<chrono::steady_clock::time_point, function<void()>> m_timers;
+    // When the first timer is due, so workers can check without locking
+    atomic<chrono::steady_clock::rep> m_next_timer;
+
+    // Takes a task from the worker's own queue, otherwise steals one
+    bool take(size_t index, function<void()> &task);
+    bool takeTimer(function<void()> &task);
+    void run(size_t index);
+};
@@ -0,0 +1,177 @@
+#include "FrameParser.hpp"
+
+#include <string.h>
+
+struct Crc16Table {
+    uint16_t entries[256];
+
+    Crc16Table() {
+        for (int i = 0; i < 256; i++) {
+            uint16_t crc = uint16_t(i << 8);
+            for (int bit = 0; bit < 8; bit++)
+                crc = (crc & 0x8000) ? uint16_t((crc << 1) ^ 0x1021) : uint16_t(crc << 1);
+            entries[i] = crc;
+        }
+    }
+};
+
+static const Crc16Table crc16_table;
+
+uint16_t SyncFrameFormat::crc16(const uint8_t *data, size_t size, uint16_t crc) {
+    for (size_t i = 0; i < size; i++)
+        crc = uint16_t((crc << 8) ^ crc16_table.entries[((crc >> 8) ^ data[i]) & 0xFF]);
+    return crc;
+}
+
+int SyncFrameFormat::frameLength(const uint8_t *data, size_t size) const {
+    if (size < HEADER_SIZE || data[0] != SYNC)
+        return -1;
+    size_t length = data[2] | (data[3] << 8);
+    if (length > m_max_payload)
+        return -1;
+    return int(HEADER_SIZE + length + CRC_SIZE);
+}
+
+size_t SyncFrameFormat::resync(const uint8_t *data, size_t size) const {
+    if (size <= 1)
+        return size;
+    const uint8_t *sync = (const uint8_t*) memchr(data + 1, SYNC, size - 1);
+    return sync ? sync - data : size;
+}
+
+bool SyncFrameFormat::decode(const uint8_t *frame, size_t length, Message &message) const {
+    size_t checked = length - CRC_SIZE;
+    uint16_t crc = frame[checked] | (frame[checked + 1] << 8);
+    if (crc16(frame + 1, checked - 1) != crc)
+        return false;
+    message.type = frame[1];
+    message.length = uint16_t(length - HEADER_SIZE - CRC_SIZE);
+    message.payload = frame + HEADER_SIZE;
+    return true;
+}
+
+size_t SyncFrameFormat::encode(uint8_t type, const uint8_t *payload, uint16_t length, uint8_t *out) {
+    out[0] = SYNC;
+    out[1] = type;
+    out[2] = uint8_t(length);
+    out[3] = uint8_t(length >> 8);
+    if (length)
+        memcpy(out + HEADER_SIZE, payload, length);
+    uint16_t crc = crc16(out + 1, HEADER_SIZE - 1 + length);
+    out[HEADER_SIZE + length] = uint8_t(crc);
+    out[HEADER_SIZE + length + 1] = uint8_t(crc >> 8);
+    return HEADER_SIZE + length + CRC_SIZE;
+}
+
+FrameParser::FrameParser(const FrameFormat &format) :
+        m_format(format) {
+}
+
+void FrameParser::reset() {
+    for (auto &stream : m_streams)
+        stream.used = 0;
+}
+
+bool FrameParser::deliver(uint8_t endpoint, const uint8_t *frame, size_t length, Counts &counts) {
+    Message message;
+    message.endpoint = endpoint;
+    if (!m_format.decode(frame, length, message)) {
+        counts.bad_checksums++;
+        return false;
+    }
+    counts.messages++;
+    Handler &handler = m_handlers[message.type];
+    if (handler) {
+        handler(message);
+    } else {
+        counts.unknown_types++;
+        if (m_unknown)
+            m_unknown(message);
+    }
+    return true;
+}
+
+size_t FrameParser::completeCarry(uint8_t endpoint, Stream &stream, const uint8_t *data, size_t size,
+        Counts &counts) {
+    uint8_t *carry = stream.carry.get();
+    size_t header = m_format.headerSize();
+    size_t pos = 0;
+    while (stream.used) {
+        if (stream.used < header) {
+            size_t count = header - stream.used < size - pos ? header - stream.used : size - pos;
+            memcpy(carry + stream.used, data + pos, count);
+            stream.used += count;
+            pos += count;
+            if (stream.used < header)
+                break;
+        }
+
+        int length = m_format.frameLength(carry, stream.used);
+        if (length > 0 && size_t(length) > m_format.maxFrameSize())
+            length = -1;
+        if (length > 0 && stream.used < size_t(length)) {
+            size_t count = length - stream.used < size - pos ? length - stream.used : size - pos;
+            memcpy(carry + stream.used, data + pos, count);
+            stream.used += count;
+            pos += count;
+            if (stream.used < size_t(length))
+                break;
+        }
+
+        // When it is not a frame after all, the bytes after its start are looked at again
+        size_t consumed = length > 0 && deliver(endpoint, carry, length, counts) ? length : 0;
+        if (!consumed) {
+            consumed = m_format.resync(carry, stream.used);
+            counts.skipped_bytes += consumed;
+        }
+        stream.used -= consumed;
+        memmove(carry, carry + consumed, stream.used);
+    }
+    return pos;
+}
+
+void FrameParser::parse(uint8_t endpoint, const uint8_t *data, size_t size) {
+    Stream &stream = m_streams[endpoint & 0x0F];
+    Counts counts;
+    size_t header = m_format.headerSize();
+
+    // A frame begun in an earlier transfer is finished first
+    size_t pos = stream.used ? completeCarry(endpoint, stream, data, size, counts) : 0;
+
+    // Whole frames are decoded where they are
+    while (pos < size) {
+        const uint8_t *frame = data + pos;
+        size_t available = size - pos;
+        int length = -1;
+        if (available >= header) {
+            length = m_format.frameLength(frame, available);
+            if (length > 0 && size_t(length) > m_format.maxFrameSize())
+                length = -1;
+        }
+
+        if (available < header || (length > 0 && size_t(length) > available)) {
+            // Runs into the next transfer
+            if (!stream.carry)
+                stream.carry.reset(new uint8_t[m_format.maxFrameSize()]);
+            memcpy(stream.carry.get(), frame, available);
+            stream.used = available;
+            break;
+        }
+        if (length > 0 && deliver(endpoint, frame, length, counts)) {
+            pos += length;
+        } else {
+            size_t skip = m_format.resync(frame, available);
+            counts.skipped_bytes += skip;
+            pos += skip;
+        }
+    }
+
+    if (counts.messages)
+        messages.fetch_add(counts.messages, memory_order_relaxed);
+    if (counts.bad_checksums)
+        bad_checksums.fetch_add(counts.bad_checksums, memory_order_relaxed);
+    if (counts.unknown_types)
+        unknown_types.fetch_add(counts.unknown_types, memory_order_relaxed);
+    if (counts.skipped_bytes)
+        skipped_bytes.fetch_add(counts.skipped_bytes, memory_order_relaxed);
+}
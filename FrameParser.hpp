@@ -0,0 +1,141 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+
+using namespace std;
+
+// A decoded message. payload points into the received buffer, or into the
+// parser's reassembly buffer for a frame that spanned transfers, and is only
+// valid while the handler runs.
+struct Message {
+    uint8_t endpoint;
+    uint8_t type;
+    uint16_t length;
+    const uint8_t *payload;
+};
+
+// How frames are laid out on the wire: where they start, how long they are
+// and how they are checked. Implementations must not allocate.
+class FrameFormat {
+public:
+    virtual ~FrameFormat() {
+    }
+
+    // Bytes needed to tell the length of a frame
+    virtual size_t headerSize() const = 0;
+    // Longest valid frame, the size of the reassembly buffer
+    virtual size_t maxFrameSize() const = 0;
+    // Given at least headerSize() bytes, returns the total length of the frame
+    // that starts there, or -1 when no valid frame starts there
+    virtual int frameLength(const uint8_t *data, size_t size) const = 0;
+    // Number of bytes to skip after data turned out not to start a frame, at
+    // least 1 and at most size
+    virtual size_t resync(const uint8_t *data, size_t size) const {
+        return 1;
+    }
+    // Validates a complete frame and fills in type, length and payload.
+    // Returns false when the checksum does not match.
+    virtual bool decode(const uint8_t *frame, size_t length, Message &message) const = 0;
+};
+
+// Default format
+//
+//     0xA5 | type | length (LE16) | payload | CRC-16 (LE16)
+//
+// The CRC is CRC-16/CCITT-FALSE over type, length and payload.
+class SyncFrameFormat: public FrameFormat {
+public:
+    static const uint8_t SYNC = 0xA5;
+    static const size_t HEADER_SIZE = 4;
+    static const size_t CRC_SIZE = 2;
+
+    explicit SyncFrameFormat(size_t max_payload = 1024) :
+            m_max_payload(max_payload) {
+    }
+
+    size_t headerSize() const override {
+        return HEADER_SIZE;
+    }
+    size_t maxFrameSize() const override {
+        return HEADER_SIZE + m_max_payload + CRC_SIZE;
+    }
+    int frameLength(const uint8_t *data, size_t size) const override;
+    size_t resync(const uint8_t *data, size_t size) const override;
+    bool decode(const uint8_t *frame, size_t length, Message &message) const override;
+
+    // Writes a frame into out, which must hold HEADER_SIZE + length + CRC_SIZE
+    // bytes. Returns the frame size.
+    static size_t encode(uint8_t type, const uint8_t *payload, uint16_t length, uint8_t *out);
+    static uint16_t crc16(const uint8_t *data, size_t size, uint16_t crc = 0xFFFF);
+
+private:
+    size_t m_max_payload;
+};
+
+// Turns the byte stream of the IN endpoints into messages
+//
+// The stages are framing, checksum validation (both given by the
+// FrameFormat) and dispatch on the message type through a table of
+// handlers. Frames that lie within one transfer are decoded in place,
+// without copying. The start of a frame that runs past the end of a
+// transfer is kept in a reassembly buffer per endpoint and completed from
+// the next transfers. Nothing is allocated per message. Garbage and frames
+// with a bad checksum are skipped up to the next possible frame start.
+//
+// Not thread safe, Device calls it from its packet processing, which never
+// runs on two threads at once.
+class FrameParser {
+public:
+    typedef function<void(const Message &message)> Handler;
+
+    // The format must outlive the parser
+    explicit FrameParser(const FrameFormat &format);
+
+    // Registers the handler for a message type, replacing the previous one
+    void on(uint8_t type, Handler handler) {
+        m_handlers[type] = move(handler);
+    }
+    // Called for types without a handler
+    void onUnknown(Handler handler) {
+        m_unknown = move(handler);
+    }
+
+    // Feeds the data of one transfer
+    void parse(uint8_t endpoint, const uint8_t *data, size_t size);
+    // Drops the partial frames, for when the stream is interrupted
+    void reset();
+
+    // Can be read from any thread
+    atomic<uint64_t> messages { 0 };
+    atomic<uint64_t> bad_checksums { 0 };
+    atomic<uint64_t> unknown_types { 0 };
+    atomic<uint64_t> skipped_bytes { 0 };
+
+private:
+    struct Stream {
+        unique_ptr<uint8_t[]> carry;
+        size_t used = 0;
+    };
+
+    struct Counts {
+        uint64_t messages = 0;
+        uint64_t bad_checksums = 0;
+        uint64_t unknown_types = 0;
+        uint64_t skipped_bytes = 0;
+    };
+
+    const FrameFormat &m_format;
+    Handler m_handlers[256];
+    Handler m_unknown;
+    Stream m_streams[16];
+
+    // Returns false when the frame does not pass the checksum
+    bool deliver(uint8_t endpoint, const uint8_t *frame, size_t length, Counts &counts);
+    // Finishes the frame in the endpoint's reassembly buffer from data.
+    // Returns the number of bytes of data used.
+    size_t completeCarry(uint8_t endpoint, Stream &stream, const uint8_t *data, size_t size, Counts &counts);
+};
@@ -0,0 +1,99 @@
+#include "Histogram.hpp"
+
+#include <stdio.h>
+
+static int msb(uint64_t value) {
+    int bit = -1;
+    while (value) {
+        value >>= 1;
+        bit++;
+    }
+    return bit;
+}
+
+static int bucketOf(uint64_t value) {
+    if (value < Histogram::SUB_BUCKETS)
+        return int(value);
+    int bit = msb(value);
+    int sub = int(value >> (bit - Histogram::SUB_BUCKET_BITS)) & (Histogram::SUB_BUCKETS - 1);
+    return Histogram::SUB_BUCKETS + (bit - Histogram::SUB_BUCKET_BITS) * Histogram::SUB_BUCKETS + sub;
+}
+
+static uint64_t bucketUpperBound(int bucket) {
+    if (bucket < Histogram::SUB_BUCKETS)
+        return bucket;
+    int bit = (bucket - Histogram::SUB_BUCKETS) / Histogram::SUB_BUCKETS + Histogram::SUB_BUCKET_BITS;
+    int sub = (bucket - Histogram::SUB_BUCKETS) % Histogram::SUB_BUCKETS;
+    int width = bit - Histogram::SUB_BUCKET_BITS;
+    uint64_t lower = (uint64_t(1) << bit) + (uint64_t(sub) << width);
+    return lower + ((uint64_t(1) << width) - 1);
+}
+
+void Histogram::record(uint64_t value) {
+    m_buckets[bucketOf(value)].fetch_add(1, memory_order_relaxed);
+
+    uint64_t max = m_max.load(memory_order_relaxed);
+    while (value > max && !m_max.compare_exchange_weak(max, value, memory_order_relaxed))
+        ;
+}
+
+uint64_t Histogram::load(uint64_t *counts) const {
+    uint64_t total = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+        counts[i] = m_buckets[i].load(memory_order_relaxed);
+        total += counts[i];
+    }
+    return total;
+}
+
+uint64_t Histogram::count() const {
+    uint64_t total = 0;
+    for (int i = 0; i < BUCKETS; i++)
+        total += m_buckets[i].load(memory_order_relaxed);
+    return total;
+}
+
+uint64_t Histogram::percentile(const uint64_t *counts, uint64_t total, double p) const {
+    if (!total)
+        return 0;
+
+    uint64_t rank = uint64_t(p / 100.0 * total + 0.5);
+    if (rank < 1)
+        rank = 1;
+    uint64_t seen = 0;
+    uint64_t max = m_max.load(memory_order_relaxed);
+    for (int i = 0; i < BUCKETS; i++) {
+        seen += counts[i];
+        if (seen >= rank) {
+            uint64_t bound = bucketUpperBound(i);
+            return bound < max ? bound : max;
+        }
+    }
+    return max;
+}
+
+uint64_t Histogram::percentile(double p) const {
+    uint64_t counts[BUCKETS];
+    uint64_t total = load(counts);
+    return percentile(counts, total, p);
+}
+
+HistogramSnapshot Histogram::snapshot() const {
+    uint64_t counts[BUCKETS];
+    HistogramSnapshot snapshot;
+    snapshot.count = load(counts);
+    snapshot.p50 = percentile(counts, snapshot.count, 50);
+    snapshot.p90 = percentile(counts, snapshot.count, 90);
+    snapshot.p99 = percentile(counts, snapshot.count, 99);
+    snapshot.p999 = percentile(counts, snapshot.count, 99.9);
+    snapshot.max = max();
+    return snapshot;
+}
+
+string Histogram::toString() const {
+    HistogramSnapshot s = snapshot();
+    char buffer[128];
+    snprintf(buffer, sizeof(buffer), "n=%llu p50=%llu p99=%llu max=%llu", (unsigned long long) s.count,
+            (unsigned long long) s.p50, (unsigned long long) s.p99, (unsigned long long) s.max);
+    return buffer;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <stdint.h>
+
+using namespace std;
+
+// Percentiles of a Histogram taken at one point in time
+struct HistogramSnapshot {
+    uint64_t count = 0;
+    uint64_t p50 = 0;
+    uint64_t p90 = 0;
+    uint64_t p99 = 0;
+    uint64_t p999 = 0;
+    uint64_t max = 0;
+};
+
+// Histogram with log-linear buckets, in the style of HdrHistogram
+//
+// Values below 8 have a bucket each. Above that every power of two range is
+// split into 8 equal buckets, so a reported percentile is within 12.5% of
+// the actual value whatever its magnitude.
+// Recording is a single relaxed atomic increment, so it can be done from the
+// libusb events thread while another thread reads the histogram.
+class Histogram {
+public:
+    static const int SUB_BUCKET_BITS = 3;
+    static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const int BUCKETS = SUB_BUCKETS + (64 - SUB_BUCKET_BITS) * SUB_BUCKETS;
+
+    void record(uint64_t value);
+
+    uint64_t count() const;
+    // Upper bound of the bucket containing the given percentile (0-100)
+    uint64_t percentile(double p) const;
+    uint64_t max() const {
+        return m_max.load(memory_order_relaxed);
+    }
+
+    // All percentiles are taken from one copy of the buckets
+    HistogramSnapshot snapshot() const;
+
+    string toString() const;
+
+private:
+    atomic<uint64_t> m_buckets[BUCKETS] = { };
+    atomic<uint64_t> m_max { 0 };
+
+    // Copies the buckets, returns the total count
+    uint64_t load(uint64_t *counts) const;
+    uint64_t percentile(const uint64_t *counts, uint64_t total, double p) const;
+};
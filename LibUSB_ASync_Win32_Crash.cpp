@@ -10,7 +10,14 @@ extern "C" {
 #include <mutex>
 #include <condition_variable>
 #include <queue>
+#include <deque>
+#include <vector>
 #include <map>
+#include <shared_mutex>
+#include <unordered_map>
+#include <random>
+#include <string.h>
+#include <stdlib.h>
 
 using namespace std;
 
@@ -26,25 +33,48 @@ using namespace std;
 #define strcasecmp _stricmp
 #endif
 
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
 #include "Device.hpp"
+#include "EventLoop.hpp"
+#include "DeviceRegistry.hpp"
+#include "DescriptorCache.hpp"
+#include "DeviceIdentity.hpp"
+#include "LoopbackTransport.hpp"
+#include "ReplayTransport.hpp"
+#include "Log.hpp"
+#include "ThreadPool.hpp"
+#include "Executor.hpp"
+#include "ContextShards.hpp"
+#include "RetryScheduler.hpp"
+#include "SharedRing.hpp"
+#include "PcapWriter.hpp"
+#include "FrameParser.hpp"
 
 libusb_context *ctx = nullptr;
 
 bool libusb_hotplug_callback_thread_running;
-bool libusb_handle_events_thread_running;
 
 mutex libusb_hotplug_callback_mutex;
-mutex libusb_handle_events_mutex;
 
 thread libusb_hotplug_callback_thread;
-thread libusb_handle_events_thread;
+
+// libusb contexts with their event threads, ctx is the first one
+ContextShards *shards = nullptr;
 
 condition_variable libusb_hotplug_callback_cv;
 
 thread windows_hwdet_thread;
 
-map<libusb_device*, Device*> mapDevices;
-map<int, Device*> mapSerial2Device;
+DeviceRegistry devices;
+
+// Configuration of the devices that are brought up
+DeviceConfig device_config;
+
+// Descriptors and serial numbers of the devices seen on the bus
+DescriptorCache descriptors;
 
 typedef struct {
     struct libusb_context *ctx;
@@ -54,63 +84,127 @@ typedef struct {
 
 queue<libusb_hotplug_event_t> libusb_hotplug_event_queue;
 
-void libusb_handle_events_thread_code(void) {
-    while (libusb_handle_events_thread_running) {
-        // This is where the crash might occur when there is a transfer active when unplugging the device.
-        // The crash occurs in windows_winusb.c line 1890
-        // winusb_get_transfer_fd(usbi_transfer * itransfer)
+// Devices being closed, and those whose last transfer has called back and
+// that are waiting to be destroyed on the hotplug callback thread
+map<Device*, shared_ptr<Device>> closing_devices;
+vector<Device*> retired_devices;
+
+// Closes the device and keeps it alive until its last transfer has called
+// back. on_closed runs on the libusb events thread and only hands the
+// pointer back, the reference is dropped on the hotplug callback thread:
+// destroying a device releases its interface, which must not happen from
+// within event handling.
+void retireDevice(shared_ptr<Device> dev) {
+    Device *device = dev.get();
+    {
+        unique_lock < mutex > lk(libusb_hotplug_callback_mutex);
+        closing_devices[device] = move(dev);
+    }
+    device->close([device]() {
+        unique_lock < mutex > lk(libusb_hotplug_callback_mutex);
+        retired_devices.push_back(device);
+        libusb_hotplug_callback_cv.notify_all();
+    });
+}
+
+// Devices being opened on the bring up pool. Set to true when the device
+// left before it was up.
+ThreadPool *bringup_pool = nullptr;
+mutex bringup_mutex;
+map<libusb_device*, bool> bringup_pending;
+
+void bringUpDevice(libusb_device *dev) {
+    shared_ptr<Device> device;
+    libusb_device_handle *handle = NULL;
+    int retval = libusb_open(dev, &handle);
+
+    if (retval) {
+        printf("Unable to open device: %s: %s\n", libusb_error_name(retval), libusb_strerror((libusb_error) retval));
+    } else {
+        // Here we would do some checks about the device, but for the demo, just accept the device
+        printf("Adding Device!\n");
+        device = make_shared<Device>(handle, device_config);
+    }
 
-        libusb_handle_events_completed(ctx, nullptr);
+    bool left;
+    {
+        unique_lock < mutex > lk(bringup_mutex);
+        left = bringup_pending[dev];
+        bringup_pending.erase(dev);
+        if (device && !left)
+            devices.insert(device);
     }
+    if (device && left)
+        retireDevice(device);
+    libusb_unref_device(dev);
 }
 
 void libusb_hotplug_callback_thread_code(void) {
     while (libusb_hotplug_callback_thread_running) {
-        unique_lock < mutex > lk(libusb_hotplug_callback_mutex);
-        libusb_hotplug_callback_cv.wait(lk);
-        if (!libusb_hotplug_callback_thread_running)
-            return;
+        // Events are handled without holding the lock, so the events thread
+        // can queue more and retire devices in the mean time
+        queue<libusb_hotplug_event_t> events;
+        vector<shared_ptr<Device>> retired;
+        {
+            unique_lock < mutex > lk(libusb_hotplug_callback_mutex);
+            libusb_hotplug_callback_cv.wait(lk, [] {
+                return !libusb_hotplug_callback_thread_running || !libusb_hotplug_event_queue.empty()
+                        || !retired_devices.empty();
+            });
+            if (!libusb_hotplug_callback_thread_running)
+                return;
+            events.swap(libusb_hotplug_event_queue);
+            for (Device *device : retired_devices) {
+                auto closing = closing_devices.find(device);
+                retired.push_back(move(closing->second));
+                closing_devices.erase(closing);
+            }
+            retired_devices.clear();
+        }
+
+        // All their transfers have finished, destroying them does not wait
+        // for anything. A lookup that still holds one destroys it on its own
+        // thread once done with it.
+        retired.clear();
 
-        while (!libusb_hotplug_event_queue.empty()) {
-            auto libusb_hotplug_callback_event = libusb_hotplug_event_queue.front();
-            libusb_hotplug_event_queue.pop();
+        while (!events.empty()) {
+            auto libusb_hotplug_callback_event = events.front();
+            events.pop();
 
             switch (libusb_hotplug_callback_event.event) {
             case LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED: {
-
-                libusb_device_handle *handle = NULL;
-                int retval = libusb_open(libusb_hotplug_callback_event.dev, &handle);
-
-                bool isSupportedDevice = true;
-
-                if (retval) {
-                    printf("Unable to open device: %s: %s\n", libusb_error_name(retval), libusb_strerror((libusb_error) retval));
-                    isSupportedDevice = false;
-                }
-
-                if (!isSupportedDevice) {
-                    libusb_close(handle);
-                    break;
+                // Opening a device takes a few control transfers, devices
+                // arriving together are brought up in parallel
+                libusb_device *dev = libusb_hotplug_callback_event.dev;
+                {
+                    unique_lock < mutex > lk(bringup_mutex);
+                    bringup_pending[dev] = false;
                 }
-
-
-                // Here we would do some checks about the device, but for the demo, just accept the device
-
-                printf("Adding Device!\n");
-                Device *dev = new Device(handle);
-                mapSerial2Device[dev->getSerial()] = dev;
-                mapDevices[dev->getLibUsbDevice()] = dev;
-
+                libusb_ref_device(dev);
+                bringup_pool->post([dev]() {
+                    bringUpDevice(dev);
+                });
                 break;
             }
             case LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT: {
-                Device *dev = mapDevices[libusb_hotplug_callback_event.dev];
-                if (dev) {
-                    mapSerial2Device.erase(dev->getSerial());
-                    mapDevices.erase(libusb_hotplug_callback_event.dev);
-                    delete dev;
+                descriptors.invalidate(libusb_hotplug_callback_event.dev);
+                {
+                    // Still being brought up, bringUpDevice() closes it when done
+                    unique_lock < mutex > lk(bringup_mutex);
+                    auto pending = bringup_pending.find(libusb_hotplug_callback_event.dev);
+                    if (pending != bringup_pending.end()) {
+                        pending->second = true;
+                        break;
+                    }
                 }
 
+                // Cancel everything in flight in one go. Once the last transfer
+                // has called back the device is handed back to this thread to be
+                // destroyed, unless a lookup still holds it.
+                shared_ptr<Device> dev = devices.remove(libusb_hotplug_callback_event.dev);
+                if (dev)
+                    retireDevice(move(dev));
+
                 break;
             }
             default: {
@@ -121,11 +215,18 @@ void libusb_hotplug_callback_thread_code(void) {
     }
 }
 
-int LIBUSB_CALL libusb_hotplug_callback(struct libusb_context* ctx, struct libusb_device* dev, libusb_hotplug_event event,
-        void* user_data) {
+void queueHotplugEvent(struct libusb_context* ctx, struct libusb_device* dev, libusb_hotplug_event event) {
     unique_lock<mutex> lk(libusb_hotplug_callback_mutex);
     libusb_hotplug_event_queue.push( {ctx, dev, event});
     libusb_hotplug_callback_cv.notify_all();
+}
+
+int LIBUSB_CALL libusb_hotplug_callback(struct libusb_context* ctx, struct libusb_device* dev, libusb_hotplug_event event,
+        void* user_data) {
+    // Every shard's context reports every device, only the shard the device
+    // is assigned to handles it
+    if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED ? shards->arrived(ctx, dev) : shards->left(ctx, dev))
+        queueHotplugEvent(ctx, dev, event);
     return 0;
 }
 
@@ -134,103 +235,40 @@ int LIBUSB_CALL libusb_hotplug_callback(struct libusb_context* ctx, struct libus
 HDEVNOTIFY hDeviceNotify = nullptr;
 HWND hWnd = nullptr;
 
-void deviceArrived(uint16_t vid, uint16_t pid, const uint8_t* sSerial) {
-    // It seems we might get a callback before the device is fully visible to libusb
-    // So adding a delay here
-    std::this_thread::sleep_for(1000ms);
+// Retries finding the libusb device of a WIN32 arrival notification
+RetryScheduler *arrival_scheduler = nullptr;
 
-    printf("DEBUG: WIN32 Detect found %04X:%04X %s, finding matching libusb Device\n", vid, pid, sSerial);
+// Looks for the libusb device with the given serial number and queues its arrival when found
+bool findArrivedDevice(uint16_t vid, uint16_t pid, const string &sSerial) {
     bool found = false;
     libusb_device** list;
-    ssize_t cnt = libusb_get_device_list(NULL, &list);
+    // Without libusb hotplug support there is no sharding, everything is
+    // opened in the first context
+    ssize_t cnt = libusb_get_device_list(ctx, &list);
     if (cnt > 0) {
-        for (int i = 0; i < cnt; i++) {
-            libusb_device* dev = list[i];
-            struct libusb_device_descriptor desc;
-            libusb_device_handle* hotplug_handle_e = NULL;
-            int retval = libusb_open(dev, &hotplug_handle_e);
-            if (retval) {
-                continue;
-            }
-            retval = libusb_get_device_descriptor(dev, &desc);
-            if (retval) {
-                libusb_close(hotplug_handle_e);
-                continue;
-            }
-            if (desc.idProduct == pid && desc.idVendor == vid) {
-                // VID/PID matches
-                uint8_t string_descriptor[256];
-                retval = libusb_get_string_descriptor_ascii(hotplug_handle_e, desc.iSerialNumber, string_descriptor,
-                        sizeof(string_descriptor));
-
-                if (retval != 8) {
-                    libusb_close(hotplug_handle_e);
-                    continue; // Expected lenght is 8 for our device
-                }
-                // Microsoft Windows is case insensitive. It even changes case for device's serial numbers
-                // so we cannot use mixed case in serial numbers on our devices
-
-                if (strcasecmp((const char*)string_descriptor, (const char*)sSerial)) {
-                    libusb_close(hotplug_handle_e);
-                    continue;
-                }
-                // Okay, we got our newly attached device!
-
-                libusb_close(hotplug_handle_e);
-                libusb_hotplug_callback(ctx, dev, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, NULL);
-                found = true;
-                break;
-            }
-            else {
-                libusb_close(hotplug_handle_e);
-                continue;
-            }
+        // Only devices with our VID/PID that were not seen before are opened
+        libusb_device* dev = descriptors.findBySerial(list, cnt, vid, pid, sSerial);
+        if (dev) {
+            // Okay, we got our newly attached device!
+            queueHotplugEvent(ctx, dev, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED);
+            found = true;
         }
         libusb_free_device_list(list, 0);
     }
-    static int retry_counter = 0;
-    if (!found) {
-
-        retry_counter++;
-        if (retry_counter < 10) {
-            std::this_thread::sleep_for(1000ms);
-            deviceArrived(vid, pid, sSerial);
-        }
-        else {
-            printf("Too many attempts, bailing out!");
-            return;
-        }
-    }
-    retry_counter = 0;
+    return found;
 }
 
-int extractVidPidfromWindowsDeviceString(uint8_t* WindowsDeviceString, uint16_t* vid, uint16_t* pid,
-        uint8_t* sSerial, int* iSerial) {
-
-    static int SerialLen = 8;
-    // Windows is case-insensitive and actually might use different cases when called during start up and hotplug events
-    if (strncasecmp((const char*)WindowsDeviceString + 0x04, "USB", 3))
-    return 1;// Not a USB device
-
-    uint8_t sVid[5], sPid[5];
-    memcpy(sVid, WindowsDeviceString + 0x0C, 4);// Extract Vid
-    memcpy(sPid, WindowsDeviceString + 0x15, 4);// Extract Pid
-    sVid[4] = sPid[4] = 0;// NULL Terminating
-    *vid = 0, * pid = 0;
-
-    sscanf_s((const char*)sVid, "%hX", vid);// Convert Vid
-    sscanf_s((const char*)sPid, "%hX", pid);// Convert Pid
-
-    // Since windows might change the case of serial numbers
-    // We can only use numerical or hex serial numbers
-    // For this instance we'll be using numberical
-
-    memcpy(sSerial, WindowsDeviceString + 0x1A, SerialLen);// Extract Vid
-    sSerial[SerialLen] = 0;
-    sscanf_s((const char*)sSerial, "%d", iSerial);
-
-    return 0;
+void deviceArrived(uint16_t vid, uint16_t pid, const uint8_t* sSerial) {
+    printf("DEBUG: WIN32 Detect found %04X:%04X %s, finding matching libusb Device\n", vid, pid, sSerial);
 
+    // It seems we might get a callback before the device is fully visible to libusb
+    // So the first look is delayed, and repeated with backoff until it shows up
+    string serial((const char*) sSerial);
+    arrival_scheduler->schedule([vid, pid, serial]() {
+        return findArrivedDevice(vid, pid, serial);
+    }, [serial]() {
+        printf("Too many attempts for %s, bailing out!\n", serial.c_str());
+    });
 }
 
 LRESULT __stdcall WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam) {
@@ -249,32 +287,21 @@ LRESULT __stdcall WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
 
             // Note: format we're getting is "\\\\?\\USB#VID_DEAD&PID_BEEF#F6D0D4CE5854242A"
 
-            // TODO: is this format fixed. eg, the offsets of the VID, PID and serial,
-            // or is there some logic needed to parse this.
-
             // Total size of the structure as indicated, minus the offset where the string begins
             size_t max_size = b->dbcc_size - ((intptr_t)b->dbcc_name - (intptr_t)b);
 
-            // Determining the offsets
-            // "\\\\?\\USB#VID_DEAD&PID_BEEF#F6D0D4CE5854242A"
-            //  0 1 23 456789ABCDEF0123456789ABCDEF0123456789
-            //  0                  1               2
-
-            if (max_size < 0x29)
-            return 1;// Device string too small, not interesting for us
-
-            // We are checking the device string for the string USB. To see whether it is a USB device
-            // we could also be looking at the GUID value. However, as we only register for USB devices
-            // that check should always pass, and this should give a little confirmation about the string.
-
-            uint16_t vid, pid;
-            uint8_t sSerial[17];
-            int iSerial;
-            uint8_t* DeviceString = (uint8_t*)b->dbcc_name;
-
             printf("DEBUG: dbcc_name: %s\n", b->dbcc_name);
 
-            extractVidPidfromWindowsDeviceString(DeviceString, &vid, &pid, sSerial, &iSerial);
+            DeviceIdentity identity;
+            if (!parseWindowsInterfacePath((const char*)b->dbcc_name, max_size, identity))
+            return 1;// Not a USB device, not interesting for us
+
+            // Since windows might change the case of serial numbers
+            // We can only use numerical or hex serial numbers
+            // For this instance we'll be using numberical
+            uint16_t vid = identity.vid, pid = identity.pid;
+            const uint8_t* sSerial = (const uint8_t*)identity.serial;
+            int iSerial = atoi(identity.serial);
 
             switch (wParam) {
                 case DBT_DEVICEARRIVAL:
@@ -282,11 +309,13 @@ LRESULT __stdcall WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
 
                 break;
                 case DBT_DEVICEREMOVECOMPLETE: {
+                    // Also when we never got to open it
+                    descriptors.invalidateSerial((const char*) sSerial);
 
-                    auto controller = mapSerial2Device[iSerial];
+                    auto controller = devices.findBySerial(iSerial);
                     if (controller) {
                         libusb_device* dev = controller->getLibUsbDevice();
-                        libusb_hotplug_callback(ctx, dev, LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, NULL);
+                        queueHotplugEvent(ctx, dev, LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT);
                     }
 
                 }
@@ -341,14 +370,11 @@ void windows_hwdet_thread_code() {
 
             printf("DeviceInterfaceDetailData.DevicePath : %s\n", DeviceInterfaceDetailData->DevicePath);
 
-            uint16_t vid, pid;
-            uint8_t sSerial[17];
-            int iSerial;
-            uint8_t* DeviceString = (uint8_t*)DeviceInterfaceDetailData->DevicePath;
-            extractVidPidfromWindowsDeviceString(DeviceString, &vid, &pid, sSerial, &iSerial);
-
-            if (vid == VID && pid == PID) {
-                deviceArrived(vid, pid, sSerial);
+            DeviceIdentity identity;
+            if (!result && parseWindowsInterfacePath((const char*)DeviceInterfaceDetailData->DevicePath,
+                    sizeof(buffer) - offsetof(SP_DEVICE_INTERFACE_DETAIL_DATA, DevicePath), identity)
+                    && identity.vid == VID && identity.pid == PID) {
+                deviceArrived(identity.vid, identity.pid, (const uint8_t*)identity.serial);
             }
 
         }
@@ -408,33 +434,788 @@ void windows_hwdet_thread_code() {
 }
 #endif
 
-int main() {
+// Closes the device and waits until all of its transfers have finished
+static void closeDevice(Device *device) {
+    mutex closed_mutex;
+    condition_variable closed_cv;
+    bool closed = false;
+    device->close([&]() {
+        unique_lock < mutex > lk(closed_mutex);
+        closed = true;
+        closed_cv.notify_all();
+    });
+    unique_lock < mutex > lk(closed_mutex);
+    closed_cv.wait(lk, [&] {
+        return closed;
+    });
+}
+
+// Runs the echo loop against LoopbackTransport instead of hardware, printing
+// the device metrics every second, and unplugs the simulated device at the end
+int runLoopback(int seconds, const LoopbackConfig &loopback_config, DeviceConfig config) {
+    // Per packet messages would be all the output there is
+    Log::setLevel(LOG_LEVEL_INFO);
+
+    LoopbackTransport *transport = new LoopbackTransport(loopback_config);
+    config.echo_seed_packets = 16;
+    Device *device = new Device(unique_ptr<UsbTransport>(transport), config);
+
+    MetricsSnapshot previous = device->metrics();
+    for (int i = 0; i < seconds; i++) {
+        this_thread::sleep_for(1s);
+        MetricsSnapshot current = device->metrics();
+        // The text is built here, the logger only takes static strings
+        Log::flush();
+        printf("%slost=%llu\n", current.toText(&previous).c_str(), (unsigned long long) transport->lost.load());
+        fflush(stdout);
+        previous = current;
+    }
+
+    LOG_INFO("Unplugging loopback device");
+    auto begin = chrono::steady_clock::now();
+    transport->unplug();
+    closeDevice(device);
+    LOG_INFO("All transfers finished %lld us after the unplug",
+            (long long) chrono::duration_cast < chrono::microseconds > (chrono::steady_clock::now() - begin).count());
+    delete device;
+    Log::flush();
+    return 0;
+}
+
+// Passes packets from one thread to another as the receive path does, once
+// through SpscQueue with buffers loaned from a BufferPool, once through the
+// deque of copied vectors under a mutex that it replaced, and prints the
+// rate and the time from push to pop of each
+int runQueueBench(int packets) {
+    const size_t size = 60;
+    uint8_t payload[size] = { };
+
+    for (bool spsc : { true, false }) {
+        Histogram latency;
+        auto begin = chrono::steady_clock::now();
+        if (spsc) {
+            SpscQueue<Packet> queue(1024);
+            BufferPool pool(size, 2048);
+            thread consumer([&]() {
+                Packet batch[64];
+                for (int done = 0; done < packets;) {
+                    size_t count = queue.pop(batch, 64);
+                    if (!count) {
+                        this_thread::yield();
+                        continue;
+                    }
+                    auto now = chrono::steady_clock::now();
+                    for (size_t i = 0; i < count; i++) {
+                        latency.record(chrono::duration_cast < chrono::nanoseconds > (now - batch[i].received).count());
+                        pool.release(batch[i].data);
+                    }
+                    done += int(count);
+                }
+            });
+            for (int i = 0; i < packets; i++) {
+                Packet packet;
+                packet.endpoint = 0x81;
+                packet.length = size;
+                while (!(packet.data = pool.acquire()))
+                    this_thread::yield();
+                memcpy(packet.data, payload, size);
+                packet.received = chrono::steady_clock::now();
+                while (!queue.push(packet))
+                    this_thread::yield();
+            }
+            consumer.join();
+        } else {
+            mutex queue_mutex;
+            condition_variable queue_cv;
+            deque<pair<chrono::steady_clock::time_point, vector<uint8_t>>> queue;
+            thread consumer([&]() {
+                unique_lock < mutex > lk(queue_mutex);
+                for (int done = 0; done < packets;) {
+                    queue_cv.wait(lk, [&] {
+                        return !queue.empty();
+                    });
+                    // Copied and used under the lock, as the receive thread did
+                    while (!queue.empty()) {
+                        auto data = queue.front();
+                        latency.record(
+                                chrono::duration_cast < chrono::nanoseconds
+                                        > (chrono::steady_clock::now() - data.first).count());
+                        queue.pop_front();
+                        done++;
+                    }
+                }
+            });
+            for (int i = 0; i < packets; i++) {
+                vector<uint8_t> data(size + 1);
+                data[0] = 0x81;
+                memcpy(data.data() + 1, payload, size);
+                unique_lock < mutex > lk(queue_mutex);
+                queue.push_back(make_pair(chrono::steady_clock::now(), data));
+                queue_cv.notify_all();
+            }
+            consumer.join();
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+
+        HistogramSnapshot h = latency.snapshot();
+        printf("%s: %d packets in %.3f s, %.0f packets/s, latency p50 %llu ns p99 %llu ns p99.9 %llu ns\n",
+                spsc ? "spsc queue  " : "deque, mutex", packets, seconds, seconds > 0 ? packets / seconds : 0.0,
+                (unsigned long long) h.p50, (unsigned long long) h.p99, (unsigned long long) h.p999);
+        fflush(stdout);
+    }
+    return 0;
+}
+
+// Looks devices up by serial from several threads while another thread
+// replaces an entry every millisecond, as hotplug does, and prints the
+// lookups per second of ShardedMap copying the shared_ptr out, of
+// ShardedMap handing out a reference, and of an unordered_map under a
+// shared_mutex and under a mutex
+int runRegistryBench(int threads, int seconds) {
+    const int keys = 64;
+    const char *names[] = { "sharded map, copy     ", "sharded map, reference", "shared_mutex          ", "mutex                 " };
+
+    for (int mode = 0; mode < 4; mode++) {
+        ShardedMap<int, shared_ptr<int>> sharded;
+        unordered_map<int, shared_ptr<int>> table;
+        shared_mutex table_shared_mutex;
+        mutex table_mutex;
+        for (int key = 0; key < keys; key++) {
+            sharded.insert(key, make_shared<int>(key));
+            table[key] = make_shared<int>(key);
+        }
+
+        atomic<bool> running(true);
+        atomic<uint64_t> total(0), checksum(0);
+        vector<thread> readers;
+        for (int t = 0; t < threads; t++) {
+            readers.emplace_back([&, t]() {
+                uint64_t lookups = 0, sum = 0;
+                for (int key = t; running.load(memory_order_relaxed); key = (key + 1) % keys) {
+                    if (mode == 0) {
+                        sum += *sharded.find(key);
+                    } else if (mode == 1) {
+                        sharded.find(key, [&sum](const shared_ptr<int> &value) {
+                            sum += *value;
+                        });
+                    } else if (mode == 2) {
+                        shared_lock < shared_mutex > lk(table_shared_mutex);
+                        sum += *table.find(key)->second;
+                    } else {
+                        unique_lock < mutex > lk(table_mutex);
+                        sum += *table.find(key)->second;
+                    }
+                    lookups++;
+                }
+                total += lookups;
+                // Keeps the lookups from being optimised away
+                checksum += sum;
+            });
+        }
+
+        int writes = 0;
+        auto end = chrono::steady_clock::now() + chrono::seconds(seconds);
+        while (chrono::steady_clock::now() < end) {
+            int key = writes % keys;
+            shared_ptr<int> value = make_shared<int>(key);
+            if (mode < 2) {
+                sharded.assign(key, value);
+            } else if (mode == 2) {
+                unique_lock < shared_mutex > lk(table_shared_mutex);
+                table[key] = value;
+            } else {
+                unique_lock < mutex > lk(table_mutex);
+                table[key] = value;
+            }
+            writes++;
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+        running = false;
+        for (auto &reader : readers)
+            reader.join();
+
+        printf("%s: %d threads, %.0f lookups/s, %d writes\n", names[mode], threads,
+                double(total.load()) / seconds, writes);
+        fflush(stdout);
+    }
+    return 0;
+}
+
+// Plays a capture back through a device, at the captured pace or as fast as
+// the device takes the packets, and prints the rate and the device metrics.
+// The consumer only counts the packets, echoing them would measure the OUT
+// transfers instead, which the capture does not drive.
+int runReplay(const char *path, bool max_speed) {
+    Log::setLevel(LOG_LEVEL_INFO);
+
+    ReplayConfig replay_config;
+    replay_config.path = path;
+    replay_config.max_speed = max_speed;
+    DeviceConfig config;
+    // Unpaced, the replay waits for the consumer rather than have the
+    // receive queue drop what it cannot take
+    if (max_speed)
+        replay_config.window = config.recv_queue_size / 2;
+    ReplayTransport *transport = new ReplayTransport(replay_config);
+    if (!transport->valid()) {
+        fprintf(stderr, "Cannot read capture %s\n", path);
+        delete transport;
+        return 1;
+    }
+
+    // The capture drives the traffic, on every endpoint it has packets for
+    config.echo_seed_packets = 0;
+    if (!transport->inEndpoints().empty())
+        config.in_endpoints = transport->inEndpoints();
+    uint64_t consumed = 0, bytes = 0;
+    config.on_packets = [&](Device &device, Packet *packets, size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            bytes += packets[i].length;
+            device.releaseBuffer(packets[i].data);
+        }
+        consumed += count;
+        transport->consumed(count);
+    };
+    auto begin = chrono::steady_clock::now();
+    Device *device = new Device(unique_ptr<UsbTransport>(transport), config);
+    transport->waitFinished();
+    // The consumer takes what is still queued before the device goes
+    while (device->metrics().recv_queue_depth)
+        this_thread::sleep_for(1ms);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+
+    transport->unplug();
+    closeDevice(device);
+    MetricsSnapshot metrics = device->metrics();
+    uint64_t replayed = transport->replayed.load();
+    delete device;
+    Log::flush();
+    printf("%s%llu packets replayed in %.3f s, %.0f packets/s, %llu packets (%llu bytes) consumed\n",
+            metrics.toText().c_str(), (unsigned long long) replayed, seconds, seconds > 0 ? replayed / seconds : 0.0,
+            (unsigned long long) consumed, (unsigned long long) bytes);
+    return 0;
+}
+
+// Converts a capture to pcap. The capture only has completions, so every
+// record becomes a usbmon completion carrying its payload.
+int runCaptureToPcap(const char *capture_path, const char *pcap_path) {
+    CaptureReader reader;
+    if (!reader.open(capture_path)) {
+        fprintf(stderr, "Cannot read capture %s\n", capture_path);
+        return 1;
+    }
+    uint64_t records = 0, written = 0, dropped = 0;
+    {
+        PcapWriter writer(pcap_path);
+        if (!writer.valid()) {
+            fprintf(stderr, "Cannot create %s\n", pcap_path);
+            return 1;
+        }
+        uint64_t start_ns = reader.header()->start_unix_ns;
+        while (const CaptureRecord *record = reader.next()) {
+            UsbmonHeader header = { };
+            header.id = records;
+            header.type = 'C';
+            header.transfer_type = 3;
+            header.endpoint = record->endpoint;
+            header.flag_setup = '-';
+            header.status = PcapWriter::statusErrno((enum libusb_transfer_status) record->status);
+            header.length = record->length;
+            header.captured = record->length;
+            // Nothing is lost to a slow disk, this only waits for it
+            writer.append(header, record->payload(), start_ns + record->time_ns, true);
+            records++;
+        }
+        written = writer.records();
+        dropped = writer.dropped();
+    }
+    printf("%llu records written to %s\n", (unsigned long long) written, pcap_path);
+    if (dropped) {
+        fprintf(stderr, "%llu of %llu records did not fit the pcap buffers\n", (unsigned long long) dropped,
+                (unsigned long long) records);
+        return 1;
+    }
+    return 0;
+}
+
+// Writes a capture of framed IN traffic as the firmware would send it: frames
+// of random type and size back to back, one in a thousand with a broken
+// checksum, cut into transfers of the default transfer size
+int runFrameCapture(const char *path, int frames) {
+    DeviceConfig config;
+    size_t transfer_size = config.transfer_size;
+    CaptureWriter writer(path, size_t(frames) * 256 + transfer_size * sizeof(CaptureRecord), "00000001");
+    if (!writer.valid()) {
+        fprintf(stderr, "Cannot create capture %s\n", path);
+        return 1;
+    }
+
+    mt19937 random(1);
+    uint8_t payload[200];
+    uint8_t frame[SyncFrameFormat::HEADER_SIZE + sizeof(payload) + SyncFrameFormat::CRC_SIZE];
+    vector<uint8_t> pending;
+    auto time = chrono::steady_clock::now();
+    for (int i = 0; i < frames; i++) {
+        uint16_t length = uint16_t(random() % (sizeof(payload) + 1));
+        for (uint16_t j = 0; j < length; j++)
+            payload[j] = uint8_t(random());
+        size_t size = SyncFrameFormat::encode(uint8_t(random() % 8), payload, length, frame);
+        if (i % 1000 == 999)
+            frame[size - 1] ^= 0xFF;
+        pending.insert(pending.end(), frame, frame + size);
+
+        size_t sent = 0;
+        for (; pending.size() - sent >= transfer_size; sent += transfer_size) {
+            writer.append(0x81, LIBUSB_TRANSFER_COMPLETED, pending.data() + sent, uint32_t(transfer_size), time);
+            time += 10us;
+        }
+        pending.erase(pending.begin(), pending.begin() + sent);
+    }
+    if (!pending.empty())
+        writer.append(0x81, LIBUSB_TRANSFER_COMPLETED, pending.data(), uint32_t(pending.size()), time);
+    printf("%d frames in %llu transfers written to %s\n", frames, (unsigned long long) writer.records(), path);
+    return 0;
+}
+
+// Decodes the IN data of a capture with the default frame format the given
+// number of times and prints the rate
+int runDecodeBench(const char *path, int iterations) {
+    CaptureReader reader;
+    if (!reader.open(path)) {
+        fprintf(stderr, "Cannot read capture %s\n", path);
+        return 1;
+    }
+    // The payloads stay in the mapped file, as they would in the buffer pool
+    struct Transfer {
+        uint8_t endpoint;
+        const uint8_t *data;
+        size_t length;
+    };
+    vector<Transfer> transfers;
+    size_t bytes = 0;
+    while (const CaptureRecord *record = reader.next())
+        if ((record->endpoint & 0x80) && record->status == LIBUSB_TRANSFER_COMPLETED && record->length) {
+            transfers.push_back( { record->endpoint, record->payload(), record->length });
+            bytes += record->length;
+        }
+
+    SyncFrameFormat format;
+    FrameParser parser(format);
+    uint64_t types[8] = { }, payload_bytes = 0;
+    for (uint8_t type = 0; type < 8; type++)
+        parser.on(type, [&types, &payload_bytes](const Message &message) {
+            types[message.type]++;
+            payload_bytes += message.length;
+        });
+
+    auto begin = chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+        parser.reset();
+        for (auto &transfer : transfers)
+            parser.parse(transfer.endpoint, transfer.data, transfer.length);
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+
+    uint64_t messages = parser.messages.load();
+    printf("%zu transfers, %zu bytes, %d iterations in %.3f s\n", transfers.size(), bytes, iterations, seconds);
+    printf("%llu messages, %.0f messages/s, %.1f MB/s, %llu payload bytes\n", (unsigned long long) messages,
+            seconds > 0 ? messages / seconds : 0.0, seconds > 0 ? bytes * double(iterations) / seconds / 1e6 : 0.0,
+            (unsigned long long) payload_bytes);
+    printf("bad checksums %llu, unknown types %llu, bytes skipped %llu\n",
+            (unsigned long long) parser.bad_checksums.load(), (unsigned long long) parser.unknown_types.load(),
+            (unsigned long long) parser.skipped_bytes.load());
+    return 0;
+}
+
+// Attaches to the shared ring of a device and prints the packet and byte
+// rates every second, until the device is gone or the time is up
+int runSharedRingReader(const char *name, int seconds) {
+    SharedRingReader reader;
+    if (!reader.open(name)) {
+        fprintf(stderr, "Cannot attach to shared ring %s\n", name);
+        return 1;
+    }
+
+    SharedPacket packets[64];
+    uint64_t total_packets = 0, total_bytes = 0, last_packets = 0, last_bytes = 0;
+    auto begin = chrono::steady_clock::now();
+    auto report = begin + 1s;
+    while (!reader.closed() && (!seconds || chrono::steady_clock::now() < begin + chrono::seconds(seconds))) {
+        size_t count = reader.poll(packets, 64);
+        for (size_t i = 0; i < count; i++)
+            total_bytes += packets[i].length;
+        total_packets += count;
+        reader.release();
+        if (!count)
+            this_thread::sleep_for(100us);
+
+        auto now = chrono::steady_clock::now();
+        if (now >= report) {
+            printf("%s: %llu packets/s %llu bytes/s dropped=%llu\n", name,
+                    (unsigned long long) (total_packets - last_packets), (unsigned long long) (total_bytes - last_bytes),
+                    (unsigned long long) reader.dropped());
+            fflush(stdout);
+            last_packets = total_packets;
+            last_bytes = total_bytes;
+            report += 1s;
+        }
+    }
+    printf("%s: %llu packets, %llu bytes%s\n", name, (unsigned long long) total_packets,
+            (unsigned long long) total_bytes, reader.closed() ? ", device gone" : "");
+    return 0;
+}
+
+// Device notifications as they come in, for the parser benchmark
+static const struct {
+    const char *data;
+    size_t length;
+} parse_samples[] = {
+#define SAMPLE(s) { s, sizeof(s) - 1 }
+    SAMPLE("\\\\?\\USB#VID_DEAD&PID_BEEF#12345678#{a5dcbf10-6530-11d2-901f-00c04fb951ed}"),
+    SAMPLE("\\\\?\\usb#vid_dead&pid_beef&mi_00#6&1a2b3c4d&0&0000#{a5dcbf10-6530-11d2-901f-00c04fb951ed}"),
+    SAMPLE("\\\\?\\HID#VID_046D&PID_C52B&MI_00#7&2f5e3a1&0&0000#{4d1e55b2-f16f-11cf-88cb-001111000030}"),
+    SAMPLE("add@/devices/pci0000:00/0000:00:14.0/usb1/1-2/1-2.3\0ACTION=add\0"
+            "DEVPATH=/devices/pci0000:00/0000:00:14.0/usb1/1-2/1-2.3\0SUBSYSTEM=usb\0DEVTYPE=usb_device\0"
+            "PRODUCT=dead/beef/100\0TYPE=0/0/0\0BUSNUM=001\0DEVNUM=007\0SEQNUM=4242\0"),
+    SAMPLE("remove@/devices/pci0000:00/0000:00:14.0/usb1/1-2/1-2.3/1-2.3:1.0\0ACTION=remove\0"
+            "DEVPATH=/devices/pci0000:00/0000:00:14.0/usb1/1-2/1-2.3/1-2.3:1.0\0SUBSYSTEM=usb\0"
+            "DEVTYPE=usb_interface\0MODALIAS=usb:vDEADpBEEFd0100dc00dsc00dp00icFFisc00ip00in00\0SEQNUM=4243\0"),
+    SAMPLE("MAJOR=189\nMINOR=6\nDEVNAME=bus/usb/001/007\nDEVTYPE=usb_device\nDRIVER=usb\n"
+            "PRODUCT=dead/beef/100\nTYPE=0/0/0\nBUSNUM=001\nDEVNUM=007\nID_SERIAL_SHORT=12345678\n"),
+#undef SAMPLE
+};
+
+// Parses the sample notifications the given number of times and prints the
+// rate. Every prefix of every sample is parsed first, from a buffer of
+// exactly that size, which is what truncated notifications look like.
+int runParseBench(int iterations) {
+    DeviceIdentity identity;
+    size_t parsed = 0;
+    for (auto &sample : parse_samples) {
+        for (size_t length = 0; length <= sample.length; length++) {
+            unique_ptr<char[]> copy(new char[length ? length : 1]);
+            memcpy(copy.get(), sample.data, length);
+            parsed += parseDeviceIdentity(copy.get(), length, identity);
+        }
+        parseDeviceIdentity(sample.data, sample.length, identity);
+        printf("%04X:%04X serial \"%s\" port \"%s\" action %d\n", identity.vid, identity.pid, identity.serial,
+                identity.port_path, identity.action);
+    }
+
+    size_t events = 0;
+    auto begin = chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++)
+        for (auto &sample : parse_samples) {
+            parsed += parseDeviceIdentity(sample.data, sample.length, identity);
+            events++;
+        }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    printf("%zu events in %.3f s, %.0f events/s (%zu parsed)\n", events, seconds, seconds > 0 ? events / seconds : 0.0,
+            parsed);
+    return 0;
+}
+
+// CPU time used by the process so far, all threads together
+static double processCpuSeconds() {
+#ifdef _WIN32
+    FILETIME creation, exit, kernel, user;
+    GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user);
+    ULARGE_INTEGER k, u;
+    k.LowPart = kernel.dwLowDateTime;
+    k.HighPart = kernel.dwHighDateTime;
+    u.LowPart = user.dwLowDateTime;
+    u.HighPart = user.dwHighDateTime;
+    return (k.QuadPart + u.QuadPart) / 1e7;
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+#endif
+}
+
+// Runs the echo loop on 1, 16 and 256 loopback devices at the same time and
+// prints the CPU usage and the worst echo turnaround percentiles of the
+// devices for each. Once with the packet processing of all devices sharing
+// one executor, once with an executor of a single worker per device, which
+// is a thread per device as before. Every loopback device has a thread of its
+// own standing in for the events thread, that part does not change.
+int runExecutorBench(int seconds, size_t workers) {
+    // Unplugging at the end of each run fails the sends still under way
+    Log::setLevel(LOG_LEVEL_ERROR);
+    Executor executor(workers);
+    printf("%zu shared executor workers, %d s per run\n", executor.size(), seconds);
+
+    for (int count : { 1, 16, 256 })
+        for (bool shared : { true, false }) {
+            vector<LoopbackTransport*> transports;
+            vector<Device*> bench_devices;
+            vector<unique_ptr<Executor>> own_executors;
+            DeviceConfig config;
+            config.echo_seed_packets = 4;
+            for (int i = 0; i < count; i++) {
+                if (shared) {
+                    config.executor = &executor;
+                } else {
+                    own_executors.push_back(unique_ptr<Executor>(new Executor(1)));
+                    config.executor = own_executors.back().get();
+                }
+                transports.push_back(new LoopbackTransport());
+                bench_devices.push_back(new Device(unique_ptr<UsbTransport>(transports.back()), config));
+            }
+
+            vector<MetricsSnapshot> before;
+            for (auto device : bench_devices)
+                before.push_back(device->metrics());
+            double cpu = processCpuSeconds();
+            auto begin = chrono::steady_clock::now();
+            this_thread::sleep_for(chrono::seconds(seconds));
+            double elapsed = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+            cpu = processCpuSeconds() - cpu;
+
+            uint64_t packets = 0, p99 = 0, p999 = 0;
+            for (size_t i = 0; i < bench_devices.size(); i++) {
+                MetricsSnapshot after = bench_devices[i]->metrics();
+                packets += after.echo_turnaround.count - before[i].echo_turnaround.count;
+                p99 = max(p99, (uint64_t) after.echo_turnaround.p99);
+                p999 = max(p999, (uint64_t) after.echo_turnaround.p999);
+            }
+            printf("%3d devices, %s: %.0f packets/s, cpu %.0f%%, echo turnaround p99 %llu us p99.9 %llu us\n", count,
+                    shared ? "shared executor  " : "thread per device", packets / elapsed, 100 * cpu / elapsed,
+                    (unsigned long long) p99, (unsigned long long) p999);
+            fflush(stdout);
+
+            for (size_t i = 0; i < bench_devices.size(); i++) {
+                transports[i]->unplug();
+                delete bench_devices[i];
+            }
+        }
+    Log::flush();
+    return 0;
+}
+
+static const MetricsSnapshot::Endpoint* findEndpoint(const MetricsSnapshot &metrics, uint8_t endpoint) {
+    for (auto &ep : metrics.endpoints)
+        if (ep.endpoint == endpoint)
+            return &ep;
+    return nullptr;
+}
+
+// Runs the echo loop without coalescing and with coalescing at several time
+// budgets, against a loopback device that splits the coalesced transfers.
+// Prints the payloads and OUT transfers per second, the CPU usage and the
+// send latency of each, which includes the time payloads wait to be coalesced.
+int runCoalesceBench(int seconds, unsigned int latency_us) {
+    // Unplugging at the end of each run fails the sends still under way
+    Log::setLevel(LOG_LEVEL_ERROR);
+    printf("%d s per run, loopback latency %u us\n", seconds, latency_us);
+
+    for (int budget : { -1, 0, 50, 200, 1000 }) {
+        LoopbackConfig loopback_config;
+        loopback_config.latency_us = latency_us;
+        loopback_config.split_coalesced = budget >= 0;
+        DeviceConfig config;
+        // Enough packets going round for several to be coalesced
+        config.echo_seed_packets = 64;
+        config.coalesce = budget >= 0;
+        config.coalesce_budget_us = budget >= 0 ? budget : 0;
+        LoopbackTransport *transport = new LoopbackTransport(loopback_config);
+        Device *device = new Device(unique_ptr<UsbTransport>(transport), config);
+
+        MetricsSnapshot before = device->metrics();
+        double cpu = processCpuSeconds();
+        this_thread::sleep_for(chrono::seconds(seconds));
+        MetricsSnapshot after = device->metrics();
+        cpu = processCpuSeconds() - cpu;
+        double elapsed = chrono::duration<double>(after.time - before.time).count();
+
+        const MetricsSnapshot::Endpoint *in = findEndpoint(after, 0x81), *in_before = findEndpoint(before, 0x81);
+        const MetricsSnapshot::Endpoint *out = findEndpoint(after, 0x01), *out_before = findEndpoint(before, 0x01);
+        double payloads = (in->transfers - in_before->transfers) / elapsed;
+        double transfers = (out->transfers - out_before->transfers) / elapsed;
+        char name[32];
+        if (budget < 0)
+            snprintf(name, sizeof(name), "no coalescing");
+        else
+            snprintf(name, sizeof(name), "budget %4d us", budget);
+        printf("%s: %.0f payloads/s, %.0f OUT transfers/s (%.1f payloads each), cpu %.0f%%, "
+                "send latency p50 %llu us p99 %llu us\n", name, payloads, transfers,
+                transfers > 0 ? payloads / transfers : 0.0, 100 * cpu / elapsed,
+                (unsigned long long) out->queue_latency.p50, (unsigned long long) out->queue_latency.p99);
+        fflush(stdout);
+
+        transport->unplug();
+        delete device;
+    }
+    Log::flush();
+    return 0;
+}
+
+// Parses a list of cores such as "2,3"
+static vector<int> parseCpus(const char *list) {
+    vector<int> cpus;
+    for (const char *p = list; *p;) {
+        cpus.push_back(atoi(p));
+        p = strchr(p, ',');
+        if (!p)
+            break;
+        p++;
+    }
+    return cpus;
+}
+
+int main(int argc, char *argv[]) {
+
+    // --loopback [seconds] [latency us] [loss] [--shm PREFIX] [--capture PREFIX]
+    // [--pcap PREFIX] [--ring-depth N] [--coalesce BUDGET_US] benchmarks without hardware
+    if (argc > 1 && !strcmp(argv[1], "--loopback")) {
+        LoopbackConfig loopback_config;
+        DeviceConfig config;
+        int options = 2;
+        while (options < argc && argv[options][0] != '-')
+            options++;
+        if (options > 3)
+            loopback_config.latency_us = atoi(argv[3]);
+        if (options > 4)
+            loopback_config.loss = atof(argv[4]);
+        for (int i = options; i + 1 < argc; i += 2) {
+            if (!strcmp(argv[i], "--shm"))
+                config.shared_ring_prefix = argv[i + 1];
+            else if (!strcmp(argv[i], "--capture"))
+                config.capture_prefix = argv[i + 1];
+            else if (!strcmp(argv[i], "--pcap"))
+                config.pcap_prefix = argv[i + 1];
+            else if (!strcmp(argv[i], "--ring-depth"))
+                config.in_ring_depth = max(1, atoi(argv[i + 1]));
+            else if (!strcmp(argv[i], "--coalesce")) {
+                config.coalesce = true;
+                config.coalesce_budget_us = atoi(argv[i + 1]);
+                loopback_config.split_coalesced = true;
+            }
+        }
+        return runLoopback(options > 2 ? atoi(argv[2]) : 10, loopback_config, config);
+    }
+
+    // --queue-bench [packets] compares the receive queue with the deque and mutex before it
+    if (argc > 1 && !strcmp(argv[1], "--queue-bench"))
+        return runQueueBench(argc > 2 ? atoi(argv[2]) : 10000000);
+
+    // --registry-bench [threads] [seconds] compares device lookups with locked maps
+    if (argc > 1 && !strcmp(argv[1], "--registry-bench"))
+        return runRegistryBench(argc > 2 ? max(1, atoi(argv[2])) : 4, argc > 3 ? max(1, atoi(argv[3])) : 3);
+
+    // --replay FILE [max] plays a capture back through the echo loop
+    if (argc > 2 && !strcmp(argv[1], "--replay"))
+        return runReplay(argv[2], argc > 3 && !strcmp(argv[3], "max"));
+
+    // --cap2pcap CAPTURE PCAP converts a capture for Wireshark
+    if (argc > 3 && !strcmp(argv[1], "--cap2pcap"))
+        return runCaptureToPcap(argv[2], argv[3]);
+
+    // --frame-capture FILE [frames] writes a capture of framed traffic,
+    // --decode-bench FILE [iterations] benchmarks the frame parser on a capture
+    if (argc > 2 && !strcmp(argv[1], "--frame-capture"))
+        return runFrameCapture(argv[2], argc > 3 ? atoi(argv[3]) : 1000000);
+    if (argc > 2 && !strcmp(argv[1], "--decode-bench"))
+        return runDecodeBench(argv[2], argc > 3 ? atoi(argv[3]) : 10);
+
+    // --shm-reader NAME [seconds] consumes the shared ring of a device
+    if (argc > 2 && !strcmp(argv[1], "--shm-reader"))
+        return runSharedRingReader(argv[2], argc > 3 ? atoi(argv[3]) : 0);
+
+    // --executor-bench [seconds] [workers] compares 1, 16 and 256 loopback devices
+    if (argc > 1 && !strcmp(argv[1], "--executor-bench"))
+        return runExecutorBench(argc > 2 ? atoi(argv[2]) : 5, argc > 3 ? atoi(argv[3]) : thread::hardware_concurrency());
+
+    // --coalesce-bench [seconds] [latency us] compares coalescing time budgets
+    if (argc > 1 && !strcmp(argv[1], "--coalesce-bench"))
+        return runCoalesceBench(argc > 2 ? atoi(argv[2]) : 3, argc > 3 ? atoi(argv[3]) : 0);
+
+    // --parse-bench [iterations] benchmarks the device notification parsers
+    if (argc > 1 && !strcmp(argv[1], "--parse-bench"))
+        return runParseBench(argc > 2 ? atoi(argv[2]) : 1000000);
 
     auto version = libusb_get_version();
     printf("Using libusb version %d.%d.%d.%d\n", version->major, version->minor, version->micro, version->nano);
 
+    // --shards N spreads the devices over N libusb contexts, round robin or
+    // --by-bus, --event-cpus pins their event threads. --latency pins the
+    // event threads and packet processing to the given cores. --shm PREFIX
+    // exports the received packets of every device to shared memory,
+    // --capture PREFIX records their transfers to a file, --pcap PREFIX
+    // writes them out for Wireshark. --decode runs the received data through
+    // a frame parser.
+    ContextShardsConfig shards_config;
+    bool latency_mode = false;
+    vector<int> latency_cpus;
+    int latency_priority = 0;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--shards") && i + 1 < argc) {
+            shards_config.shards = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--by-bus")) {
+            shards_config.assignment = ContextShardsConfig::BY_BUS;
+        } else if (!strcmp(argv[i], "--event-cpus") && i + 1 < argc) {
+            shards_config.cpus = parseCpus(argv[++i]);
+        } else if (!strcmp(argv[i], "--shm") && i + 1 < argc) {
+            device_config.shared_ring_prefix = argv[++i];
+        } else if (!strcmp(argv[i], "--capture") && i + 1 < argc) {
+            device_config.capture_prefix = argv[++i];
+        } else if (!strcmp(argv[i], "--pcap") && i + 1 < argc) {
+            device_config.pcap_prefix = argv[++i];
+        } else if (!strcmp(argv[i], "--decode")) {
+            device_config.make_parser = [](Device &device) {
+                static SyncFrameFormat format;
+                return unique_ptr<FrameParser>(new FrameParser(format));
+            };
+        } else if (!strcmp(argv[i], "--latency") && i + 1 < argc) {
+            latency_mode = true;
+            latency_cpus = parseCpus(argv[++i]);
+            if (i + 1 < argc && argv[i + 1][0] != '-')
+                latency_priority = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    // The event threads go on the first cores, one packet processing worker
+    // on each of the others, all of them real-time when a priority is given.
+    // The buffer pools are locked so a packet never waits for a page fault.
+    if (latency_mode) {
+        size_t event_cpus = min(shards_config.shards, latency_cpus.size());
+        shards_config.cpus.assign(latency_cpus.begin(), latency_cpus.begin() + event_cpus);
+        vector<int> worker_cpus(latency_cpus.begin() + event_cpus, latency_cpus.end());
+        if (worker_cpus.empty())
+            worker_cpus = latency_cpus;
+        shards_config.event_loop.realtime_priority = latency_priority;
+        device_config.executor = new Executor(worker_cpus.size(), worker_cpus, latency_priority);
+        device_config.lock_memory = true;
+    }
+
     printf("Initialising libusb...\n");
 
-    int res = libusb_init(&ctx);
+    shards = new ContextShards(shards_config);
+    int res = shards->init();
 
     if (res) {
         fprintf(stderr, "Error initialising libusb.\n");
         return res;
     }
+    ctx = shards->context(0);
+
+    bringup_pool = new ThreadPool();
 
     printf("Starting hotplug callback thread...\n");
     libusb_hotplug_callback_thread_running = true;
     libusb_hotplug_callback_thread = thread(libusb_hotplug_callback_thread_code);
 
-    printf("Starting events thread...\n");
-    libusb_handle_events_thread_running = true;
-    libusb_handle_events_thread = thread(libusb_handle_events_thread_code);
+    printf("Starting %d events thread(s)...\n", (int) shards->size());
+    shards->start();
 
     printf("Registering hotplug callback...\n");
 
-    res = libusb_hotplug_register_callback(ctx,
-            libusb_hotplug_event(LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT), LIBUSB_HOTPLUG_ENUMERATE,
-            VID, PID, LIBUSB_HOTPLUG_MATCH_ANY, libusb_hotplug_callback, nullptr, nullptr);
+    res = shards->registerHotplug(
+            libusb_hotplug_event(LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT), VID, PID,
+            libusb_hotplug_callback, nullptr);
 
 #ifdef WIN32
 	// Current Windows version of libusb has no hotplug support
@@ -444,12 +1225,21 @@ int main() {
 	if (res == LIBUSB_ERROR_NOT_SUPPORTED) {
 		// Start the windows specific hotplug thread code
 		printf("Hotplug not supported on this version.\nStarting our own detection thread...\n");
+		arrival_scheduler = new RetryScheduler(*bringup_pool);
 		windows_hwdet_thread = thread(windows_hwdet_thread_code);
 	}
 
 #endif
 
-    while (1)
-        this_thread::sleep_for(100s);
+    while (1) {
+        this_thread::sleep_for(latency_mode ? 10s : 100s);
+        // Achieved echo latency, percentiles since the device was brought up
+        if (latency_mode)
+            devices.forEach([](const shared_ptr<Device> &device) {
+                HistogramSnapshot echo = device->metrics().echo_turnaround;
+                printf("Device %d: echo turnaround p50 %llu us, p99 %llu us, p99.9 %llu us\n", device->getSerial(),
+                        (unsigned long long) echo.p50, (unsigned long long) echo.p99, (unsigned long long) echo.p999);
+            });
+    }
 }
 
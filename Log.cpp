@@ -0,0 +1,279 @@
+#include "Log.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "SpscQueue.hpp"
+
+atomic<int> Log::s_level { LOG_LEVEL };
+
+namespace {
+
+// Queue of one logging thread. The drain thread keeps it until the thread has
+// exited and the queue is empty.
+struct ThreadQueue {
+    SpscQueue<Log::Record> records { 4096 };
+    atomic<bool> alive { true };
+};
+
+class Drain {
+public:
+    Drain() {
+        m_thread = thread(&Drain::run, this);
+    }
+    ~Drain() {
+        {
+            unique_lock < mutex > lk(m_mutex);
+            m_running = false;
+            m_cv.notify_all();
+        }
+        m_thread.join();
+    }
+
+    shared_ptr<ThreadQueue> attach() {
+        shared_ptr<ThreadQueue> queue = make_shared<ThreadQueue>();
+        unique_lock < mutex > lk(m_mutex);
+        m_queues.push_back(queue);
+        return queue;
+    }
+
+    void flush() {
+        unique_lock < mutex > lk(m_mutex);
+        uint64_t request = ++m_flush_requested;
+        m_cv.notify_all();
+        m_flushed_cv.wait(lk, [this, request] {
+            return m_flushed >= request || !m_running;
+        });
+    }
+
+    atomic<uint64_t> dropped { 0 };
+
+private:
+    mutex m_mutex;
+    condition_variable m_cv;
+    condition_variable m_flushed_cv;
+    vector<shared_ptr<ThreadQueue>> m_queues;
+    bool m_running = true;
+    uint64_t m_flush_requested = 0;
+    uint64_t m_flushed = 0;
+    // Records taken from the queues and not written yet, drain thread only
+    vector<Log::Record> m_pending;
+    thread m_thread;
+
+    // How long records are held back for the other queues to catch up
+    static constexpr chrono::milliseconds HOLD { 2 };
+
+    void run();
+    // Writes the records older than HOLD, or all of them, returns whether it
+    // took or wrote any
+    bool drain(bool all);
+};
+
+void format(const Log::Record &record, string &out) {
+    static const char levels[] = "EWID";
+    char buffer[128];
+
+    time_t seconds = chrono::system_clock::to_time_t(record.time);
+    struct tm local;
+#ifdef _WIN32
+    localtime_s(&local, &seconds);
+#else
+    localtime_r(&seconds, &local);
+#endif
+    int millis = int(chrono::duration_cast < chrono::milliseconds > (record.time.time_since_epoch()).count() % 1000);
+    snprintf(buffer, sizeof(buffer), "%02d:%02d:%02d.%03d %c ", local.tm_hour, local.tm_min, local.tm_sec, millis,
+            levels[record.level < 4 ? record.level : 3]);
+    out += buffer;
+
+    // Every conversion is formatted on its own with its stored argument.
+    // Length modifiers are replaced, integers are always stored as long long.
+    int arg = 0;
+    for (const char *c = record.format; *c; c++) {
+        if (*c != '%') {
+            out += *c;
+            continue;
+        }
+        if (c[1] == '%') {
+            out += '%';
+            c++;
+            continue;
+        }
+
+        const char *start = c++;
+        string spec = "%";
+        while (*c && strchr("-+ #0123456789.", *c))
+            spec += *c++;
+        while (*c && strchr("hlzjtL", *c))
+            c++;
+        if (!*c || arg >= record.count) {
+            out.append(start, *c ? c + 1 - start : c - start);
+            if (!*c)
+                break;
+            continue;
+        }
+
+        const Log::Arg &a = record.args[arg++];
+        switch (*c) {
+        case 'd':
+        case 'i':
+            snprintf(buffer, sizeof(buffer), (spec + "ll" + *c).c_str(), a.i);
+            break;
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'o':
+            snprintf(buffer, sizeof(buffer), (spec + "ll" + *c).c_str(), a.u);
+            break;
+        case 'c':
+            snprintf(buffer, sizeof(buffer), (spec + *c).c_str(), int(a.i));
+            break;
+        case 'e':
+        case 'E':
+        case 'f':
+        case 'F':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+            snprintf(buffer, sizeof(buffer), (spec + *c).c_str(), a.d);
+            break;
+        case 's':
+            // Strings may be longer than the buffer
+            if (spec == "%") {
+                out += a.s ? a.s : "(null)";
+                continue;
+            }
+            snprintf(buffer, sizeof(buffer), (spec + *c).c_str(), a.s ? a.s : "(null)");
+            break;
+        case 'p':
+            snprintf(buffer, sizeof(buffer), (spec + *c).c_str(), a.p);
+            break;
+        default:
+            out.append(start, c + 1 - start);
+            continue;
+        }
+        out += buffer;
+    }
+}
+
+bool Drain::drain(bool all) {
+    vector<shared_ptr<ThreadQueue>> queues;
+    {
+        unique_lock < mutex > lk(m_mutex);
+        queues = m_queues;
+    }
+
+    // Taken before popping: anything logged before it is either popped now
+    // or still being pushed, which HOLD leaves time for
+    chrono::system_clock::time_point due = chrono::system_clock::now() - HOLD;
+    const size_t batch_size = 64;
+    Log::Record batch[batch_size];
+    bool any = false;
+    bool exited = false;
+    for (auto &queue : queues) {
+        size_t count;
+        while ((count = queue->records.pop(batch, batch_size))) {
+            m_pending.insert(m_pending.end(), batch, batch + count);
+            any = true;
+        }
+        if (!queue->alive && queue->records.empty())
+            exited = true;
+    }
+
+    // Each queue is in order already, a stable sort keeps records with the
+    // same time in the order their thread logged them
+    stable_sort(m_pending.begin(), m_pending.end(), [](const Log::Record &a, const Log::Record &b) {
+        return a.time < b.time;
+    });
+    size_t written = 0;
+    string line;
+    for (; written < m_pending.size() && (all || m_pending[written].time <= due); written++) {
+        const Log::Record &record = m_pending[written];
+        line.clear();
+        format(record, line);
+        line += '\n';
+        fwrite(line.data(), 1, line.size(), record.level <= LOG_LEVEL_WARNING ? stderr : stdout);
+    }
+    if (written) {
+        m_pending.erase(m_pending.begin(), m_pending.begin() + written);
+        fflush(stdout);
+        fflush(stderr);
+        any = true;
+    }
+
+    if (exited) {
+        unique_lock < mutex > lk(m_mutex);
+        for (size_t i = 0; i < m_queues.size();) {
+            if (!m_queues[i]->alive && m_queues[i]->records.empty()) {
+                m_queues[i] = m_queues.back();
+                m_queues.pop_back();
+            } else {
+                i++;
+            }
+        }
+    }
+    return any;
+}
+
+void Drain::run() {
+    unique_lock < mutex > lk(m_mutex);
+    while (m_running) {
+        uint64_t request = m_flush_requested;
+        // A flush writes everything logged before it, held back or not
+        bool flushing = request > m_flushed;
+        lk.unlock();
+        bool any = drain(flushing);
+        lk.lock();
+
+        if (request > m_flushed) {
+            m_flushed = request;
+            m_flushed_cv.notify_all();
+        }
+        if (!any && m_running && m_flush_requested == m_flushed)
+            m_cv.wait_for(lk, m_pending.empty() ? chrono::milliseconds(10) : HOLD);
+    }
+    lk.unlock();
+    drain(true);
+    lk.lock();
+    m_flushed_cv.notify_all();
+}
+
+Drain& drainInstance() {
+    static Drain drain;
+    return drain;
+}
+
+// Marks the queue as abandoned when its thread exits
+struct ThreadHandle {
+    shared_ptr<ThreadQueue> queue;
+    ~ThreadHandle() {
+        if (queue)
+            queue->alive = false;
+    }
+};
+thread_local ThreadHandle t_handle;
+
+}
+
+void Log::push(const Record &record) {
+    if (!t_handle.queue)
+        t_handle.queue = drainInstance().attach();
+    if (!t_handle.queue->records.push(record))
+        drainInstance().dropped.fetch_add(1, memory_order_relaxed);
+}
+
+void Log::flush() {
+    drainInstance().flush();
+}
+
+uint64_t Log::dropped() {
+    return drainInstance().dropped.load(memory_order_relaxed);
+}
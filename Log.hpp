@@ -0,0 +1,150 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <type_traits>
+#include <stdint.h>
+
+using namespace std;
+
+#define LOG_LEVEL_ERROR   0
+#define LOG_LEVEL_WARNING 1
+#define LOG_LEVEL_INFO    2
+#define LOG_LEVEL_DEBUG   3
+
+// Messages above this level are compiled out, debug messages only make it
+// into debug builds. It is also the runtime level until setLevel() is called.
+#ifndef LOG_LEVEL
+#ifdef NDEBUG
+#define LOG_LEVEL LOG_LEVEL_INFO
+#else
+#define LOG_LEVEL LOG_LEVEL_DEBUG
+#endif
+#endif
+
+// Asynchronous logger
+//
+// Logging a message stores the format string pointer and the raw arguments
+// in a queue owned by the calling thread, no formatting, locking or I/O
+// happens on the caller's thread. A background thread drains the queues,
+// merges them in time order, formats the messages and writes them to stdout.
+// Messages are held back for a few milliseconds, so that one logged on a
+// thread that was preempted before it could push it is still written in
+// order.
+//
+// Because formatting is deferred, the format must be a string literal and
+// %s arguments must outlive the message, such as string literals or the
+// results of libusb_error_name() and libusb_strerror(). At most MAX_ARGS
+// arguments are stored. When a thread's queue is full the message is
+// dropped and counted.
+class Log {
+public:
+    static const int MAX_ARGS = 6;
+
+    union Arg {
+        long long i;
+        unsigned long long u;
+        double d;
+        const char *s;
+        const void *p;
+    };
+
+    struct Record {
+        chrono::system_clock::time_point time;
+        const char *format;
+        uint8_t level;
+        uint8_t count;
+        Arg args[MAX_ARGS];
+    };
+
+    // Messages above the runtime level are dropped on the caller's thread
+    static void setLevel(int level) {
+        s_level.store(level, memory_order_relaxed);
+    }
+    static bool enabled(int level) {
+        return level <= s_level.load(memory_order_relaxed);
+    }
+
+    template<typename ... Args>
+    static void write(int level, const char *format, Args ... args) {
+        static_assert(sizeof...(Args) <= MAX_ARGS, "Too many log arguments");
+        if (!enabled(level))
+            return;
+        Record record;
+        record.time = chrono::system_clock::now();
+        record.format = format;
+        record.level = uint8_t(level);
+        record.count = uint8_t(sizeof...(Args));
+        store(record.args, args...);
+        push(record);
+    }
+
+    // Waits until every message logged before the call has been written
+    static void flush();
+
+    static uint64_t dropped();
+
+private:
+    static atomic<int> s_level;
+
+    static void push(const Record &record);
+
+    static void store(Arg *args) {
+    }
+    template<typename T, typename ... Rest>
+    static void store(Arg *args, T value, Rest ... rest) {
+        *args = arg(value);
+        store(args + 1, rest...);
+    }
+
+    static Arg arg(const char *value) {
+        Arg a;
+        a.s = value;
+        return a;
+    }
+    template<typename T>
+    static typename enable_if<is_integral<T>::value || is_enum<T>::value, Arg>::type arg(T value) {
+        Arg a;
+        if (is_signed<T>::value)
+            a.i = (long long) value;
+        else
+            a.u = (unsigned long long) value;
+        return a;
+    }
+    template<typename T>
+    static typename enable_if<is_floating_point<T>::value, Arg>::type arg(T value) {
+        Arg a;
+        a.d = value;
+        return a;
+    }
+    template<typename T>
+    static typename enable_if<is_pointer<T>::value, Arg>::type arg(T value) {
+        Arg a;
+        a.p = (const void*) value;
+        return a;
+    }
+};
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) Log::write(LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define LOG_ERROR(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_WARNING
+#define LOG_WARNING(...) Log::write(LOG_LEVEL_WARNING, __VA_ARGS__)
+#else
+#define LOG_WARNING(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(...) Log::write(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) Log::write(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) do {} while (0)
+#endif
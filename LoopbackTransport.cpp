@@ -0,0 +1,217 @@
+#include "LoopbackTransport.hpp"
+
+#include <string.h>
+
+LoopbackTransport::LoopbackTransport(const LoopbackConfig &config) :
+        m_config(config), m_random(config.seed) {
+    m_thread = thread(&LoopbackTransport::run, this);
+}
+
+LoopbackTransport::~LoopbackTransport() {
+    {
+        unique_lock < mutex > lk(m_mutex);
+        m_running = false;
+        m_cv.notify_all();
+    }
+    m_thread.join();
+}
+
+void LoopbackTransport::unplug() {
+    unique_lock < mutex > lk(m_mutex);
+    if (!m_plugged)
+        return;
+    m_plugged = false;
+
+    for (auto &out : m_out)
+        m_completions.push_back( { out.transfer, LIBUSB_TRANSFER_NO_DEVICE });
+    m_out.clear();
+    for (auto &in : m_in) {
+        for (auto xfr : in)
+            m_completions.push_back( { xfr, LIBUSB_TRANSFER_NO_DEVICE });
+        in.clear();
+    }
+    m_echoes.clear();
+    m_cv.notify_all();
+}
+
+void LoopbackTransport::flush() {
+    unique_lock < mutex > lk(m_mutex);
+    m_idle_cv.wait(lk, [this] {
+        return !m_running || (m_completions.empty() && !m_delivering);
+    });
+}
+
+int LoopbackTransport::claimInterface(int interface_number) {
+    unique_lock < mutex > lk(m_mutex);
+    return m_plugged ? LIBUSB_SUCCESS : LIBUSB_ERROR_NO_DEVICE;
+}
+
+int LoopbackTransport::releaseInterface(int interface_number) {
+    unique_lock < mutex > lk(m_mutex);
+    return m_plugged ? LIBUSB_SUCCESS : LIBUSB_ERROR_NO_DEVICE;
+}
+
+int LoopbackTransport::getSerial(uint8_t *data, int length) {
+    if (length <= 0)
+        return LIBUSB_ERROR_INVALID_PARAM;
+    int size = int(m_config.serial.size()) < length - 1 ? int(m_config.serial.size()) : length - 1;
+    memcpy(data, m_config.serial.data(), size);
+    data[size] = 0;
+    return size;
+}
+
+int LoopbackTransport::getMaxPacketSize(uint8_t endpoint) {
+    return m_config.max_packet_size;
+}
+
+int LoopbackTransport::submit(struct libusb_transfer *transfer) {
+    unique_lock < mutex > lk(m_mutex);
+    if (!m_plugged)
+        return LIBUSB_ERROR_NO_DEVICE;
+
+    if (transfer->endpoint & 0x80) {
+        m_in[transfer->endpoint & 0x0F].push_back(transfer);
+    } else {
+        auto due = chrono::steady_clock::now() + chrono::microseconds(m_config.latency_us);
+        m_out.push_back( { due, transfer });
+    }
+    m_cv.notify_all();
+    return LIBUSB_SUCCESS;
+}
+
+int LoopbackTransport::cancel(struct libusb_transfer *transfer) {
+    unique_lock < mutex > lk(m_mutex);
+    if (transfer->endpoint & 0x80) {
+        auto &in = m_in[transfer->endpoint & 0x0F];
+        for (auto it = in.begin(); it != in.end(); ++it) {
+            if (*it == transfer) {
+                in.erase(it);
+                m_completions.push_back( { transfer, LIBUSB_TRANSFER_CANCELLED });
+                m_cv.notify_all();
+                return LIBUSB_SUCCESS;
+            }
+        }
+    } else {
+        for (auto it = m_out.begin(); it != m_out.end(); ++it) {
+            if (it->transfer == transfer) {
+                m_out.erase(it);
+                m_completions.push_back( { transfer, LIBUSB_TRANSFER_CANCELLED });
+                m_cv.notify_all();
+                return LIBUSB_SUCCESS;
+            }
+        }
+    }
+    return LIBUSB_ERROR_NOT_FOUND;
+}
+
+int LoopbackTransport::clearHalt(uint8_t endpoint) {
+    unique_lock < mutex > lk(m_mutex);
+    if (!m_plugged)
+        return LIBUSB_ERROR_NO_DEVICE;
+    if (!(endpoint & 0x80) && m_halted[endpoint & 0x0F]) {
+        m_halted[endpoint & 0x0F] = false;
+        halts_cleared++;
+    }
+    return LIBUSB_SUCCESS;
+}
+
+chrono::steady_clock::time_point LoopbackTransport::process(chrono::steady_clock::time_point now) {
+    uniform_real_distribution<double> chance(0, 1);
+
+    while (!m_out.empty() && m_out.front().due <= now) {
+        struct libusb_transfer *xfr = m_out.front().transfer;
+        m_out.pop_front();
+        bool &halted = m_halted[xfr->endpoint & 0x0F];
+        if (!halted && m_config.stall > 0 && chance(m_random) < m_config.stall) {
+            halted = true;
+            stalls++;
+        }
+        if (halted) {
+            xfr->actual_length = 0;
+            m_completions.push_back( { xfr, LIBUSB_TRANSFER_STALL });
+            continue;
+        }
+        xfr->actual_length = xfr->length;
+        m_completions.push_back( { xfr, LIBUSB_TRANSFER_COMPLETED });
+        if (xfr->length && xfr->length % m_config.max_packet_size == 0) {
+            if (xfr->flags & LIBUSB_TRANSFER_ADD_ZERO_PACKET)
+                zero_packets++;
+            else
+                unterminated++;
+        }
+
+        if (m_config.loss > 0 && chance(m_random) < m_config.loss) {
+            lost++;
+            continue;
+        }
+        uint8_t endpoint = uint8_t(0x80 | xfr->endpoint);
+        if (!m_config.split_coalesced) {
+            m_echoes.push_back( { endpoint, vector<uint8_t>(xfr->buffer, xfr->buffer + xfr->length) });
+            continue;
+        }
+        for (int pos = 0; pos + 2 <= xfr->length;) {
+            int size = xfr->buffer[pos] | (xfr->buffer[pos + 1] << 8);
+            pos += 2;
+            // A malformed transfer, the rest is lost
+            if (pos + size > xfr->length)
+                break;
+            m_echoes.push_back( { endpoint, vector<uint8_t>(xfr->buffer + pos, xfr->buffer + pos + size) });
+            pos += size;
+        }
+    }
+
+    // Echoes wait for the host to queue an IN transfer, as they would in the firmware
+    while (!m_echoes.empty()) {
+        Echo &echo = m_echoes.front();
+        auto &in = m_in[echo.endpoint & 0x0F];
+        if (in.empty())
+            break;
+        struct libusb_transfer *xfr = in.front();
+        in.pop_front();
+
+        int length = int(echo.data.size());
+        enum libusb_transfer_status status = LIBUSB_TRANSFER_COMPLETED;
+        if (length > xfr->length) {
+            length = xfr->length;
+            status = LIBUSB_TRANSFER_OVERFLOW;
+        }
+        memcpy(xfr->buffer, echo.data.data(), length);
+        xfr->actual_length = length;
+        m_completions.push_back( { xfr, status });
+        m_echoes.pop_front();
+        echoed++;
+    }
+
+    return m_out.empty() ? chrono::steady_clock::time_point::max() : m_out.front().due;
+}
+
+void LoopbackTransport::run() {
+    vector<Completion> completions;
+    unique_lock < mutex > lk(m_mutex);
+    while (m_running) {
+        auto next = process(chrono::steady_clock::now());
+
+        if (m_completions.empty()) {
+            if (next == chrono::steady_clock::time_point::max())
+                m_cv.wait(lk);
+            else
+                m_cv.wait_until(lk, next);
+            continue;
+        }
+
+        // Callbacks may submit again, so they run without the lock
+        completions.swap(m_completions);
+        m_delivering = true;
+        lk.unlock();
+        for (auto &completion : completions) {
+            completion.transfer->status = completion.status;
+            completion.transfer->callback(completion.transfer);
+        }
+        completions.clear();
+        lk.lock();
+        m_delivering = false;
+        if (m_completions.empty())
+            m_idle_cv.notify_all();
+    }
+    m_idle_cv.notify_all();
+}
@@ -0,0 +1,132 @@
+#pragma once
+extern "C" {
+#include "libusb.h"
+}
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+#include "UsbTransport.hpp"
+
+using namespace std;
+
+struct LoopbackConfig {
+    // Serial number string descriptor
+    string serial = "00000001";
+
+    uint16_t max_packet_size = 64;
+
+    // Time from submitting an OUT transfer until it completes and its data
+    // can be received on the matching IN endpoint
+    unsigned int latency_us = 0;
+
+    // Probability (0-1) that the data of an OUT transfer is not echoed back
+    double loss = 0;
+
+    // Seed for the packet loss, so runs can be repeated
+    uint32_t seed = 1;
+
+    // Split every OUT transfer into the payloads Device packs into it when
+    // coalescing, each behind its 2 byte little endian length (see
+    // Coalescer), and echo each payload on its own, as firmware that
+    // understands coalesced transfers does
+    bool split_coalesced = false;
+
+    // Probability (0-1) that an OUT transfer stalls its endpoint. It completes
+    // with LIBUSB_TRANSFER_STALL, as does every later OUT transfer to the
+    // endpoint until clearHalt() is called.
+    double stall = 0;
+};
+
+// Software stand-in for the echo firmware
+//
+// Data sent on an OUT endpoint is returned on the IN endpoint with the same
+// number, as the ucdev demo firmware does for OUT1 and IN1. Transfers
+// complete through their callback on a thread of the transport, which plays
+// the part of the libusb events thread.
+//
+// unplug() simulates the device being pulled: every pending transfer
+// completes with LIBUSB_TRANSFER_NO_DEVICE and further submits fail with
+// LIBUSB_ERROR_NO_DEVICE.
+class LoopbackTransport: public UsbTransport {
+public:
+    LoopbackTransport(const LoopbackConfig &config = LoopbackConfig());
+    ~LoopbackTransport();
+
+    void unplug();
+    // Waits until every transfer that has completed so far has been passed to its callback
+    void flush();
+
+    libusb_device_handle* handle() override {
+        return nullptr;
+    }
+    libusb_device* device() override {
+        return nullptr;
+    }
+
+    int claimInterface(int interface_number) override;
+    int releaseInterface(int interface_number) override;
+    int getSerial(uint8_t *data, int length) override;
+    int getMaxPacketSize(uint8_t endpoint) override;
+
+    int submit(struct libusb_transfer *transfer) override;
+    int cancel(struct libusb_transfer *transfer) override;
+    int clearHalt(uint8_t endpoint) override;
+
+    // Payloads echoed back and payloads lost on purpose
+    atomic<uint64_t> echoed { 0 };
+    atomic<uint64_t> lost { 0 };
+    // OUT transfers ending on a packet boundary, with a zero length packet
+    // (LIBUSB_TRANSFER_ADD_ZERO_PACKET) and without
+    atomic<uint64_t> zero_packets { 0 };
+    atomic<uint64_t> unterminated { 0 };
+    // Endpoints stalled on purpose and halts cleared
+    atomic<uint64_t> stalls { 0 };
+    atomic<uint64_t> halts_cleared { 0 };
+
+private:
+    struct Echo {
+        uint8_t endpoint;
+        vector<uint8_t> data;
+    };
+    struct Completion {
+        struct libusb_transfer *transfer;
+        enum libusb_transfer_status status;
+    };
+    struct PendingOut {
+        chrono::steady_clock::time_point due;
+        struct libusb_transfer *transfer;
+    };
+
+    LoopbackConfig m_config;
+    mt19937 m_random;
+
+    mutex m_mutex;
+    condition_variable m_cv;
+    condition_variable m_idle_cv;
+    bool m_running = true;
+    bool m_delivering = false;
+    bool m_plugged = true;
+    bool m_halted[16] = { };
+
+    // OUT transfers in submission order, which with a fixed latency is also
+    // the order in which they are due
+    deque<PendingOut> m_out;
+    deque<Echo> m_echoes;
+    deque<struct libusb_transfer*> m_in[16];
+    vector<Completion> m_completions;
+
+    thread m_thread;
+
+    void run();
+    // Moves everything that is due to m_completions, returns when the next thing is due
+    chrono::steady_clock::time_point process(chrono::steady_clock::time_point now);
+};
@@ -0,0 +1,140 @@
+#include "Metrics.hpp"
+
+#include <stdarg.h>
+#include <stdio.h>
+
+static const char *statusNames[EndpointMetrics::STATUSES] = { "completed", "error", "timed_out", "cancelled", "stall",
+        "no_device", "overflow" };
+
+void EndpointMetrics::record(const struct libusb_transfer *transfer, chrono::steady_clock::time_point submitted) {
+    transfers.fetch_add(1, memory_order_relaxed);
+    bytes.fetch_add(transfer->actual_length, memory_order_relaxed);
+    if (transfer->status >= 0 && transfer->status < STATUSES)
+        status[transfer->status].fetch_add(1, memory_order_relaxed);
+    latency.record(chrono::duration_cast < chrono::microseconds > (chrono::steady_clock::now() - submitted).count());
+}
+
+// Finds the same endpoint in an earlier snapshot to compute rates
+static const MetricsSnapshot::Endpoint* previousEndpoint(const MetricsSnapshot *previous, uint8_t endpoint,
+        double &seconds, const MetricsSnapshot &current) {
+    if (!previous)
+        return nullptr;
+    seconds = chrono::duration<double>(current.time - previous->time).count();
+    if (seconds <= 0)
+        return nullptr;
+    for (auto &ep : previous->endpoints)
+        if (ep.endpoint == endpoint)
+            return &ep;
+    return nullptr;
+}
+
+// Formats straight onto the end of out, however long the result
+static void appendf(string &out, const char *format, ...) {
+    char buffer[256];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    if (length < 0)
+        return;
+    if (size_t(length) < sizeof(buffer)) {
+        out.append(buffer, length);
+        return;
+    }
+    // Too long for the buffer, format again into the string itself
+    size_t size = out.size();
+    out.resize(size + length + 1);
+    va_start(args, format);
+    vsnprintf(&out[size], length + 1, format, args);
+    va_end(args);
+    out.resize(size + length);
+}
+
+static void appendHistogramText(string &out, const char *name, const HistogramSnapshot &h) {
+    appendf(out, " %s n=%llu p50=%llu p90=%llu p99=%llu p99.9=%llu max=%llu", name, (unsigned long long) h.count,
+            (unsigned long long) h.p50, (unsigned long long) h.p90, (unsigned long long) h.p99,
+            (unsigned long long) h.p999, (unsigned long long) h.max);
+}
+
+static void appendHistogramJson(string &out, const char *name, const HistogramSnapshot &h) {
+    appendf(out, "\"%s\":{\"count\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}", name,
+            (unsigned long long) h.count, (unsigned long long) h.p50, (unsigned long long) h.p90,
+            (unsigned long long) h.p99, (unsigned long long) h.p999, (unsigned long long) h.max);
+}
+
+string MetricsSnapshot::toText(const MetricsSnapshot *previous) const {
+    string out;
+    for (auto &ep : endpoints) {
+        appendf(out, "EP %02X: transfers=%llu bytes=%llu", ep.endpoint, (unsigned long long) ep.transfers,
+                (unsigned long long) ep.bytes);
+        double seconds = 0;
+        const Endpoint *prev = previousEndpoint(previous, ep.endpoint, seconds, *this);
+        if (prev)
+            appendf(out, " transfers/s=%.0f bytes/s=%.0f", (ep.transfers - prev->transfers) / seconds,
+                    (ep.bytes - prev->bytes) / seconds);
+        for (int i = 0; i < EndpointMetrics::STATUSES; i++)
+            if (ep.status[i] && i != LIBUSB_TRANSFER_COMPLETED)
+                appendf(out, " %s=%llu", statusNames[i], (unsigned long long) ep.status[i]);
+        appendHistogramText(out, "latency_us", ep.latency);
+        if (!(ep.endpoint & 0x80)) {
+            appendf(out, " queue_depth=%llu in_flight=%d", (unsigned long long) ep.queue_depth, ep.in_flight);
+            appendHistogramText(out, "queue_latency_us", ep.queue_latency);
+        }
+        out += '\n';
+    }
+    appendf(out, "Device: recv_dropped=%llu send_dropped=%llu send_errors=%llu recv_queue_depth=%llu buffers_available=%llu",
+            (unsigned long long) recv_dropped, (unsigned long long) send_dropped, (unsigned long long) send_errors,
+            (unsigned long long) recv_queue_depth, (unsigned long long) buffers_available);
+    if (shared_ring_dropped)
+        appendf(out, " shared_ring_dropped=%llu", (unsigned long long) shared_ring_dropped);
+    if (capture_dropped)
+        appendf(out, " capture_dropped=%llu", (unsigned long long) capture_dropped);
+    if (pcap_dropped)
+        appendf(out, " pcap_dropped=%llu", (unsigned long long) pcap_dropped);
+    if (messages_decoded || bad_checksums || unknown_types || skipped_bytes)
+        appendf(out, " messages_decoded=%llu bad_checksums=%llu unknown_types=%llu skipped_bytes=%llu",
+                (unsigned long long) messages_decoded, (unsigned long long) bad_checksums,
+                (unsigned long long) unknown_types, (unsigned long long) skipped_bytes);
+    appendHistogramText(out, "echo_turnaround_us", echo_turnaround);
+    out += '\n';
+    return out;
+}
+
+string MetricsSnapshot::toJson(const MetricsSnapshot *previous) const {
+    string out = "{\"endpoints\":[";
+    for (size_t i = 0; i < endpoints.size(); i++) {
+        const Endpoint &ep = endpoints[i];
+        if (i)
+            out += ',';
+        appendf(out, "{\"endpoint\":%d,\"transfers\":%llu,\"bytes\":%llu,", ep.endpoint,
+                (unsigned long long) ep.transfers, (unsigned long long) ep.bytes);
+        double seconds = 0;
+        const Endpoint *prev = previousEndpoint(previous, ep.endpoint, seconds, *this);
+        if (prev)
+            appendf(out, "\"transfers_per_second\":%.1f,\"bytes_per_second\":%.1f,",
+                    (ep.transfers - prev->transfers) / seconds, (ep.bytes - prev->bytes) / seconds);
+        out += "\"status\":{";
+        for (int s = 0; s < EndpointMetrics::STATUSES; s++)
+            appendf(out, "%s\"%s\":%llu", s ? "," : "", statusNames[s], (unsigned long long) ep.status[s]);
+        out += "},";
+        appendHistogramJson(out, "latency_us", ep.latency);
+        if (!(ep.endpoint & 0x80)) {
+            appendf(out, ",\"queue_depth\":%llu,\"in_flight\":%d,", (unsigned long long) ep.queue_depth, ep.in_flight);
+            appendHistogramJson(out, "queue_latency_us", ep.queue_latency);
+        }
+        out += '}';
+    }
+    appendf(out, "],\"recv_dropped\":%llu,\"send_dropped\":%llu,\"send_errors\":%llu,\"recv_queue_depth\":%llu,"
+            "\"buffers_available\":%llu,\"shared_ring_dropped\":%llu,\"capture_dropped\":%llu,"
+            "\"pcap_dropped\":%llu,\"messages_decoded\":%llu,\"bad_checksums\":%llu,\"unknown_types\":%llu,"
+            "\"skipped_bytes\":%llu,",
+            (unsigned long long) recv_dropped, (unsigned long long) send_dropped, (unsigned long long) send_errors,
+            (unsigned long long) recv_queue_depth, (unsigned long long) buffers_available,
+            (unsigned long long) shared_ring_dropped, (unsigned long long) capture_dropped,
+            (unsigned long long) pcap_dropped, (unsigned long long) messages_decoded,
+            (unsigned long long) bad_checksums, (unsigned long long) unknown_types,
+            (unsigned long long) skipped_bytes);
+    appendHistogramJson(out, "echo_turnaround_us", echo_turnaround);
+    out += '}';
+    return out;
+}
@@ -0,0 +1,83 @@
+#pragma once
+extern "C" {
+#include "libusb.h"
+}
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "Histogram.hpp"
+
+using namespace std;
+
+// Counters for one endpoint, updated on the libusb events thread as
+// transfers complete
+struct EndpointMetrics {
+    // One counter per libusb_transfer_status
+    static const int STATUSES = LIBUSB_TRANSFER_OVERFLOW + 1;
+
+    explicit EndpointMetrics(uint8_t endpoint) :
+            endpoint(endpoint) {
+    }
+
+    const uint8_t endpoint;
+    atomic<uint64_t> transfers { 0 };
+    atomic<uint64_t> bytes { 0 };
+    atomic<uint64_t> status[STATUSES] = { };
+    // Time from submitting a transfer until it completes, in microseconds
+    Histogram latency;
+
+    void record(const struct libusb_transfer *transfer, chrono::steady_clock::time_point submitted);
+};
+
+// Copy of the metrics of a Device
+//
+// Every value is read atomically on its own, the snapshot as a whole is not
+// taken at a single instant.
+struct MetricsSnapshot {
+    struct Endpoint {
+        uint8_t endpoint = 0;
+        uint64_t transfers = 0;
+        uint64_t bytes = 0;
+        uint64_t status[EndpointMetrics::STATUSES] = { };
+        HistogramSnapshot latency;
+
+        // Send queue of OUT endpoints
+        size_t queue_depth = 0;
+        int in_flight = 0;
+        HistogramSnapshot queue_latency;
+    };
+
+    chrono::steady_clock::time_point time;
+    vector<Endpoint> endpoints;
+
+    // Time from an IN transfer completing until its data is sent back, in microseconds
+    HistogramSnapshot echo_turnaround;
+
+    uint64_t recv_dropped = 0;
+    uint64_t send_dropped = 0;
+    uint64_t send_errors = 0;
+    size_t recv_queue_depth = 0;
+    size_t buffers_available = 0;
+    // Packets the shared ring had no room for, see DeviceConfig::shared_ring_prefix
+    uint64_t shared_ring_dropped = 0;
+    // Completions the capture file had no room for, see DeviceConfig::capture_prefix
+    uint64_t capture_dropped = 0;
+    // Records the pcap writer could not keep up with, see DeviceConfig::pcap_prefix
+    uint64_t pcap_dropped = 0;
+    // Messages decoded by the device's FrameParser, frames it rejected for
+    // their checksum or type, and bytes it skipped to find the next frame,
+    // see DeviceConfig::make_parser
+    uint64_t messages_decoded = 0;
+    uint64_t bad_checksums = 0;
+    uint64_t unknown_types = 0;
+    uint64_t skipped_bytes = 0;
+
+    // Given an earlier snapshot, transfer and byte rates are included,
+    // computed over the time between both snapshots
+    string toText(const MetricsSnapshot *previous = nullptr) const;
+    string toJson(const MetricsSnapshot *previous = nullptr) const;
+};
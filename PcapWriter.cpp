@@ -0,0 +1,204 @@
+#include "PcapWriter.hpp"
+
+#include <string.h>
+
+// Linux errno values as usbmon reports them, also when written on Windows
+#define USBMON_ENOENT      2
+#define USBMON_ENODEV     19
+#define USBMON_EINVAL     22
+#define USBMON_EPIPE      32
+#define USBMON_EPROTO     71
+#define USBMON_EOVERFLOW  75
+#define USBMON_ETIMEDOUT 110
+#define USBMON_EINPROGRESS 115
+
+struct PcapFileHeader {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t network;
+};
+
+struct PcapRecordHeader {
+    uint32_t ts_sec;
+    // Nanoseconds, as the file magic says
+    uint32_t ts_nsec;
+    uint32_t incl_len;
+    uint32_t orig_len;
+};
+
+PcapWriter::PcapWriter(const string &path, uint16_t bus, uint8_t device, size_t buffer_size, size_t buffers) :
+        m_bus(bus), m_device(device), m_buffer_size(buffer_size) {
+    m_file = fopen(path.c_str(), "wb");
+    if (!m_file)
+        return;
+    // Whole buffers are written at a time, stdio buffering would only copy them again
+    setvbuf(m_file, nullptr, _IONBF, 0);
+
+    PcapFileHeader header = { 0xA1B23C4D, 2, 4, 0, 0, 0x40000, LINKTYPE_USB_LINUX_MMAPPED };
+    fwrite(&header, sizeof(header), 1, m_file);
+
+    for (size_t i = 0; i < (buffers ? buffers : 1); i++) {
+        m_buffers.emplace_back(new vector<uint8_t>());
+        m_buffers.back()->reserve(m_buffer_size);
+        m_free.push_back(m_buffers.back().get());
+    }
+    m_thread = thread(&PcapWriter::run, this);
+}
+
+PcapWriter::~PcapWriter() {
+    if (!m_file)
+        return;
+    {
+        unique_lock < mutex > lk(m_mutex);
+        m_running = false;
+        m_cv.notify_all();
+    }
+    m_thread.join();
+    fclose(m_file);
+}
+
+int32_t PcapWriter::statusErrno(enum libusb_transfer_status status) {
+    switch (status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+        return 0;
+    case LIBUSB_TRANSFER_TIMED_OUT:
+        return -USBMON_ETIMEDOUT;
+    case LIBUSB_TRANSFER_CANCELLED:
+        return -USBMON_ENOENT;
+    case LIBUSB_TRANSFER_STALL:
+        return -USBMON_EPIPE;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+        return -USBMON_ENODEV;
+    case LIBUSB_TRANSFER_OVERFLOW:
+        return -USBMON_EOVERFLOW;
+    case LIBUSB_TRANSFER_ERROR:
+    default:
+        return -USBMON_EPROTO;
+    }
+}
+
+void PcapWriter::submitted(const struct libusb_transfer *transfer) {
+    event(transfer, 'S', -USBMON_EINPROGRESS, !(transfer->endpoint & 0x80));
+}
+
+void PcapWriter::submitFailed(const struct libusb_transfer *transfer, int error) {
+    event(transfer, 'E', error == LIBUSB_ERROR_NO_DEVICE ? -USBMON_ENODEV : -USBMON_EINVAL, false);
+}
+
+void PcapWriter::completed(const struct libusb_transfer *transfer) {
+    event(transfer, 'C', statusErrno(transfer->status), (transfer->endpoint & 0x80) != 0);
+}
+
+void PcapWriter::event(const struct libusb_transfer *transfer, uint8_t type, int32_t status, bool with_data) {
+    static const uint8_t transfer_types[] = { 2, 0, 3, 1 };
+    UsbmonHeader header = { };
+    header.id = uint64_t(uintptr_t(transfer));
+    header.type = type;
+    header.transfer_type = transfer->type < sizeof(transfer_types) ? transfer_types[transfer->type] : 3;
+    header.endpoint = transfer->endpoint;
+    header.device = m_device;
+    header.bus = m_bus;
+    header.flag_setup = '-';
+    header.status = status;
+    int length = type == 'C' ? transfer->actual_length : transfer->length;
+    header.length = length > 0 ? uint32_t(length) : 0;
+    header.captured = with_data ? header.length : 0;
+    header.flag_data = with_data ? 0 : (transfer->endpoint & 0x80) ? '<' : '>';
+    append(header, transfer->buffer,
+            chrono::duration_cast < chrono::nanoseconds > (chrono::system_clock::now().time_since_epoch()).count());
+}
+
+void PcapWriter::append(const UsbmonHeader &header, const uint8_t *data, uint64_t unix_ns, bool wait) {
+    if (!m_file)
+        return;
+    size_t size = sizeof(PcapRecordHeader) + sizeof(UsbmonHeader) + header.captured;
+    if (size > m_buffer_size) {
+        m_dropped.fetch_add(1, memory_order_relaxed);
+        return;
+    }
+
+    PcapRecordHeader record;
+    record.ts_sec = uint32_t(unix_ns / 1000000000);
+    record.ts_nsec = uint32_t(unix_ns % 1000000000);
+    record.incl_len = uint32_t(sizeof(UsbmonHeader) + header.captured);
+    record.orig_len = record.incl_len;
+    UsbmonHeader usbmon = header;
+    usbmon.ts_sec = int64_t(unix_ns / 1000000000);
+    usbmon.ts_usec = int32_t(unix_ns % 1000000000 / 1000);
+
+    unique_lock < mutex > lk(m_mutex);
+    if (!m_current || m_current->size() + size > m_buffer_size) {
+        if (m_current) {
+            m_full.push_back(m_current);
+            m_cv.notify_all();
+            m_current = nullptr;
+        }
+        if (m_free.empty() && wait)
+            m_free_cv.wait(lk, [this] {
+                return !m_free.empty();
+            });
+        if (m_free.empty()) {
+            m_dropped.fetch_add(1, memory_order_relaxed);
+            return;
+        }
+        m_current = m_free.back();
+        m_free.pop_back();
+    }
+    const uint8_t *record_bytes = (const uint8_t*) &record;
+    const uint8_t *usbmon_bytes = (const uint8_t*) &usbmon;
+    m_current->insert(m_current->end(), record_bytes, record_bytes + sizeof(record));
+    m_current->insert(m_current->end(), usbmon_bytes, usbmon_bytes + sizeof(usbmon));
+    m_current->insert(m_current->end(), data, data + header.captured);
+    m_records.fetch_add(1, memory_order_relaxed);
+}
+
+void PcapWriter::flush() {
+    if (!m_file)
+        return;
+    unique_lock < mutex > lk(m_mutex);
+    uint64_t request = ++m_flush_requested;
+    m_cv.notify_all();
+    m_flushed_cv.wait(lk, [this, request] {
+        return m_flushed >= request;
+    });
+}
+
+void PcapWriter::run() {
+    unique_lock < mutex > lk(m_mutex);
+    while (true) {
+        bool timed_out = false;
+        if (m_full.empty() && m_running && m_flush_requested == m_flushed) {
+            if (m_cv.wait_for(lk, chrono::seconds(1)) == cv_status::no_timeout)
+                continue;
+            timed_out = true;
+        }
+
+        // Whatever has been collected goes out at least once a second
+        uint64_t request = m_flush_requested;
+        if ((timed_out || request > m_flushed || !m_running) && m_current && !m_current->empty()) {
+            m_full.push_back(m_current);
+            m_current = nullptr;
+        }
+        while (!m_full.empty()) {
+            vector<uint8_t> *buffer = m_full.front();
+            m_full.pop_front();
+            lk.unlock();
+            fwrite(buffer->data(), 1, buffer->size(), m_file);
+            buffer->clear();
+            lk.lock();
+            m_free.push_back(buffer);
+            m_free_cv.notify_all();
+        }
+        fflush(m_file);
+        if (request > m_flushed) {
+            m_flushed = request;
+            m_flushed_cv.notify_all();
+        }
+        if (!m_running)
+            break;
+    }
+}
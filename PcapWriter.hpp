@@ -0,0 +1,127 @@
+#pragma once
+extern "C" {
+#include "libusb.h"
+}
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdint.h>
+
+using namespace std;
+
+// Packet header of the Linux usbmon binary interface, as stored in pcap
+// files with link type LINKTYPE_USB_LINUX_MMAPPED. Host byte order.
+struct UsbmonHeader {
+    uint64_t id;
+    // 'S' submission, 'C' completion, 'E' submission error
+    uint8_t type;
+    // 0 isochronous, 1 interrupt, 2 control, 3 bulk
+    uint8_t transfer_type;
+    uint8_t endpoint;
+    uint8_t device;
+    uint16_t bus;
+    // '-' when there is no setup packet
+    uint8_t flag_setup;
+    // 0 when data follows
+    uint8_t flag_data;
+    int64_t ts_sec;
+    int32_t ts_usec;
+    // 0 or a negative Linux errno
+    int32_t status;
+    // Length of the transfer and of the data that follows
+    uint32_t length;
+    uint32_t captured;
+    uint8_t setup[8];
+    int32_t interval;
+    int32_t start_frame;
+    uint32_t transfer_flags;
+    uint32_t descriptors;
+};
+
+static_assert(sizeof(UsbmonHeader) == 64, "UsbmonHeader is a file format");
+
+// Writes transfers to a pcap file that Wireshark shows as usbmon traffic
+//
+// Records are collected in memory buffers under a short lock, a thread of the
+// writer writes out full buffers, and whatever is collected every second, so
+// the threads producing records never wait for I/O. When the disk cannot keep
+// up and every buffer is full, records are dropped and counted, unless the
+// caller asks to wait for a buffer. The file can be a FIFO for a live view
+// in Wireshark.
+class PcapWriter {
+public:
+    static const uint32_t LINKTYPE_USB_LINUX_MMAPPED = 220;
+
+    // bus and device go into every record, Wireshark shows them as the
+    // address. Check valid() afterwards.
+    PcapWriter(const string &path, uint16_t bus = 0, uint8_t device = 0, size_t buffer_size = 1 << 20,
+            size_t buffers = 4);
+    // Writes out everything collected and closes the file
+    ~PcapWriter();
+
+    bool valid() const {
+        return m_file != nullptr;
+    }
+
+    // The submission of a transfer, with the data of OUT transfers
+    void submitted(const struct libusb_transfer *transfer);
+    // A transfer that could not be submitted
+    void submitFailed(const struct libusb_transfer *transfer, int error);
+    // The completion of a transfer, with the data of IN transfers
+    void completed(const struct libusb_transfer *transfer);
+
+    // Writes one record, time in ns since the Unix epoch. With wait, a full
+    // set of buffers makes the caller wait until one has been written out
+    // instead of dropping the record, for converting files offline. Records
+    // larger than a buffer are dropped either way.
+    void append(const UsbmonHeader &header, const uint8_t *data, uint64_t unix_ns, bool wait = false);
+
+    // Waits until every record appended so far is in the file
+    void flush();
+
+    uint64_t records() const {
+        return m_records.load(memory_order_relaxed);
+    }
+    uint64_t dropped() const {
+        return m_dropped.load(memory_order_relaxed);
+    }
+
+    // libusb transfer status as the Linux errno usbmon reports
+    static int32_t statusErrno(enum libusb_transfer_status status);
+
+private:
+    FILE *m_file = nullptr;
+    uint16_t m_bus;
+    uint8_t m_device;
+    size_t m_buffer_size;
+
+    mutex m_mutex;
+    condition_variable m_cv;
+    condition_variable m_flushed_cv;
+    // Signalled when a buffer has been written out and is free again
+    condition_variable m_free_cv;
+    bool m_running = true;
+    // Buffer records are appended to, nullptr when every buffer is full
+    vector<uint8_t> *m_current = nullptr;
+    vector<unique_ptr<vector<uint8_t>>> m_buffers;
+    vector<vector<uint8_t>*> m_free;
+    deque<vector<uint8_t>*> m_full;
+    uint64_t m_flush_requested = 0;
+    uint64_t m_flushed = 0;
+
+    atomic<uint64_t> m_records { 0 };
+    atomic<uint64_t> m_dropped { 0 };
+
+    thread m_thread;
+
+    void run();
+    void event(const struct libusb_transfer *transfer, uint8_t type, int32_t status, bool with_data);
+};
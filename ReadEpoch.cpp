@@ -0,0 +1,81 @@
+#include "ReadEpoch.hpp"
+
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+
+using namespace std;
+
+namespace {
+
+const uint64_t IDLE = UINT64_MAX;
+const size_t SLOTS = 128;
+
+// The epoch a thread entered its read section at, IDLE outside of one
+struct alignas(64) Slot {
+    atomic<bool> owned { false };
+    atomic<uint64_t> epoch { IDLE };
+};
+
+Slot slots[SLOTS];
+atomic<uint64_t> global_epoch { 1 };
+// Readers that did not get a slot
+shared_mutex overflow;
+
+struct ThreadSlot {
+    Slot *slot = nullptr;
+    bool claimed = false;
+    int depth = 0;
+
+    ~ThreadSlot() {
+        if (slot)
+            slot->owned.store(false, memory_order_release);
+    }
+};
+
+thread_local ThreadSlot current;
+
+}
+
+ReadEpoch::Guard::Guard() {
+    ThreadSlot &t = current;
+    if (t.depth++)
+        return;
+    if (!t.claimed) {
+        t.claimed = true;
+        for (Slot &slot : slots) {
+            bool expected = false;
+            if (!slot.owned.load(memory_order_relaxed) && slot.owned.compare_exchange_strong(expected, true)) {
+                t.slot = &slot;
+                break;
+            }
+        }
+    }
+    // Sequentially consistent, so that either synchronize() sees this
+    // reader, or the reader sees what was published before synchronize()
+    if (t.slot)
+        t.slot->epoch.store(global_epoch.load());
+    else
+        overflow.lock_shared();
+}
+
+ReadEpoch::Guard::~Guard() {
+    ThreadSlot &t = current;
+    if (--t.depth)
+        return;
+    if (t.slot)
+        t.slot->epoch.store(IDLE, memory_order_release);
+    else
+        overflow.unlock_shared();
+}
+
+void ReadEpoch::synchronize() {
+    uint64_t epoch = global_epoch.fetch_add(1) + 1;
+    // Readers that entered since see the new epoch, or at least what was
+    // published before it, no need to wait for them
+    for (Slot &slot : slots)
+        while (slot.epoch.load() < epoch)
+            this_thread::yield();
+    unique_lock < shared_mutex > lk(overflow);
+}
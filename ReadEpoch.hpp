@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+
+// Epoch based reclamation for read mostly structures
+//
+// A reader marks its thread as reading with a Guard. A writer that has
+// unpublished an object calls synchronize(), which returns once every reader
+// that may still see the object has left, and then frees it.
+//
+// Each thread gets a slot of its own on first use, entering and leaving is a
+// store to that slot and touches nothing shared with the other readers. When
+// all slots are taken, readers fall back to a shared lock.
+class ReadEpoch {
+public:
+    // Read section, may be nested
+    class Guard {
+    public:
+        Guard();
+        ~Guard();
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+    };
+
+    // Waits until every read section entered before the call has been left.
+    // Must not be called from inside a read section.
+    static void synchronize();
+};
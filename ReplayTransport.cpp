@@ -0,0 +1,210 @@
+#include "ReplayTransport.hpp"
+
+#include <algorithm>
+#include <string.h>
+
+ReplayTransport::ReplayTransport(const ReplayConfig &config) :
+        m_config(config) {
+    if (m_reader.open(m_config.path)) {
+        while (const CaptureRecord *record = m_reader.next())
+            if ((record->endpoint & 0x80) && find(m_endpoints.begin(), m_endpoints.end(), record->endpoint)
+                    == m_endpoints.end())
+                m_endpoints.push_back(record->endpoint);
+        m_reader.rewind();
+        advance();
+    }
+    m_thread = thread(&ReplayTransport::run, this);
+}
+
+ReplayTransport::~ReplayTransport() {
+    {
+        unique_lock < mutex > lk(m_mutex);
+        m_running = false;
+        m_cv.notify_all();
+        m_finished_cv.notify_all();
+    }
+    m_thread.join();
+}
+
+bool ReplayTransport::replayable(uint8_t endpoint) const {
+    return m_config.in_endpoints.empty()
+            || find(m_config.in_endpoints.begin(), m_config.in_endpoints.end(), endpoint) != m_config.in_endpoints.end();
+}
+
+void ReplayTransport::advance() {
+    while ((m_next = m_reader.next())) {
+        if (m_next->status == LIBUSB_TRANSFER_NO_DEVICE)
+            break;
+        if (!(m_next->endpoint & 0x80) || m_next->status == LIBUSB_TRANSFER_CANCELLED)
+            continue;
+        // A packet no transfer is ever submitted for would hold up the replay
+        if (replayable(m_next->endpoint))
+            break;
+        skipped++;
+    }
+}
+
+void ReplayTransport::unplugLocked() {
+    if (!m_plugged)
+        return;
+    m_plugged = false;
+    for (auto &in : m_in) {
+        for (auto xfr : in)
+            m_completions.push_back( { xfr, LIBUSB_TRANSFER_NO_DEVICE });
+        in.clear();
+    }
+    m_cv.notify_all();
+}
+
+void ReplayTransport::unplug() {
+    unique_lock < mutex > lk(m_mutex);
+    unplugLocked();
+}
+
+bool ReplayTransport::finished() {
+    unique_lock < mutex > lk(m_mutex);
+    return !m_next;
+}
+
+void ReplayTransport::consumed(size_t count) {
+    unique_lock < mutex > lk(m_mutex);
+    m_outstanding = count < m_outstanding ? m_outstanding - count : 0;
+    m_cv.notify_all();
+}
+
+void ReplayTransport::waitFinished() {
+    unique_lock < mutex > lk(m_mutex);
+    m_finished_cv.wait(lk, [this] {
+        return !m_running || !m_next;
+    });
+}
+
+int ReplayTransport::claimInterface(int interface_number) {
+    unique_lock < mutex > lk(m_mutex);
+    return m_plugged ? LIBUSB_SUCCESS : LIBUSB_ERROR_NO_DEVICE;
+}
+
+int ReplayTransport::releaseInterface(int interface_number) {
+    unique_lock < mutex > lk(m_mutex);
+    return m_plugged ? LIBUSB_SUCCESS : LIBUSB_ERROR_NO_DEVICE;
+}
+
+int ReplayTransport::getSerial(uint8_t *data, int length) {
+    if (length <= 0)
+        return LIBUSB_ERROR_INVALID_PARAM;
+    if (!m_reader.header())
+        return LIBUSB_ERROR_IO;
+    const char *serial = m_reader.header()->serial;
+    int size = int(strnlen(serial, sizeof(m_reader.header()->serial)));
+    if (size > length - 1)
+        size = length - 1;
+    memcpy(data, serial, size);
+    data[size] = 0;
+    return size;
+}
+
+int ReplayTransport::getMaxPacketSize(uint8_t endpoint) {
+    return m_config.max_packet_size;
+}
+
+int ReplayTransport::submit(struct libusb_transfer *transfer) {
+    unique_lock < mutex > lk(m_mutex);
+    if (!m_plugged)
+        return LIBUSB_ERROR_NO_DEVICE;
+
+    if (transfer->endpoint & 0x80) {
+        m_in[transfer->endpoint & 0x0F].push_back(transfer);
+    } else {
+        transfer->actual_length = transfer->length;
+        m_completions.push_back( { transfer, LIBUSB_TRANSFER_COMPLETED });
+    }
+    m_cv.notify_all();
+    return LIBUSB_SUCCESS;
+}
+
+int ReplayTransport::cancel(struct libusb_transfer *transfer) {
+    unique_lock < mutex > lk(m_mutex);
+    auto &in = m_in[transfer->endpoint & 0x0F];
+    for (auto it = in.begin(); it != in.end(); ++it) {
+        if (*it == transfer) {
+            in.erase(it);
+            m_completions.push_back( { transfer, LIBUSB_TRANSFER_CANCELLED });
+            m_cv.notify_all();
+            return LIBUSB_SUCCESS;
+        }
+    }
+    // OUT transfers complete as soon as they are submitted
+    return LIBUSB_ERROR_NOT_FOUND;
+}
+
+chrono::steady_clock::time_point ReplayTransport::process(chrono::steady_clock::time_point now) {
+    while (m_next && m_plugged) {
+        // The time line starts with the first packet
+        if (!m_started) {
+            m_started = true;
+            m_start = now;
+            m_first_time_ns = m_next->time_ns;
+        }
+        if (m_next->status == LIBUSB_TRANSFER_NO_DEVICE) {
+            unplugLocked();
+            m_next = nullptr;
+            break;
+        }
+        if (!m_config.max_speed) {
+            auto due = m_start + chrono::nanoseconds(m_next->time_ns - m_first_time_ns);
+            if (due > now)
+                return due;
+        }
+
+        // A packet waits for the host to queue an IN transfer, as it would in the firmware
+        auto &in = m_in[m_next->endpoint & 0x0F];
+        if (in.empty() || (m_config.window && m_outstanding >= m_config.window))
+            break;
+        struct libusb_transfer *xfr = in.front();
+        in.pop_front();
+
+        int length = int(m_next->length);
+        enum libusb_transfer_status status = (enum libusb_transfer_status) m_next->status;
+        if (length > xfr->length) {
+            length = xfr->length;
+            status = LIBUSB_TRANSFER_OVERFLOW;
+        }
+        memcpy(xfr->buffer, m_next->payload(), length);
+        xfr->actual_length = length;
+        m_completions.push_back( { xfr, status });
+        if (status == LIBUSB_TRANSFER_COMPLETED)
+            m_outstanding++;
+        replayed++;
+        advance();
+    }
+    if (!m_next)
+        m_finished_cv.notify_all();
+    return chrono::steady_clock::time_point::max();
+}
+
+void ReplayTransport::run() {
+    vector<Completion> completions;
+    unique_lock < mutex > lk(m_mutex);
+    while (m_running) {
+        auto next = process(chrono::steady_clock::now());
+
+        if (m_completions.empty()) {
+            if (next == chrono::steady_clock::time_point::max())
+                m_cv.wait(lk);
+            else
+                m_cv.wait_until(lk, next);
+            continue;
+        }
+
+        // Callbacks may submit again, so they run without the lock
+        completions.swap(m_completions);
+        lk.unlock();
+        for (auto &completion : completions) {
+            completion.transfer->status = completion.status;
+            completion.transfer->callback(completion.transfer);
+        }
+        completions.clear();
+        lk.lock();
+    }
+    m_finished_cv.notify_all();
+}
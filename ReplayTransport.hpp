@@ -0,0 +1,134 @@
+#pragma once
+extern "C" {
+#include "libusb.h"
+}
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+#include "UsbTransport.hpp"
+#include "Capture.hpp"
+
+using namespace std;
+
+struct ReplayConfig {
+    // Capture file written by CaptureWriter
+    string path;
+
+    // Deliver the packets as fast as IN transfers are submitted instead of
+    // at the times they were captured
+    bool max_speed = false;
+
+    uint16_t max_packet_size = 64;
+
+    // When not 0, at most this many delivered packets wait for the consumer,
+    // which reports them with consumed(). Keeps a fast replay from
+    // overrunning the receive queue of the device.
+    size_t window = 0;
+
+    // IN endpoints the device submits transfers on. Completions captured on
+    // other endpoints are skipped and counted, nothing would ever take them.
+    // Empty for all, the device should then be configured with
+    // ReplayTransport::inEndpoints().
+    vector<uint8_t> in_endpoints;
+};
+
+// Stand-in for a device that plays back a capture
+//
+// The IN completions of the capture, with their payload and status, complete
+// the IN transfers submitted to the transport, so they go through
+// Device::libusb_transfer_cb and the packet processing as they did when they
+// were captured. OUT transfers complete right away. A captured
+// LIBUSB_TRANSFER_NO_DEVICE ends the replay as an unplug: every pending
+// transfer completes with LIBUSB_TRANSFER_NO_DEVICE from then on. Transfers
+// complete on a thread of the transport, as with LoopbackTransport.
+class ReplayTransport: public UsbTransport {
+public:
+    explicit ReplayTransport(const ReplayConfig &config);
+    ~ReplayTransport();
+
+    // False when the capture cannot be read
+    bool valid() const {
+        return m_reader.header() != nullptr;
+    }
+
+    void unplug();
+    // Waits until every IN completion of the capture has been delivered
+    void waitFinished();
+    bool finished();
+    // Returns packets to the window, see ReplayConfig::window
+    void consumed(size_t count);
+    // The IN endpoints the capture has completions for, in the order they
+    // first appear, for DeviceConfig::in_endpoints
+    const vector<uint8_t>& inEndpoints() const {
+        return m_endpoints;
+    }
+
+    libusb_device_handle* handle() override {
+        return nullptr;
+    }
+    libusb_device* device() override {
+        return nullptr;
+    }
+
+    int claimInterface(int interface_number) override;
+    int releaseInterface(int interface_number) override;
+    // The serial number of the captured device
+    int getSerial(uint8_t *data, int length) override;
+    int getMaxPacketSize(uint8_t endpoint) override;
+
+    int submit(struct libusb_transfer *transfer) override;
+    int cancel(struct libusb_transfer *transfer) override;
+    // Captured endpoints never stall
+    int clearHalt(uint8_t endpoint) override {
+        return LIBUSB_SUCCESS;
+    }
+
+    // IN completions delivered so far
+    atomic<uint64_t> replayed { 0 };
+    // IN completions skipped as their endpoint is not in ReplayConfig::in_endpoints
+    atomic<uint64_t> skipped { 0 };
+
+private:
+    struct Completion {
+        struct libusb_transfer *transfer;
+        enum libusb_transfer_status status;
+    };
+
+    ReplayConfig m_config;
+    CaptureReader m_reader;
+    vector<uint8_t> m_endpoints;
+    // Next IN completion to deliver, nullptr at the end of the capture
+    const CaptureRecord *m_next = nullptr;
+    chrono::steady_clock::time_point m_start;
+    uint64_t m_first_time_ns = 0;
+    bool m_started = false;
+    size_t m_outstanding = 0;
+
+    mutex m_mutex;
+    condition_variable m_cv;
+    condition_variable m_finished_cv;
+    bool m_running = true;
+    bool m_plugged = true;
+
+    deque<struct libusb_transfer*> m_in[16];
+    vector<Completion> m_completions;
+
+    thread m_thread;
+
+    void run();
+    // Skips to the next IN completion that is to be replayed
+    void advance();
+    bool replayable(uint8_t endpoint) const;
+    // Moves everything that is due to m_completions, returns when the next thing is due
+    chrono::steady_clock::time_point process(chrono::steady_clock::time_point now);
+    // Completes every queued transfer with LIBUSB_TRANSFER_NO_DEVICE
+    void unplugLocked();
+};
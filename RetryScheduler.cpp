@@ -0,0 +1,113 @@
+#include "RetryScheduler.hpp"
+
+RetryScheduler::RetryScheduler(ThreadPool &executor, const RetryPolicy &policy, chrono::milliseconds tick) :
+        m_executor(executor), m_policy(policy), m_tick(tick.count() > 0 ? tick : chrono::milliseconds(1)), m_random(
+                random_device()()) {
+    m_next_tick = chrono::steady_clock::now() + m_tick;
+    m_thread = thread(&RetryScheduler::run, this);
+}
+
+RetryScheduler::~RetryScheduler() {
+    {
+        unique_lock < mutex > lk(m_mutex);
+        m_running = false;
+        m_cv.notify_all();
+    }
+    m_thread.join();
+}
+
+void RetryScheduler::schedule(function<bool()> attempt, function<void()> on_give_up) {
+    shared_ptr<Retry> retry = make_shared<Retry>();
+    retry->attempt = move(attempt);
+    retry->on_give_up = move(on_give_up);
+    retry->delay = m_policy.initial_delay;
+    retry->scheduled = chrono::steady_clock::now();
+
+    unique_lock < mutex > lk(m_mutex);
+    insert(retry);
+}
+
+void RetryScheduler::insert(shared_ptr<Retry> retry) {
+    uniform_real_distribution<double> jitter(1 - m_policy.jitter, 1 + m_policy.jitter);
+    double delay = retry->delay.count() * jitter(m_random);
+    size_t ticks = size_t(delay / m_tick.count() + 0.5);
+    if (ticks < 1)
+        ticks = 1;
+
+    // A slot is reached again every WHEEL_SIZE ticks, longer delays wait for
+    // a number of rounds
+    size_t slot = (m_current + ticks) % WHEEL_SIZE;
+    m_wheel[slot].push_back( { retry, (ticks - 1) / WHEEL_SIZE });
+
+    // The wheel stood still while it was empty, it turns again from now
+    if (!m_pending++) {
+        m_next_tick = chrono::steady_clock::now() + m_tick;
+        m_cv.notify_all();
+    }
+}
+
+void RetryScheduler::run() {
+    vector<shared_ptr<Retry>> due;
+    unique_lock < mutex > lk(m_mutex);
+    while (m_running) {
+        if (!m_pending) {
+            m_cv.wait(lk);
+            continue;
+        }
+        if (chrono::steady_clock::now() < m_next_tick) {
+            m_cv.wait_until(lk, m_next_tick);
+            continue;
+        }
+        m_next_tick += m_tick;
+        m_current = (m_current + 1) % WHEEL_SIZE;
+
+        vector<Entry> &slot = m_wheel[m_current];
+        for (size_t i = 0; i < slot.size();) {
+            if (slot[i].rounds) {
+                slot[i].rounds--;
+                i++;
+            } else {
+                due.push_back(slot[i].retry);
+                slot[i] = slot.back();
+                slot.pop_back();
+                m_pending--;
+            }
+        }
+
+        if (due.empty())
+            continue;
+        lk.unlock();
+        for (auto &retry : due)
+            m_executor.post([this, retry]() {
+                attempt(retry);
+            });
+        due.clear();
+        lk.lock();
+    }
+}
+
+void RetryScheduler::attempt(shared_ptr<Retry> retry) {
+    retry->attempts++;
+    attempts.fetch_add(1, memory_order_relaxed);
+
+    if (retry->attempt()) {
+        succeeded.fetch_add(1, memory_order_relaxed);
+        time_to_ready.record(
+                chrono::duration_cast < chrono::milliseconds > (chrono::steady_clock::now() - retry->scheduled).count());
+        return;
+    }
+
+    if (retry->attempts >= m_policy.max_attempts) {
+        gave_up.fetch_add(1, memory_order_relaxed);
+        if (retry->on_give_up)
+            retry->on_give_up();
+        return;
+    }
+
+    retry->delay = chrono::milliseconds(chrono::milliseconds::rep(retry->delay.count() * m_policy.multiplier));
+    if (retry->delay > m_policy.max_delay)
+        retry->delay = m_policy.max_delay;
+    unique_lock < mutex > lk(m_mutex);
+    if (m_running)
+        insert(retry);
+}
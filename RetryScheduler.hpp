@@ -0,0 +1,92 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+#include "Histogram.hpp"
+#include "ThreadPool.hpp"
+
+using namespace std;
+
+struct RetryPolicy {
+    // Delay before the first attempt, doubled (by multiplier) after every
+    // failed attempt up to max_delay
+    chrono::milliseconds initial_delay { 250 };
+    chrono::milliseconds max_delay { 4000 };
+    double multiplier = 2;
+
+    // Every delay is randomly shortened or lengthened by up to this
+    // fraction, so retries scheduled together spread out
+    double jitter = 0.2;
+
+    int max_attempts = 10;
+};
+
+// Runs attempts with exponential backoff until they succeed
+//
+// Pending retries are kept on a timer wheel driven by a thread of its own,
+// which only ticks while there are any.
+// Due attempts are posted to the executor, so they run concurrently and a
+// slow attempt does not hold up the others. Each schedule() call is an
+// independent chain of attempts with its own backoff.
+//
+// The scheduler must outlive the tasks it posted to the executor.
+class RetryScheduler {
+public:
+    RetryScheduler(ThreadPool &executor, const RetryPolicy &policy = RetryPolicy(), chrono::milliseconds tick =
+            chrono::milliseconds(10));
+    ~RetryScheduler();
+
+    // attempt returns true when it succeeded. on_give_up, when set, is called
+    // after max_attempts failed attempts. Never blocks.
+    void schedule(function<bool()> attempt, function<void()> on_give_up = nullptr);
+
+    atomic<uint64_t> attempts { 0 };
+    atomic<uint64_t> succeeded { 0 };
+    atomic<uint64_t> gave_up { 0 };
+    // Time from schedule() to the successful attempt, in milliseconds
+    Histogram time_to_ready;
+
+private:
+    struct Retry {
+        function<bool()> attempt;
+        function<void()> on_give_up;
+        int attempts = 0;
+        chrono::milliseconds delay;
+        chrono::steady_clock::time_point scheduled;
+    };
+    struct Entry {
+        shared_ptr<Retry> retry;
+        size_t rounds;
+    };
+
+    static const size_t WHEEL_SIZE = 512;
+
+    ThreadPool &m_executor;
+    RetryPolicy m_policy;
+    chrono::milliseconds m_tick;
+
+    mutex m_mutex;
+    condition_variable m_cv;
+    bool m_running = true;
+    vector<Entry> m_wheel[WHEEL_SIZE];
+    size_t m_current = 0;
+    // Entries on the wheel, with none the thread waits without a deadline
+    size_t m_pending = 0;
+    chrono::steady_clock::time_point m_next_tick;
+    mt19937 m_random;
+    thread m_thread;
+
+    // Call with m_mutex held
+    void insert(shared_ptr<Retry> retry);
+    void run();
+    void attempt(shared_ptr<Retry> retry);
+};
@@ -0,0 +1,85 @@
+#include "SendQueue.hpp"
+
+SendQueue::SendQueue(size_t capacity, int max_in_flight) :
+        m_queue(capacity), m_max_in_flight(max_in_flight) {
+}
+
+SendQueue::Result SendQueue::push(const PendingSend &send, bool block) {
+    unique_lock < mutex > lk(m_mutex);
+    queue_depth.record(m_count);
+
+    if (m_stopped)
+        return STOPPED;
+
+    if (m_in_flight < m_max_in_flight && !m_count) {
+        m_in_flight++;
+        return SUBMIT;
+    }
+
+    if (m_count == m_queue.size()) {
+        if (!block)
+            return FULL;
+        blocked++;
+        m_space_cv.wait(lk, [this] {
+            return m_stopped || m_count < m_queue.size();
+        });
+        if (m_stopped)
+            return STOPPED;
+        // Every transfer may have completed while we waited, then there is
+        // no completion left to take the send from the queue
+        if (m_in_flight < m_max_in_flight && !m_count) {
+            m_in_flight++;
+            return SUBMIT;
+        }
+    }
+
+    m_queue[(m_head + m_count) % m_queue.size()] = send;
+    m_count++;
+    return QUEUED;
+}
+
+bool SendQueue::complete(PendingSend &next) {
+    unique_lock < mutex > lk(m_mutex);
+    if (m_count && !m_stopped) {
+        next = m_queue[m_head];
+        m_head = (m_head + 1) % m_queue.size();
+        m_count--;
+        m_space_cv.notify_one();
+        return true;
+    }
+    m_in_flight--;
+    return false;
+}
+
+void SendQueue::stop() {
+    unique_lock < mutex > lk(m_mutex);
+    m_stopped = true;
+    m_space_cv.notify_all();
+}
+
+bool SendQueue::discard(PendingSend &send) {
+    unique_lock < mutex > lk(m_mutex);
+    if (!m_count)
+        return false;
+    send = m_queue[m_head];
+    m_head = (m_head + 1) % m_queue.size();
+    m_count--;
+    return true;
+}
+
+int SendQueue::inFlight() {
+    unique_lock < mutex > lk(m_mutex);
+    return m_in_flight;
+}
+
+size_t SendQueue::depth() {
+    unique_lock < mutex > lk(m_mutex);
+    return m_count;
+}
+
+size_t SendQueue::room() {
+    unique_lock < mutex > lk(m_mutex);
+    if (m_stopped)
+        return m_queue.size() + m_max_in_flight;
+    return m_queue.size() - m_count + (m_in_flight < m_max_in_flight ? m_max_in_flight - m_in_flight : 0);
+}
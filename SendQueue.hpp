@@ -0,0 +1,74 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+#include <stdint.h>
+
+#include "Histogram.hpp"
+
+using namespace std;
+
+// A send waiting for a credit
+struct PendingSend {
+    uint8_t *buffer;
+    size_t size;
+    chrono::steady_clock::time_point queued;
+};
+
+// Credit based flow control for one OUT endpoint
+//
+// At most max_in_flight transfers are submitted at any time. A send that finds
+// no credit is queued, and the completion of a transfer hands its credit to
+// the oldest queued send. When the queue is full the sender either blocks
+// until a completion makes room, or the send is refused.
+//
+// This class only does the bookkeeping, submitting is up to the caller:
+// push() returning SUBMIT and complete() returning true mean the caller holds
+// a credit and must submit the send.
+class SendQueue {
+public:
+    enum Result {
+        SUBMIT, QUEUED, FULL, STOPPED
+    };
+
+    SendQueue(size_t capacity, int max_in_flight);
+
+    Result push(const PendingSend &send, bool block);
+
+    // Called when a transfer finished (or failed to submit). Returns true with
+    // next filled in when a queued send takes over the credit.
+    bool complete(PendingSend &next);
+
+    // Wakes blocked senders and refuses further sends
+    void stop();
+    // Takes the oldest queued send without a credit, for emptying the queue
+    // once stopped. Returns false when the queue is empty.
+    bool discard(PendingSend &send);
+
+    int inFlight();
+    size_t depth();
+    // How many sends can be pushed right now without blocking or being
+    // refused: the free credits and queue slots. A stopped queue refuses
+    // without blocking, so it counts as having room for all.
+    size_t room();
+
+    // Time from the send being requested to the transfer completing, in microseconds
+    Histogram latency;
+    // Number of sends queued, sampled on each push
+    Histogram queue_depth;
+
+    atomic<uint64_t> blocked { 0 };
+
+private:
+    mutex m_mutex;
+    condition_variable m_space_cv;
+    vector<PendingSend> m_queue;
+    size_t m_head = 0;
+    size_t m_count = 0;
+    int m_in_flight = 0;
+    int m_max_in_flight;
+    bool m_stopped = false;
+};
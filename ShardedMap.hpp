@@ -0,0 +1,171 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <stddef.h>
+
+#include "ReadEpoch.hpp"
+
+using namespace std;
+
+// Concurrent map for read mostly data
+//
+// Keys are spread over a fixed number of shards. Each shard publishes an
+// immutable table through a plain atomic pointer. find() reads the current
+// table inside a ReadEpoch read section: it takes no lock and writes nothing
+// that other readers touch. Writers copy the table of the shard under the
+// shard's lock, publish the copy, and free the old table once
+// ReadEpoch::synchronize() says no reader can still see it.
+//
+// find(key) copies the value out, for a shared_ptr that is an atomic
+// increment on the pointee's reference count. find(key, f) hands f a
+// reference into the table instead, which stays valid until f returns.
+//
+// Meant for tables that change at human speed, such as devices coming and
+// going, while lookups happen all the time. Every change waits for the
+// readers that are under way.
+template<typename Key, typename Value, size_t SHARDS = 16>
+class ShardedMap {
+public:
+    typedef unordered_map<Key, Value> Table;
+
+    ShardedMap() {
+        for (auto &shard : m_shards)
+            shard.table.store(new Table());
+    }
+    ~ShardedMap() {
+        for (auto &shard : m_shards)
+            delete shard.table.load();
+    }
+    ShardedMap(const ShardedMap&) = delete;
+    ShardedMap& operator=(const ShardedMap&) = delete;
+
+    // Returns a default constructed Value when the key is not present
+    Value find(const Key &key) const {
+        ReadEpoch::Guard guard;
+        const Table *table = shard(key).table.load();
+        auto it = table->find(key);
+        return it == table->end() ? Value() : it->second;
+    }
+
+    // Calls f(value) when the key is present, returns whether it was. f runs
+    // inside the read section and must not change this or any other ShardedMap.
+    template<typename F>
+    bool find(const Key &key, F f) const {
+        ReadEpoch::Guard guard;
+        const Table *table = shard(key).table.load();
+        auto it = table->find(key);
+        if (it == table->end())
+            return false;
+        f(it->second);
+        return true;
+    }
+
+    // Returns false when the key is already present
+    bool insert(const Key &key, const Value &value) {
+        Shard &s = shard(key);
+        unique_lock < mutex > lk(s.writer);
+        const Table *table = s.table.load();
+        if (table->count(key))
+            return false;
+        Table *copy = new Table(*table);
+        copy->emplace(key, value);
+        replace(s, copy);
+        return true;
+    }
+
+    // Inserts the key, or replaces its value, in a single step: readers see
+    // either the old value or the new one. Returns the old value, or a
+    // default constructed Value when the key was not present.
+    Value assign(const Key &key, const Value &value) {
+        Shard &s = shard(key);
+        unique_lock < mutex > lk(s.writer);
+        const Table *table = s.table.load();
+        auto it = table->find(key);
+        Value old = it == table->end() ? Value() : it->second;
+        Table *copy = new Table(*table);
+        (*copy)[key] = value;
+        replace(s, copy);
+        return old;
+    }
+
+    // Returns the removed value, or a default constructed Value when the key was not present
+    Value erase(const Key &key) {
+        Shard &s = shard(key);
+        unique_lock < mutex > lk(s.writer);
+        const Table *table = s.table.load();
+        auto it = table->find(key);
+        if (it == table->end())
+            return Value();
+        Value value = it->second;
+        Table *copy = new Table(*table);
+        copy->erase(key);
+        replace(s, copy);
+        return value;
+    }
+
+    // Removes the key only when it maps to expected, returns whether it did
+    bool erase(const Key &key, const Value &expected) {
+        Shard &s = shard(key);
+        unique_lock < mutex > lk(s.writer);
+        const Table *table = s.table.load();
+        auto it = table->find(key);
+        if (it == table->end() || !(it->second == expected))
+            return false;
+        Table *copy = new Table(*table);
+        copy->erase(key);
+        replace(s, copy);
+        return true;
+    }
+
+    // Calls f(key, value) for every entry. Shards are visited one at a time,
+    // changes made meanwhile may or may not be seen. f runs outside of the
+    // read section on copies of the entries, so it may change the map.
+    void forEach(const function<void(const Key&, const Value&)> &f) const {
+        for (auto &s : m_shards) {
+            vector<pair<Key, Value>> entries;
+            {
+                ReadEpoch::Guard guard;
+                const Table *table = s.table.load();
+                entries.assign(table->begin(), table->end());
+            }
+            for (auto &entry : entries)
+                f(entry.first, entry.second);
+        }
+    }
+
+    size_t size() const {
+        ReadEpoch::Guard guard;
+        size_t total = 0;
+        for (auto &s : m_shards)
+            total += s.table.load()->size();
+        return total;
+    }
+
+private:
+    struct Shard {
+        mutex writer;
+        // Loads and stores are sequentially consistent, ReadEpoch relies on it
+        atomic<const Table*> table { nullptr };
+    };
+    Shard m_shards[SHARDS];
+
+    Shard& shard(const Key &key) {
+        return m_shards[hash<Key>()(key) % SHARDS];
+    }
+    const Shard& shard(const Key &key) const {
+        return m_shards[hash<Key>()(key) % SHARDS];
+    }
+
+    // Publishes the new table and frees the old one once no reader can see it
+    static void replace(Shard &s, const Table *table) {
+        const Table *old = s.table.exchange(table);
+        ReadEpoch::synchronize();
+        delete old;
+    }
+};
@@ -0,0 +1,274 @@
+#include "SharedRing.hpp"
+
+#include <new>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+static uint32_t currentPid() {
+#ifdef _WIN32
+    return GetCurrentProcessId();
+#else
+    return uint32_t(getpid());
+#endif
+}
+
+static bool processAlive(uint32_t pid) {
+#ifdef _WIN32
+    HANDLE process = OpenProcess(SYNCHRONIZE, FALSE, pid);
+    if (!process)
+        return GetLastError() != ERROR_INVALID_PARAMETER;
+    bool alive = WaitForSingleObject(process, 0) == WAIT_TIMEOUT;
+    CloseHandle(process);
+    return alive;
+#else
+    return !kill(pid_t(pid), 0) || errno != ESRCH;
+#endif
+}
+
+SharedMapping::~SharedMapping() {
+    if (!m_data)
+        return;
+#ifdef _WIN32
+    UnmapViewOfFile(m_data);
+    CloseHandle(m_handle);
+#else
+    munmap(m_data, m_size);
+    // Readers keep their mapping, only new ones cannot find it any more
+    if (m_created)
+        shm_unlink(m_name.c_str());
+#endif
+}
+
+bool SharedMapping::map(const string &name, bool create, size_t size) {
+#ifdef _WIN32
+    m_name = "Local\\" + name;
+    HANDLE handle;
+    if (create)
+        handle = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, DWORD(uint64_t(size) >> 32),
+                DWORD(size), m_name.c_str());
+    else
+        handle = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, m_name.c_str());
+    if (!handle)
+        return false;
+    void *data = MapViewOfFile(handle, FILE_MAP_ALL_ACCESS, 0, 0, create ? size : 0);
+    if (!data) {
+        CloseHandle(handle);
+        return false;
+    }
+    if (!create) {
+        MEMORY_BASIC_INFORMATION info;
+        VirtualQuery(data, &info, sizeof(info));
+        size = info.RegionSize;
+    }
+    m_handle = handle;
+#else
+    m_name = name[0] == '/' ? name : "/" + name;
+    int fd;
+    if (create) {
+        shm_unlink(m_name.c_str());
+        fd = shm_open(m_name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0666);
+        if (fd >= 0 && ftruncate(fd, off_t(size))) {
+            close(fd);
+            shm_unlink(m_name.c_str());
+            return false;
+        }
+    } else {
+        fd = shm_open(m_name.c_str(), O_RDWR, 0);
+        struct stat st;
+        if (fd >= 0 && fstat(fd, &st)) {
+            close(fd);
+            return false;
+        }
+        if (fd >= 0)
+            size = size_t(st.st_size);
+    }
+    if (fd < 0)
+        return false;
+    void *data = size ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (data == MAP_FAILED) {
+        if (create)
+            shm_unlink(m_name.c_str());
+        return false;
+    }
+#endif
+    m_created = create;
+    m_data = (uint8_t*) data;
+    m_size = size;
+    return true;
+}
+
+SharedRingWriter::SharedRingWriter(const string &name, size_t capacity) {
+    size_t size = 4096;
+    while (size < capacity)
+        size <<= 1;
+    capacity = size;
+    size_t data_offset = (sizeof(SharedRingHeader) + 4095) & ~size_t(4095);
+    if (!m_mapping.map(name, true, data_offset + capacity))
+        return;
+
+    m_header = new (m_mapping.data()) SharedRingHeader();
+    m_header->version = SharedRingHeader::VERSION;
+    m_header->capacity = capacity;
+    m_header->data_offset = data_offset;
+    m_header->magic.store(SharedRingHeader::MAGIC, memory_order_release);
+
+    m_ring = m_mapping.data() + data_offset;
+    m_mask = capacity - 1;
+    m_limit = capacity;
+}
+
+SharedRingWriter::~SharedRingWriter() {
+    if (m_header)
+        m_header->closed.store(1, memory_order_release);
+}
+
+void SharedRingWriter::updateLimit(uint64_t needed) {
+    uint64_t capacity = m_mask + 1;
+    uint64_t slowest = m_pos;
+    for (auto &reader : m_header->readers) {
+        uint32_t pid = reader.pid.load(memory_order_acquire);
+        if (!pid)
+            continue;
+        uint64_t pos = reader.pos.load(memory_order_acquire);
+        // A reader that is still attaching has not set its position yet
+        if (pos > m_pos || m_pos - pos > capacity)
+            continue;
+        if (pos + capacity < m_pos + needed && !processAlive(pid)) {
+            reader.pos.store(0, memory_order_relaxed);
+            reader.pid.compare_exchange_strong(pid, 0, memory_order_release);
+            continue;
+        }
+        if (pos < slowest)
+            slowest = pos;
+    }
+    m_limit = slowest + capacity;
+}
+
+bool SharedRingWriter::write(uint8_t endpoint, const uint8_t *data, uint16_t length, uint64_t received_ns) {
+    if (!m_header)
+        return false;
+    const size_t header_size = sizeof(SharedRingRecord);
+    uint64_t size = (header_size + length + header_size - 1) / header_size * header_size;
+    uint64_t offset = m_pos & m_mask;
+    uint64_t tail = m_mask + 1 - offset;
+    // A record that does not fit before the end starts over at the front
+    uint64_t needed = tail < size ? tail + size : size;
+    if (m_pos + needed > m_limit) {
+        updateLimit(needed);
+        if (m_pos + needed > m_limit) {
+            m_header->dropped.fetch_add(1, memory_order_relaxed);
+            return false;
+        }
+    }
+
+    if (tail < size) {
+        SharedRingRecord *pad = (SharedRingRecord*) (m_ring + offset);
+        pad->size = uint32_t(tail);
+        // The slot may hold an older record, whose length a reader would check
+        pad->length = 0;
+        pad->type = SharedRingRecord::PAD;
+        m_pos += tail;
+        offset = 0;
+    }
+    SharedRingRecord *record = (SharedRingRecord*) (m_ring + offset);
+    record->size = uint32_t(size);
+    record->length = length;
+    record->endpoint = endpoint;
+    record->type = SharedRingRecord::PACKET;
+    record->received_ns = received_ns;
+    memcpy(record + 1, data, length);
+    m_pos += size;
+
+    m_header->write_pos.store(m_pos, memory_order_release);
+    m_header->packets.fetch_add(1, memory_order_relaxed);
+    return true;
+}
+
+SharedRingReader::~SharedRingReader() {
+    detach();
+}
+
+bool SharedRingReader::open(const string &name) {
+    detach();
+    if (!m_mapping.data() && !m_mapping.map(name, false, 0))
+        return false;
+    if (m_mapping.size() < sizeof(SharedRingHeader))
+        return false;
+    SharedRingHeader *header = (SharedRingHeader*) m_mapping.data();
+    if (header->magic.load(memory_order_acquire) != SharedRingHeader::MAGIC
+            || header->version != SharedRingHeader::VERSION)
+        return false;
+    if (header->data_offset + header->capacity > m_mapping.size())
+        return false;
+
+    uint32_t pid = currentPid();
+    for (int i = 0; i < SharedRingHeader::MAX_READERS; i++) {
+        uint32_t expected = 0;
+        if (!header->readers[i].pid.compare_exchange_strong(expected, pid, memory_order_acq_rel))
+            continue;
+        m_pos = header->write_pos.load(memory_order_acquire);
+        header->readers[i].pos.store(m_pos, memory_order_release);
+        m_header = header;
+        m_ring = m_mapping.data() + header->data_offset;
+        m_mask = header->capacity - 1;
+        m_slot = i;
+        return true;
+    }
+    return false;
+}
+
+void SharedRingReader::detach() {
+    if (!m_header)
+        return;
+    m_header->readers[m_slot].pos.store(0, memory_order_relaxed);
+    m_header->readers[m_slot].pid.store(0, memory_order_release);
+    m_header = nullptr;
+    m_slot = -1;
+}
+
+size_t SharedRingReader::poll(SharedPacket *out, size_t max) {
+    if (!m_header)
+        return 0;
+    uint64_t end = m_header->write_pos.load(memory_order_acquire);
+    size_t count = 0;
+    while (m_pos < end && count < max) {
+        uint64_t offset = m_pos & m_mask;
+        const SharedRingRecord *record = (const SharedRingRecord*) (m_ring + offset);
+        // The writer is trusted only as far as the mapping goes
+        if (record->size < sizeof(SharedRingRecord) || record->size > m_mask + 1 - offset
+                || record->length > record->size - sizeof(SharedRingRecord)) {
+            m_pos = end;
+            break;
+        }
+        if (record->type == SharedRingRecord::PACKET) {
+            SharedPacket &packet = out[count++];
+            packet.endpoint = record->endpoint;
+            packet.length = record->length;
+            packet.data = (const uint8_t*) (record + 1);
+            packet.received_ns = record->received_ns;
+        }
+        m_pos += record->size;
+    }
+    return count;
+}
+
+void SharedRingReader::release() {
+    if (m_header)
+        m_header->readers[m_slot].pos.store(m_pos, memory_order_release);
+}
+
+bool SharedRingReader::closed() const {
+    return !m_header
+            || (m_header->closed.load(memory_order_acquire) && m_pos == m_header->write_pos.load(memory_order_acquire));
+}
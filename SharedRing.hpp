@@ -0,0 +1,186 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+
+using namespace std;
+
+// Ring of received packets in shared memory, written by one Device and read
+// by any number of other processes
+//
+// Each packet is copied into the ring once, readers get pointers straight
+// into the mapping, so adding a consumer adds no copy. Every reader has a
+// cursor in the shared header and the writer never overwrites what a reader
+// has not released yet: when the slowest reader is a full ring behind, new
+// packets are dropped and counted instead. Readers that exit without
+// detaching are found by their process id once they hold the writer back.
+//
+// The shared memory is a POSIX shm object or a Windows named file mapping,
+// both called by the name the ring is created with.
+
+// Layout of a record in the ring. Records are padded to a multiple of the
+// header size and never wrap, the end of the ring is filled with a PAD
+// record instead.
+struct SharedRingRecord {
+    enum {
+        PACKET = 0, PAD = 1
+    };
+    // Record size including header and padding
+    uint32_t size;
+    uint16_t length;
+    uint8_t endpoint;
+    uint8_t type;
+    // steady_clock time the IN transfer completed, in ns. On Linux and
+    // Windows this clock is the same in every process.
+    uint64_t received_ns;
+};
+
+struct SharedRingHeader {
+    static const uint32_t MAGIC = 0x52425355; // "USBR"
+    static const uint32_t VERSION = 1;
+    static const int MAX_READERS = 16;
+
+    // Set last, once the rest of the header is filled in
+    atomic<uint32_t> magic;
+    uint32_t version;
+    // Size of the data area, a power of two
+    uint64_t capacity;
+    // Offset of the data area from the start of the mapping
+    uint64_t data_offset;
+
+    // Byte position up to which records are complete, only increases
+    alignas(64) atomic<uint64_t> write_pos;
+    // Packets dropped because a reader was a full ring behind
+    atomic<uint64_t> dropped;
+    atomic<uint64_t> packets;
+    // Set when the device has gone, readers drain what is left and stop
+    atomic<uint32_t> closed;
+
+    struct Reader {
+        // 0 when the slot is free
+        alignas(64) atomic<uint32_t> pid;
+        // Byte position up to which the reader is done
+        atomic<uint64_t> pos;
+    } readers[MAX_READERS];
+};
+
+static_assert(atomic<uint64_t>::is_always_lock_free, "Shared memory atomics must be lock-free");
+
+// Maps the shared memory of a ring, for the writer and the readers alike
+class SharedMapping {
+public:
+    SharedMapping() {
+    }
+    ~SharedMapping();
+    SharedMapping(const SharedMapping&) = delete;
+    SharedMapping& operator=(const SharedMapping&) = delete;
+
+    // create makes a new object of the given size, replacing one left over
+    // under the same name, otherwise an existing one is opened with the size
+    // it has. Returns false when that fails.
+    bool map(const string &name, bool create, size_t size);
+
+    uint8_t* data() const {
+        return m_data;
+    }
+    size_t size() const {
+        return m_size;
+    }
+
+private:
+    string m_name;
+    bool m_created = false;
+    uint8_t *m_data = nullptr;
+    size_t m_size = 0;
+#ifdef _WIN32
+    void *m_handle = nullptr;
+#endif
+};
+
+// Write side, one per Device, only to be used from one thread at a time
+class SharedRingWriter {
+public:
+    // The capacity is rounded up to a power of two. Check valid() afterwards.
+    SharedRingWriter(const string &name, size_t capacity);
+    // Marks the ring closed, readers can keep their mapping
+    ~SharedRingWriter();
+
+    bool valid() const {
+        return m_header != nullptr;
+    }
+
+    // Returns false when the packet was dropped, because the slowest reader
+    // is a full ring behind or the packet does not fit in the ring at all
+    bool write(uint8_t endpoint, const uint8_t *data, uint16_t length, uint64_t received_ns);
+
+    uint64_t dropped() const {
+        return m_header ? m_header->dropped.load(memory_order_relaxed) : 0;
+    }
+
+private:
+    SharedMapping m_mapping;
+    SharedRingHeader *m_header = nullptr;
+    uint8_t *m_ring = nullptr;
+    uint64_t m_mask = 0;
+    uint64_t m_pos = 0;
+    // Position the writer may fill up to without looking at the readers again
+    uint64_t m_limit = 0;
+
+    // Takes the slowest reader's position into m_limit. Readers that keep
+    // the next needed bytes from being written are freed when their process
+    // is gone.
+    void updateLimit(uint64_t needed);
+};
+
+// A packet as seen by a reader, data points into the shared mapping and is
+// valid until the next release()
+struct SharedPacket {
+    uint8_t endpoint;
+    uint16_t length;
+    const uint8_t *data;
+    uint64_t received_ns;
+};
+
+// Read side, for the consumer processes
+//
+//     SharedRingReader reader;
+//     if (reader.open("usb-12345678"))
+//         while (!reader.closed()) {
+//             SharedPacket packets[64];
+//             size_t count = reader.poll(packets, 64);
+//             ... use packets[0 .. count - 1] ...
+//             reader.release();
+//         }
+class SharedRingReader {
+public:
+    SharedRingReader() {
+    }
+    ~SharedRingReader();
+
+    // Attaches to the ring, starting at the packets written from now on.
+    // Returns false when there is no such ring or all reader slots are taken.
+    bool open(const string &name);
+    void detach();
+
+    // Takes up to max packets that are not taken yet, without waiting
+    size_t poll(SharedPacket *out, size_t max);
+    // Hands everything taken so far back to the writer
+    void release();
+
+    // True once the writer has closed the ring and everything is taken
+    bool closed() const;
+    uint64_t dropped() const {
+        return m_header ? m_header->dropped.load(memory_order_relaxed) : 0;
+    }
+
+private:
+    SharedMapping m_mapping;
+    SharedRingHeader *m_header = nullptr;
+    const uint8_t *m_ring = nullptr;
+    uint64_t m_mask = 0;
+    int m_slot = -1;
+    // Position of the next record to take
+    uint64_t m_pos = 0;
+};
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <stddef.h>
+
+using namespace std;
+
+// Bounded single-producer/single-consumer queue
+//
+// push() is only to be called from one thread (for Device this is the libusb
+// events thread) and pop() only from one other thread at a time (for Device
+// the run of its packet processing on the executor). Both are wait-free,
+// neither allocates after construction.
+// The capacity is rounded up to a power of two.
+template<typename T>
+class SpscQueue {
+public:
+    explicit SpscQueue(size_t capacity = 1024) {
+        size_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+        m_slots.resize(size);
+        m_mask = size - 1;
+    }
+
+    // Returns false when the queue is full, the item is not queued then.
+    bool push(const T &item) {
+        size_t tail = m_tail.load(memory_order_relaxed);
+        if (tail - m_cached_head > m_mask) {
+            m_cached_head = m_head.load(memory_order_acquire);
+            if (tail - m_cached_head > m_mask)
+                return false;
+        }
+        m_slots[tail & m_mask] = item;
+        m_tail.store(tail + 1, memory_order_seq_cst);
+        return true;
+    }
+
+    // Pops up to max items into out, returns the number of items popped.
+    size_t pop(T *out, size_t max) {
+        size_t head = m_head.load(memory_order_relaxed);
+        if (m_cached_tail == head)
+            m_cached_tail = m_tail.load(memory_order_acquire);
+        size_t count = m_cached_tail - head;
+        if (count > max)
+            count = max;
+        for (size_t i = 0; i < count; i++)
+            out[i] = m_slots[(head + i) & m_mask];
+        m_head.store(head + count, memory_order_release);
+        return count;
+    }
+
+    bool empty() const {
+        return m_tail.load(memory_order_seq_cst) == m_head.load(memory_order_acquire);
+    }
+
+    size_t size() const {
+        return m_tail.load(memory_order_acquire) - m_head.load(memory_order_acquire);
+    }
+
+    size_t capacity() const {
+        return m_mask + 1;
+    }
+
+private:
+    vector<T> m_slots;
+    size_t m_mask;
+
+    // Producer and consumer indices are kept on separate cache lines,
+    // each together with the cached copy of the other side's index.
+    char m_pad0[64];
+    atomic<size_t> m_tail { 0 };
+    size_t m_cached_head = 0;
+    char m_pad1[64];
+    atomic<size_t> m_head { 0 };
+    size_t m_cached_tail = 0;
+    char m_pad2[64];
+};
@@ -0,0 +1,40 @@
+#include "ThreadPool.hpp"
+
+ThreadPool::ThreadPool(size_t threads) {
+    if (!threads)
+        threads = 1;
+    for (size_t i = 0; i < threads; i++)
+        m_threads.push_back(thread(&ThreadPool::run, this));
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        unique_lock < mutex > lk(m_mutex);
+        m_stopping = true;
+        m_cv.notify_all();
+    }
+    for (auto &t : m_threads)
+        t.join();
+}
+
+void ThreadPool::post(function<void()> task) {
+    unique_lock < mutex > lk(m_mutex);
+    m_tasks.push_back(move(task));
+    m_cv.notify_one();
+}
+
+void ThreadPool::run() {
+    unique_lock < mutex > lk(m_mutex);
+    while (true) {
+        m_cv.wait(lk, [this] {
+            return m_stopping || !m_tasks.empty();
+        });
+        if (m_tasks.empty())
+            return;
+        function<void()> task = move(m_tasks.front());
+        m_tasks.pop_front();
+        lk.unlock();
+        task();
+        lk.lock();
+    }
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <stddef.h>
+
+using namespace std;
+
+// Fixed number of threads running posted tasks in the order they were posted
+//
+// The destructor runs the tasks still queued before joining the threads.
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t threads = thread::hardware_concurrency());
+    ~ThreadPool();
+
+    void post(function<void()> task);
+
+    size_t size() const {
+        return m_threads.size();
+    }
+
+private:
+    mutex m_mutex;
+    condition_variable m_cv;
+    deque<function<void()>> m_tasks;
+    bool m_stopping = false;
+    vector<thread> m_threads;
+
+    void run();
+};
@@ -0,0 +1,95 @@
+#pragma once
+extern "C" {
+#include "libusb.h"
+}
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>) && __has_include(<span>)
+#define DEVICE_COROUTINES 1
+
+#include <coroutine>
+#include <exception>
+#include <span>
+#include <stddef.h>
+#include <stdint.h>
+
+using namespace std;
+
+class Device;
+
+struct TransferResult {
+    // LIBUSB_TRANSFER_ERROR when the transfer could not be submitted, error
+    // then holds the libusb error code
+    enum libusb_transfer_status status = LIBUSB_TRANSFER_ERROR;
+    int error = 0;
+    size_t length = 0;
+
+    explicit operator bool() const {
+        return status == LIBUSB_TRANSFER_COMPLETED;
+    }
+};
+
+// A transfer for a coroutine to co_await, returned by Device::read() and
+// Device::write()
+//
+// The transfer is submitted when the coroutine suspends and the coroutine is
+// resumed straight from the transfer's completion, on the libusb events
+// thread. The awaiter lives in the coroutine frame and the transfer comes
+// from the device's transfer pool, so awaiting allocates nothing once the
+// pool is warm.
+class TransferAwaiter {
+public:
+    TransferAwaiter(Device &device, uint8_t endpoint, uint8_t *buffer, size_t length) :
+            m_device(device), m_endpoint(endpoint), m_buffer(buffer), m_length(length) {
+    }
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+    // Returns false, resuming right away, when the transfer could not be submitted
+    bool await_suspend(coroutine_handle<> handle);
+    TransferResult await_resume() const noexcept {
+        return m_result;
+    }
+
+private:
+    friend class Device;
+
+    Device &m_device;
+    uint8_t m_endpoint;
+    uint8_t *m_buffer;
+    size_t m_length;
+    coroutine_handle<> m_handle;
+    TransferResult m_result;
+};
+
+// Return type for a coroutine that runs on its own, started when called and
+// freed when it returns
+//
+//     UsbTask echo(Device &device) {
+//         uint8_t buffer[64];
+//         while (true) {
+//             TransferResult in = co_await device.read(0x81, buffer);
+//             if (!in || !co_await device.write(0x01, span<const uint8_t>(buffer, in.length)))
+//                 co_return;
+//         }
+//     }
+struct UsbTask {
+    struct promise_type {
+        UsbTask get_return_object() {
+            return UsbTask();
+        }
+        suspend_never initial_suspend() noexcept {
+            return suspend_never();
+        }
+        suspend_never final_suspend() noexcept {
+            return suspend_never();
+        }
+        void return_void() {
+        }
+        void unhandled_exception() {
+            terminate();
+        }
+    };
+};
+
+#endif
@@ -0,0 +1,51 @@
+#include "TransferPool.hpp"
+
+TransferPool::TransferPool(size_t capacity) :
+        m_capacity(capacity) {
+    m_free.reserve(capacity);
+    for (size_t i = 0; i < capacity; i++)
+        m_free.push_back(allocate());
+}
+
+TransferPool::~TransferPool() {
+    for (auto xfr : m_free)
+        destroy(xfr);
+}
+
+struct libusb_transfer* TransferPool::allocate() {
+    struct libusb_transfer *xfr = libusb_alloc_transfer(0);
+    xfr->user_data = new TransferContext();
+    return xfr;
+}
+
+void TransferPool::destroy(struct libusb_transfer *transfer) {
+    delete context(transfer);
+    libusb_free_transfer(transfer);
+}
+
+struct libusb_transfer* TransferPool::acquire() {
+    {
+        unique_lock < mutex > lk(m_mutex);
+        if (!m_free.empty()) {
+            struct libusb_transfer *xfr = m_free.back();
+            m_free.pop_back();
+            m_hits.fetch_add(1, memory_order_relaxed);
+            return xfr;
+        }
+    }
+    m_misses.fetch_add(1, memory_order_relaxed);
+    return allocate();
+}
+
+void TransferPool::release(struct libusb_transfer *transfer) {
+    if (!transfer)
+        return;
+    {
+        unique_lock < mutex > lk(m_mutex);
+        if (m_free.size() < m_capacity) {
+            m_free.push_back(transfer);
+            return;
+        }
+    }
+    destroy(transfer);
+}
@@ -0,0 +1,76 @@
+#pragma once
+extern "C" {
+#include "libusb.h"
+}
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+
+// Bookkeeping attached to every transfer handed out by TransferPool.
+// transfer->user_data points to it, so it must be passed as user_data again
+// when filling the transfer.
+struct TransferContext {
+    void *owner = nullptr;
+    // When the send was requested and when the transfer was last submitted
+    chrono::steady_clock::time_point queued;
+    chrono::steady_clock::time_point submitted;
+    // Position in the owner's list of transfers in flight
+    size_t slot = 0;
+    // The TransferAwaiter of a transfer awaited by a coroutine
+    void *waiter = nullptr;
+    // Times an OUT transfer has been submitted again after failing, see
+    // DeviceConfig::out_retries
+    int retries = 0;
+};
+
+// Free list of pre-allocated libusb transfers
+//
+// acquire() hands out a pooled transfer when one is available and falls back
+// to libusb_alloc_transfer() otherwise (a miss). release() puts the transfer
+// back into the pool, or frees it when the pool is already at capacity, so
+// transfers allocated on a miss refill the pool. The free list never grows
+// beyond its initial reservation, so the steady state does not allocate.
+class TransferPool {
+public:
+    explicit TransferPool(size_t capacity);
+    ~TransferPool();
+
+    struct libusb_transfer* acquire();
+    void release(struct libusb_transfer *transfer);
+
+    // Allocate and free a transfer with its context outside of any pool
+    static struct libusb_transfer* allocate();
+    static void destroy(struct libusb_transfer *transfer);
+
+    static TransferContext* context(struct libusb_transfer *transfer) {
+        return (TransferContext*) transfer->user_data;
+    }
+
+    uint64_t hits() const {
+        return m_hits.load(memory_order_relaxed);
+    }
+    uint64_t misses() const {
+        return m_misses.load(memory_order_relaxed);
+    }
+    size_t capacity() const {
+        return m_capacity;
+    }
+    // Transfers in the free list, capacity() once every transfer is back
+    size_t available() const {
+        unique_lock < mutex > lk(m_mutex);
+        return m_free.size();
+    }
+
+private:
+    size_t m_capacity;
+    mutable mutex m_mutex;
+    vector<struct libusb_transfer*> m_free;
+
+    atomic<uint64_t> m_hits { 0 };
+    atomic<uint64_t> m_misses { 0 };
+};
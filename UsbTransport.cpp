@@ -0,0 +1,21 @@
+#include "UsbTransport.hpp"
+
+#include "Log.hpp"
+
+int LibusbTransport::getSerial(uint8_t *data, int length) {
+    struct libusb_device_descriptor device_desc;
+    int retval = libusb_get_device_descriptor(m_device, &device_desc);
+
+    if (retval) {
+        LOG_WARNING("Error. Cannot Obtain Device Descriptor: %s %s. Trying again...", libusb_error_name(retval),
+                libusb_strerror((libusb_error) retval));
+        retval = libusb_get_device_descriptor(m_device, &device_desc);
+        if (retval) {
+            LOG_ERROR("Error. Cannot Obtain Device Descriptor: %s %s. Bailing out...", libusb_error_name(retval),
+                    libusb_strerror((libusb_error) retval));
+            return retval;
+        }
+    }
+
+    return libusb_get_string_descriptor_ascii(m_handle, device_desc.iSerialNumber, data, length);
+}
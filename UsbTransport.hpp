@@ -0,0 +1,81 @@
+#pragma once
+extern "C" {
+#include "libusb.h"
+}
+
+#include <stdint.h>
+
+using namespace std;
+
+// The USB device as seen by Device
+//
+// Transfers are libusb transfers in either case, filled with
+// libusb_fill_bulk_transfer() and completed through their callback, so
+// Device does not need to know whether it talks to real hardware.
+class UsbTransport {
+public:
+    virtual ~UsbTransport() {
+    }
+
+    // nullptr when there is no libusb device behind the transport
+    virtual libusb_device_handle* handle() = 0;
+    virtual libusb_device* device() = 0;
+
+    virtual int claimInterface(int interface_number) = 0;
+    virtual int releaseInterface(int interface_number) = 0;
+
+    // Reads the serial number string descriptor as ASCII. Returns the number
+    // of bytes read or a libusb error code.
+    virtual int getSerial(uint8_t *data, int length) = 0;
+    // Returns wMaxPacketSize of the endpoint or a libusb error code
+    virtual int getMaxPacketSize(uint8_t endpoint) = 0;
+
+    virtual int submit(struct libusb_transfer *transfer) = 0;
+    virtual int cancel(struct libusb_transfer *transfer) = 0;
+
+    // Clears the halt of a stalled endpoint. Blocks for a control transfer,
+    // but does not run libusb events, so it may be called from a transfer callback.
+    virtual int clearHalt(uint8_t endpoint) = 0;
+};
+
+// Transport for a device opened with libusb
+class LibusbTransport: public UsbTransport {
+public:
+    explicit LibusbTransport(libusb_device_handle *handle) :
+            m_handle(handle), m_device(libusb_get_device(handle)) {
+    }
+
+    libusb_device_handle* handle() override {
+        return m_handle;
+    }
+    libusb_device* device() override {
+        return m_device;
+    }
+
+    int claimInterface(int interface_number) override {
+        return libusb_claim_interface(m_handle, interface_number);
+    }
+    int releaseInterface(int interface_number) override {
+        return libusb_release_interface(m_handle, interface_number);
+    }
+
+    int getSerial(uint8_t *data, int length) override;
+    int getMaxPacketSize(uint8_t endpoint) override {
+        return libusb_get_max_packet_size(m_device, endpoint);
+    }
+
+    int submit(struct libusb_transfer *transfer) override {
+        return libusb_submit_transfer(transfer);
+    }
+    int cancel(struct libusb_transfer *transfer) override {
+        return libusb_cancel_transfer(transfer);
+    }
+
+    int clearHalt(uint8_t endpoint) override {
+        return libusb_clear_halt(m_handle, endpoint);
+    }
+
+private:
+    libusb_device_handle *m_handle;
+    libusb_device *m_device;
+};
@@ -0,0 +1,165 @@
+// Acquires and releases buffers of a small pool from several threads, some
+// released by the thread that acquired them and some handed to another
+// thread first, as the receive queue does. Every buffer acquired is marked
+// as owned and filled with its owner's pattern: a buffer handed out twice
+// shows up as one that is already owned or whose pattern changed. Afterwards
+// every buffer is back in the pool.
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "BufferPool.hpp"
+
+using namespace std;
+
+static int failures = 0;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, name, #condition); \
+            failures++; \
+        } \
+    } while (0)
+
+static const size_t BUFFER_SIZE = 64;
+static const size_t BUFFER_COUNT = 8;
+static const int THREADS = 4;
+static const int ITERATIONS = 1000000;
+
+struct Shared {
+    BufferPool pool { BUFFER_SIZE, BUFFER_COUNT };
+    // Thread that holds each buffer, 0 while it is in the pool
+    atomic<int> owners[BUFFER_COUNT];
+    atomic<uint64_t> twice { 0 };
+    atomic<uint64_t> overwritten { 0 };
+    atomic<uint64_t> foreign { 0 };
+    atomic<uint64_t> exhausted { 0 };
+    // Buffers on their way to another thread, which releases them
+    mutex handoff_lock;
+    vector<uint8_t*> handoff;
+
+    Shared() {
+        for (auto &owner : owners)
+            owner = 0;
+    }
+};
+
+static void run(Shared &shared, int id, uint8_t *base) {
+    int owner = id + 1;
+    vector<uint8_t*> held;
+    for (int i = 0; i < ITERATIONS; i++) {
+        // Takes up to 3 buffers, then gives them back
+        for (int n = i % 3 + 1; n > 0; n--) {
+            uint8_t *buffer = shared.pool.acquire();
+            if (!buffer) {
+                shared.exhausted++;
+                break;
+            }
+            size_t offset = size_t(buffer - base);
+            if (!shared.pool.owns(buffer) || offset % BUFFER_SIZE) {
+                shared.foreign++;
+                continue;
+            }
+            int expected = 0;
+            if (!shared.owners[offset / BUFFER_SIZE].compare_exchange_strong(expected, owner))
+                shared.twice++;
+            memset(buffer, owner, BUFFER_SIZE);
+            held.push_back(buffer);
+        }
+        if (i % 64 == 0)
+            this_thread::yield();
+
+        for (uint8_t *buffer : held) {
+            for (size_t j = 0; j < BUFFER_SIZE; j++)
+                if (buffer[j] != owner) {
+                    shared.overwritten++;
+                    break;
+                }
+        }
+        // Every fourth round the buffers are left for whichever thread takes
+        // the handoff next
+        if (i % 4 == 0) {
+            unique_lock < mutex > lk(shared.handoff_lock);
+            shared.handoff.insert(shared.handoff.end(), held.begin(), held.end());
+        } else {
+            for (uint8_t *buffer : held) {
+                shared.owners[size_t(buffer - base) / BUFFER_SIZE] = 0;
+                shared.pool.release(buffer);
+            }
+        }
+        held.clear();
+
+        vector<uint8_t*> mine;
+        {
+            unique_lock < mutex > lk(shared.handoff_lock);
+            if (i % 4 != 0)
+                mine.swap(shared.handoff);
+        }
+        for (uint8_t *buffer : mine) {
+            shared.owners[size_t(buffer - base) / BUFFER_SIZE] = 0;
+            shared.pool.release(buffer);
+        }
+    }
+}
+
+int main() {
+    const char *name = "threads";
+    unique_ptr<Shared> shared(new Shared());
+    BufferPool &pool = shared->pool;
+
+    // The buffers are handed out from one block, the first one comes first
+    uint8_t *base = pool.acquire();
+    CHECK(base != nullptr);
+    pool.release(base);
+    CHECK(pool.available() == BUFFER_COUNT);
+
+    vector<thread> threads;
+    for (int i = 0; i < THREADS; i++)
+        threads.emplace_back([&, i] {
+            run(*shared, i, base);
+        });
+    for (auto &thread : threads)
+        thread.join();
+    // Handed off by the last round
+    for (uint8_t *buffer : shared->handoff) {
+        shared->owners[size_t(buffer - base) / BUFFER_SIZE] = 0;
+        pool.release(buffer);
+    }
+
+    CHECK(shared->twice == 0);
+    CHECK(shared->overwritten == 0);
+    CHECK(shared->foreign == 0);
+    CHECK(pool.available() == BUFFER_COUNT);
+    printf("%d acquire rounds, %llu found the pool empty\n", THREADS * ITERATIONS,
+            (unsigned long long) shared->exhausted.load());
+
+    name = "drained";
+    // Every buffer is in the free list once
+    set<uint8_t*> buffers;
+    for (size_t i = 0; i < BUFFER_COUNT; i++) {
+        uint8_t *buffer = pool.acquire();
+        CHECK(buffer != nullptr);
+        buffers.insert(buffer);
+    }
+    CHECK(buffers.size() == BUFFER_COUNT);
+    CHECK(pool.acquire() == nullptr);
+    CHECK(pool.available() == 0);
+    for (uint8_t *buffer : buffers)
+        pool.release(buffer);
+    CHECK(pool.available() == BUFFER_COUNT);
+
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}
@@ -0,0 +1,162 @@
+// Parses a corpus of device notifications, well formed and malformed, and
+// checks the identity found in each. Every case is also parsed truncated at
+// every length and with random bytes replaced, from a buffer of exactly its
+// size, so that a read past the end shows up under AddressSanitizer.
+
+#include <memory>
+#include <random>
+#include <string>
+#include <stdio.h>
+#include <string.h>
+
+#include "DeviceIdentity.hpp"
+
+using namespace std;
+
+static int failures = 0;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, name, #condition); \
+            failures++; \
+        } \
+    } while (0)
+
+struct Case {
+    const char *name;
+    string input;
+    bool parsed;
+    uint16_t vid;
+    uint16_t pid;
+    const char *serial;
+    const char *port_path;
+    DeviceIdentity::Action action;
+};
+
+// Keeps the NULs of netlink messages
+#define S(s) string(s, sizeof(s) - 1)
+#define GUID "#{a5dcbf10-6530-11d2-901f-00c04fb951ed}"
+
+static const string serial_126(126, 'S');
+static const string serial_127(127, 'S');
+
+static const Case cases[] = {
+    // Windows device interface paths
+    { "windows", S("\\\\?\\USB#VID_DEAD&PID_BEEF#F6D0D4CE5854242A" GUID), true, 0xDEAD, 0xBEEF, "F6D0D4CE5854242A", "",
+            DeviceIdentity::UNKNOWN },
+    { "windows lower case", S("\\\\?\\usb#vid_dead&pid_beef#serial" GUID), true, 0xDEAD, 0xBEEF, "serial", "",
+            DeviceIdentity::UNKNOWN },
+    { "windows kernel prefix", S("\\??\\USB#VID_0483&PID_5740#00000001" GUID), true, 0x0483, 0x5740, "00000001", "",
+            DeviceIdentity::UNKNOWN },
+    { "windows no prefix", S("USB#VID_1&PID_2#S"), true, 0x0001, 0x0002, "S", "", DeviceIdentity::UNKNOWN },
+    { "windows interface of composite device", S("\\\\?\\USB#VID_DEAD&PID_BEEF&MI_00#6&1a2b3c4d&0&0000" GUID), true,
+            0xDEAD, 0xBEEF, "", "", DeviceIdentity::UNKNOWN },
+    { "windows serial made up by windows", S("\\\\?\\USB#VID_0001&PID_0002#5&abc&0&1" GUID), true, 0x0001, 0x0002, "",
+            "", DeviceIdentity::UNKNOWN },
+    { "windows no instance id", S("\\\\?\\USB#VID_DEAD&PID_BEEF"), true, 0xDEAD, 0xBEEF, "", "",
+            DeviceIdentity::UNKNOWN },
+    { "windows NUL ends the path", S("\\\\?\\USB#VID_DEAD&PID_BEEF#AB\0CD" GUID), true, 0xDEAD, 0xBEEF, "AB", "",
+            DeviceIdentity::UNKNOWN },
+    { "windows longest serial", "\\\\?\\USB#VID_DEAD&PID_BEEF#" + serial_126 + GUID, true, 0xDEAD, 0xBEEF,
+            serial_126.c_str(), "", DeviceIdentity::UNKNOWN },
+    { "windows overlong serial", "\\\\?\\USB#VID_DEAD&PID_BEEF#" + serial_127 + GUID, false },
+    { "windows VID with 5 digits", S("\\\\?\\USB#VID_DEADF&PID_BEEF#X" GUID), true, 0xDEAD, 0xBEEF, "X", "",
+            DeviceIdentity::UNKNOWN },
+    { "windows no PID", S("\\\\?\\USB#VID_DEAD#12345678" GUID), false },
+    { "windows VID not hex", S("\\\\?\\USB#VID_XYZ1&PID_0001#1" GUID), false },
+    { "windows truncated in VID", S("\\\\?\\USB#VID_DE"), false },
+    { "windows not USB", S("\\\\?\\HID#VID_046D&PID_C52B&MI_00#7&2f5e3a1&0&0000" GUID), false },
+    { "empty", S(""), false },
+
+    // Linux uevents
+    { "netlink add", S("add@/devices/pci0000:00/0000:00:14.0/usb1/1-2\0ACTION=add\0"
+            "DEVPATH=/devices/pci0000:00/0000:00:14.0/usb1/1-2\0SUBSYSTEM=usb\0PRODUCT=dead/beef/100\0"
+            "TYPE=0/0/0\0ID_SERIAL_SHORT=F6D0\0"), true, 0xDEAD, 0xBEEF, "F6D0", "1-2", DeviceIdentity::ADD },
+    { "netlink remove of interface", S("remove@/devices/pci0000:00/0000:00:14.0/usb1/1-2/1-2.3/1-2.3:1.0\0"
+            "ACTION=remove\0MODALIAS=usb:v0483p5740d0200dc00dsc00dp00ic02isc02ip01in00\0"), true, 0x0483, 0x5740, "",
+            "1-2.3", DeviceIdentity::REMOVE },
+    { "sysfs uevent file", S("MAJOR=189\nMINOR=1\nDEVNAME=bus/usb/001/002\nDEVTYPE=usb_device\nDRIVER=usb\n"
+            "PRODUCT=1d6b/2/510\nTYPE=9/0/3\nBUSNUM=001\nDEVNUM=002\n"), true, 0x1D6B, 0x0002, "", "",
+            DeviceIdentity::UNKNOWN },
+    { "MODALIAS lower case", S("MODALIAS=usb:vdeadpbeefd0100\n"), true, 0xDEAD, 0xBEEF, "", "",
+            DeviceIdentity::UNKNOWN },
+    { "PRODUCT after MODALIAS wins", S("MODALIAS=usb:v1111p2222d0100\nPRODUCT=3333/4444/1\n"), true, 0x3333, 0x4444,
+            "", "", DeviceIdentity::UNKNOWN },
+    { "MODALIAS after PRODUCT ignored", S("PRODUCT=3333/4444/1\nMODALIAS=usb:v1111p2222d0100\n"), true, 0x3333,
+            0x4444, "", "", DeviceIdentity::UNKNOWN },
+    { "root hub DEVPATH", S("ACTION=add\nDEVPATH=/devices/pci0000:00/0000:00:14.0/usb1\nPRODUCT=1d6b/2/510\n"), true,
+            0x1D6B, 0x0002, "", "", DeviceIdentity::ADD },
+    { "overlong DEVPATH port", S("DEVPATH=/devices/usb1/1-1.2.3.4.5.6.7.1.2.3.4.5.6.7.1.2.3\nPRODUCT=1/2/3\n"), true,
+            0x0001, 0x0002, "", "", DeviceIdentity::UNKNOWN },
+    { "DEVPATH not a port", S("DEVPATH=/devices/usb1/1-2x\nPRODUCT=1/2/3\n"), true, 0x0001, 0x0002, "", "",
+            DeviceIdentity::UNKNOWN },
+    { "serial containing &", S("PRODUCT=1/2/3\nID_SERIAL_SHORT=A&B\n"), true, 0x0001, 0x0002, "A&B", "",
+            DeviceIdentity::UNKNOWN },
+    { "overlong ID_SERIAL_SHORT", "PRODUCT=1/2/3\nID_SERIAL_SHORT=" + serial_127 + "\n", true, 0x0001, 0x0002, "",
+            "", DeviceIdentity::UNKNOWN },
+    { "CRLF lines", S("ACTION=remove\r\nPRODUCT=dead/beef/1\r\n"), true, 0xDEAD, 0xBEEF, "", "",
+            DeviceIdentity::UNKNOWN },
+    { "PRODUCT VID with 5 digits", S("PRODUCT=12345/6789/1\n"), false },
+    { "PRODUCT truncated", S("PRODUCT=dead/"), false },
+    { "MODALIAS not USB", S("MODALIAS=pci:v00008086d00001E31\n"), false },
+    { "ACTION only", S("ACTION=add\n"), false },
+    { "no fields", S("\n\n\0\0"), false },
+};
+
+// Parses s from a heap buffer of exactly its length
+static bool parseExact(const string &s, DeviceIdentity &identity) {
+    unique_ptr<char[]> copy(new char[s.size() ? s.size() : 1]);
+    memcpy(copy.get(), s.data(), s.size());
+    return parseDeviceIdentity(copy.get(), s.size(), identity);
+}
+
+static bool terminated(const DeviceIdentity &identity) {
+    return memchr(identity.serial, 0, sizeof(identity.serial)) && memchr(identity.port_path, 0,
+            sizeof(identity.port_path));
+}
+
+int main() {
+    for (auto &c : cases) {
+        const char *name = c.name;
+        DeviceIdentity identity;
+        bool parsed = parseExact(c.input, identity);
+        CHECK(parsed == c.parsed);
+        if (parsed && c.parsed) {
+            CHECK(identity.vid == c.vid);
+            CHECK(identity.pid == c.pid);
+            CHECK(!strcmp(identity.serial, c.serial));
+            CHECK(!strcmp(identity.port_path, c.port_path));
+            CHECK(identity.action == c.action);
+        }
+
+        for (size_t length = 0; length < c.input.size(); length++) {
+            parseExact(c.input.substr(0, length), identity);
+            CHECK(terminated(identity));
+        }
+    }
+
+    // Random bytes replaced, with a bias towards the characters that delimit fields
+    const char *name = "mutations";
+    static const char special[] = "\\?#&_=@/:.\n\r\0-";
+    mt19937 random(1);
+    for (int i = 0; i < 100000; i++) {
+        string input = cases[random() % (sizeof(cases) / sizeof(cases[0]))].input;
+        if (input.empty())
+            continue;
+        for (int n = 1 + random() % 4; n > 0; n--) {
+            char c = random() % 2 ? special[random() % (sizeof(special) - 1)] : char(random());
+            input[random() % input.size()] = c;
+        }
+        DeviceIdentity identity;
+        parseExact(input, identity);
+        CHECK(terminated(identity));
+    }
+
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}
@@ -0,0 +1,262 @@
+// Parses a stream of frames mixed with frames that have a bad checksum,
+// frames longer than the format allows and garbage, split into two transfers
+// at every offset, fed a byte at a time and interleaved on two endpoints.
+// Every split must give the same messages and counts as the whole stream.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "FrameParser.hpp"
+
+using namespace std;
+
+static int failures = 0;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, name, #condition); \
+            failures++; \
+        } \
+    } while (0)
+
+static const size_t MAX_PAYLOAD = 64;
+
+// Reads lengths up to 1024 like the default format but keeps a reassembly
+// buffer for MAX_PAYLOAD, so that the parser's own check of maxFrameSize()
+// is what rejects the longer frames
+class ShortFormat: public SyncFrameFormat {
+public:
+    size_t maxFrameSize() const override {
+        return HEADER_SIZE + MAX_PAYLOAD + CRC_SIZE;
+    }
+};
+
+struct Received {
+    uint8_t endpoint;
+    uint8_t type;
+    vector<uint8_t> payload;
+
+    bool operator==(const Received &other) const {
+        return endpoint == other.endpoint && type == other.type && payload == other.payload;
+    }
+};
+
+// The stream and what parsing it must give
+struct Stream {
+    vector<uint8_t> bytes;
+    vector<Received> messages;
+    uint64_t bad_checksums = 0;
+    uint64_t unknown_types = 0;
+    uint64_t skipped_bytes = 0;
+    // Whether the rejected frames can be skipped as a whole, none of their
+    // bytes after the first looks like the start of a frame
+    bool skippable = true;
+
+    vector<uint8_t> encode(uint8_t type, size_t length, uint8_t seed) {
+        vector<uint8_t> payload(length);
+        for (size_t i = 0; i < length; i++)
+            payload[i] = uint8_t(seed + i * 7);
+        vector<uint8_t> frame(SyncFrameFormat::HEADER_SIZE + length + SyncFrameFormat::CRC_SIZE);
+        SyncFrameFormat::encode(type, payload.data(), uint16_t(length), frame.data());
+        return frame;
+    }
+
+    void append(const vector<uint8_t> &frame) {
+        bytes.insert(bytes.end(), frame.begin(), frame.end());
+    }
+
+    void reject(const vector<uint8_t> &frame) {
+        append(frame);
+        skipped_bytes += frame.size();
+        skippable = skippable && !hasSync(frame);
+    }
+
+    static bool hasSync(const vector<uint8_t> &frame) {
+        return memchr(frame.data() + 1, SyncFrameFormat::SYNC, frame.size() - 1) != nullptr;
+    }
+
+    // A frame without the sync byte after its start
+    vector<uint8_t> encodeRejected(uint8_t type, size_t length, bool bad_checksum) {
+        for (int seed = 0; seed < 256; seed++) {
+            vector<uint8_t> frame = encode(type, length, uint8_t(seed));
+            if (bad_checksum)
+                frame[frame.size() - 1] ^= 0x01;
+            if (!hasSync(frame))
+                return frame;
+        }
+        return encode(type, length, 0);
+    }
+
+    void frame(uint8_t type, size_t length, uint8_t seed) {
+        vector<uint8_t> frame = encode(type, length, seed);
+        append(frame);
+        Received message = { 0, type, vector<uint8_t>(frame.begin() + SyncFrameFormat::HEADER_SIZE, frame.end()
+                - SyncFrameFormat::CRC_SIZE) };
+        messages.push_back(message);
+        if (type >= 4)
+            unknown_types++;
+    }
+
+    void badChecksum(uint8_t type, size_t length) {
+        bad_checksums++;
+        reject(encodeRejected(type, length, true));
+    }
+
+    void tooLong(size_t length) {
+        reject(encodeRejected(1, length, false));
+    }
+
+    void garbage(size_t length) {
+        vector<uint8_t> bytes(length);
+        for (size_t i = 0; i < length; i++)
+            bytes[i] = uint8_t(0x30 + i % 64);
+        reject(bytes);
+    }
+
+    // A sync byte and a plausible header, the frame it announces runs into
+    // the real frame that follows and fails its checksum
+    void falseStart() {
+        const uint8_t header[] = { SyncFrameFormat::SYNC, 0x01, 0x03, 0x00 };
+        bytes.insert(bytes.end(), header, header + sizeof(header));
+        bad_checksums++;
+        skipped_bytes += sizeof(header);
+    }
+};
+
+static Stream makeStream() {
+    Stream stream;
+    stream.frame(1, 0, 0);
+    stream.frame(2, 10, 0xA0);
+    stream.garbage(3);
+    stream.frame(3, MAX_PAYLOAD, 0x10);
+    stream.badChecksum(2, 20);
+    stream.frame(1, 1, SyncFrameFormat::SYNC);
+    stream.tooLong(MAX_PAYLOAD + 1);
+    stream.frame(2, 5, 0x5A);
+    stream.falseStart();
+    stream.frame(3, 30, 0x33);
+    stream.frame(9, 2, 0x44);
+    stream.tooLong(200);
+    stream.garbage(1);
+    stream.badChecksum(1, 0);
+    stream.frame(1, 17, 0xA5);
+    stream.garbage(5);
+    stream.frame(2, MAX_PAYLOAD, 0x01);
+    return stream;
+}
+
+struct Run {
+    ShortFormat format;
+    FrameParser parser;
+    vector<Received> received;
+
+    Run() :
+            parser(format) {
+        for (uint8_t type = 1; type <= 3; type++)
+            parser.on(type, [this](const Message &message) {
+                record(message);
+            });
+        parser.onUnknown([this](const Message &message) {
+            record(message);
+        });
+    }
+
+    void record(const Message &message) {
+        Received copy = { message.endpoint, message.type, vector<uint8_t>(message.payload, message.payload
+                + message.length) };
+        received.push_back(copy);
+    }
+};
+
+// Checks what one endpoint received against the stream
+static void check(const char *name, const Stream &stream, const Run &run, uint8_t endpoint, size_t copies = 1) {
+    vector<Received> expected;
+    for (auto message : stream.messages) {
+        message.endpoint = endpoint;
+        expected.push_back(message);
+    }
+    vector<Received> received;
+    for (auto &message : run.received)
+        if (message.endpoint == endpoint)
+            received.push_back(message);
+    CHECK(received == expected);
+    CHECK(run.parser.messages == stream.messages.size() * copies);
+    CHECK(run.parser.bad_checksums == stream.bad_checksums * copies);
+    CHECK(run.parser.unknown_types == stream.unknown_types * copies);
+    CHECK(run.parser.skipped_bytes == stream.skipped_bytes * copies);
+}
+
+int main() {
+    Stream stream = makeStream();
+    const uint8_t *bytes = stream.bytes.data();
+    size_t size = stream.bytes.size();
+    const char *name = "stream";
+    CHECK(stream.skippable);
+
+    {
+        name = "whole";
+        Run run;
+        run.parser.parse(0x81, bytes, size);
+        check(name, stream, run, 0x81);
+    }
+
+    // Each part is a buffer of its own size, so that reading past it shows
+    // up under AddressSanitizer
+    for (size_t split = 0; split <= size; split++) {
+        name = "split";
+        Run run;
+        vector<uint8_t> first(bytes, bytes + split);
+        vector<uint8_t> second(bytes + split, bytes + size);
+        run.parser.parse(0x81, first.data(), first.size());
+        run.parser.parse(0x81, second.data(), second.size());
+        check(name, stream, run, 0x81);
+        if (failures) {
+            fprintf(stderr, "split at %zu\n", split);
+            break;
+        }
+    }
+
+    {
+        name = "byte at a time";
+        Run run;
+        for (size_t i = 0; i < size; i++) {
+            uint8_t byte = bytes[i];
+            run.parser.parse(0x81, &byte, 1);
+        }
+        check(name, stream, run, 0x81);
+    }
+
+    {
+        name = "two endpoints interleaved";
+        Run run;
+        // In pieces of 3 and 5 bytes, so that the frames end at different times
+        for (size_t first = 0, second = 0; first < size || second < size; first += 3, second += 5) {
+            if (first < size)
+                run.parser.parse(0x81, bytes + first, size - first < 3 ? size - first : 3);
+            if (second < size)
+                run.parser.parse(0x82, bytes + second, size - second < 5 ? size - second : 5);
+        }
+        check(name, stream, run, 0x81, 2);
+        check(name, stream, run, 0x82, 2);
+    }
+
+    {
+        name = "reset";
+        Run run;
+        // The start of the second frame is kept for the next transfer
+        run.parser.parse(0x81, bytes + 6, 5);
+        run.parser.reset();
+        run.parser.parse(0x81, bytes, size);
+        check(name, stream, run, 0x81);
+    }
+
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}
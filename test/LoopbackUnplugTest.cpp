@@ -0,0 +1,165 @@
+// Unplugs a LoopbackTransport while the echo loop is running and checks that
+// the device closes cleanly: on_closed is called exactly once, every transfer
+// has called back, and every buffer and transfer is back in its pool.
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <stdio.h>
+
+#include "Coalescer.hpp"
+#include "Device.hpp"
+#include "Executor.hpp"
+#include "Log.hpp"
+#include "LoopbackTransport.hpp"
+
+using namespace std;
+
+static int failures = 0;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, name, #condition); \
+            failures++; \
+        } \
+    } while (0)
+
+// Polls until condition() holds, returns false after the timeout
+template<typename Condition>
+static bool waitFor(Condition condition, chrono::milliseconds timeout = chrono::milliseconds(5000)) {
+    auto end = chrono::steady_clock::now() + timeout;
+    while (!condition()) {
+        if (chrono::steady_clock::now() > end)
+            return false;
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    return true;
+}
+
+static const MetricsSnapshot::Endpoint* findEndpoint(const MetricsSnapshot &metrics, uint8_t endpoint) {
+    for (auto &ep : metrics.endpoints)
+        if (ep.endpoint == endpoint)
+            return &ep;
+    return nullptr;
+}
+
+static void runUnplug(const char *name, const LoopbackConfig &loopback_config, DeviceConfig config) {
+    Executor executor(2);
+    config.executor = &executor;
+    config.echo_seed_packets = 16;
+    size_t ring_size = config.in_endpoints.size() * config.in_ring_depth;
+    config.buffer_pool_size = ring_size + config.recv_queue_size + config.echo_seed_packets;
+
+    LoopbackTransport *transport = new LoopbackTransport(loopback_config);
+    Device *device = new Device(unique_ptr<UsbTransport>(transport), config);
+
+    // Under load: packets are going round and transfers are in flight
+    bool loaded = waitFor([device] {
+        MetricsSnapshot metrics = device->metrics();
+        const MetricsSnapshot::Endpoint *in = findEndpoint(metrics, 0x81);
+        return in && in->transfers >= 1000;
+    });
+    CHECK(loaded);
+    // A full send queue leaves the packets on the receive queue, it neither
+    // drops the sends nor blocks the executor
+    if (config.send_queue_full == DeviceConfig::SEND_QUEUE_BLOCK)
+        CHECK(device->metrics().send_dropped == 0);
+    // Coalesced transfers are ended on packet boundaries
+    if (config.coalesce) {
+        CHECK(transport->zero_packets > 0);
+        CHECK(transport->unterminated == 0);
+    }
+    // Every stall was cleared and its send retried
+    if (loopback_config.stall > 0) {
+        CHECK(transport->stalls > 0);
+        CHECK(device->metrics().send_errors == 0);
+    }
+
+    mutex closed_mutex;
+    condition_variable closed_cv;
+    int closed = 0;
+    transport->unplug();
+    device->close([&]() {
+        unique_lock < mutex > lk(closed_mutex);
+        closed++;
+        closed_cv.notify_all();
+    });
+    {
+        unique_lock < mutex > lk(closed_mutex);
+        CHECK(closed_cv.wait_for(lk, chrono::seconds(5), [&] {
+            return closed > 0;
+        }));
+    }
+
+    // Nothing calls back after on_closed, a second close() is ignored
+    transport->flush();
+    device->close([&]() {
+        closed++;
+    });
+    CHECK(closed == 1);
+
+    // The packet processing still holds the packets it was given, those go
+    // back to the pool once it has run. The IN ring keeps a buffer per transfer.
+    bool drained = waitFor([device, config, ring_size] {
+        return device->metrics().buffers_available == config.buffer_pool_size - ring_size;
+    });
+    CHECK(drained);
+
+    MetricsSnapshot metrics = device->metrics();
+    CHECK(metrics.recv_queue_depth == 0);
+    const MetricsSnapshot::Endpoint *out = findEndpoint(metrics, 0x01);
+    CHECK(out && out->in_flight == 0);
+    CHECK(out && out->queue_depth == 0);
+    const TransferPool &pool = device->getTransferPool();
+    CHECK(pool.available() == pool.capacity());
+    if (failures)
+        fprintf(stderr, "%s: %s", name, metrics.toText().c_str());
+
+    delete device;
+}
+
+int main() {
+    // The unplug fails the sends and re-submits under way, which is expected
+    Log::setLevel(LOG_LEVEL_ERROR);
+
+    for (int i = 0; i < 20; i++) {
+        LoopbackConfig loopback_config;
+        DeviceConfig config;
+        runUnplug("no latency", loopback_config, config);
+
+        loopback_config.latency_us = 100;
+        loopback_config.loss = 0.001;
+        loopback_config.seed = i + 1;
+        runUnplug("latency and loss", loopback_config, config);
+
+        LoopbackConfig split_config;
+        split_config.split_coalesced = true;
+        // A payload with its length fills a packet
+        split_config.max_packet_size = uint16_t(config.transfer_size + Coalescer::HEADER_SIZE);
+        config.coalesce = true;
+        config.coalesce_budget_us = 50;
+        runUnplug("coalescing", split_config, config);
+
+        config = DeviceConfig();
+        config.in_ring_depth = 16;
+        config.max_out_in_flight = 2;
+        config.send_queue_size = 4;
+        runUnplug("full send queue", LoopbackConfig(), config);
+
+        LoopbackConfig stall_config;
+        stall_config.stall = 0.01;
+        stall_config.seed = i + 1;
+        runUnplug("stalls", stall_config, DeviceConfig());
+    }
+
+    Log::flush();
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}
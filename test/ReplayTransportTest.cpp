@@ -0,0 +1,146 @@
+// Replays a capture with packets on two IN endpoints: configured with the
+// endpoints of the capture, every packet is delivered; configured for one,
+// the packets of the other are skipped and the replay still finishes.
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+
+#include "Capture.hpp"
+#include "Device.hpp"
+#include "Executor.hpp"
+#include "Log.hpp"
+#include "ReplayTransport.hpp"
+
+using namespace std;
+
+static int failures = 0;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, name, #condition); \
+            failures++; \
+        } \
+    } while (0)
+
+// Polls until condition() holds, returns false after the timeout
+template<typename Condition>
+static bool waitFor(Condition condition, chrono::milliseconds timeout = chrono::milliseconds(5000)) {
+    auto end = chrono::steady_clock::now() + timeout;
+    while (!condition()) {
+        if (chrono::steady_clock::now() > end)
+            return false;
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    return true;
+}
+
+static const char *capture_path = "ReplayTransportTest.cap";
+static const int packets_per_endpoint = 1000;
+
+// Packets alternate between EP81 and EP82, each carries its endpoint and its
+// index on that endpoint
+static bool writeCapture() {
+    CaptureWriter writer(capture_path, 1 << 20, "00000001");
+    if (!writer.valid())
+        return false;
+    auto time = chrono::steady_clock::now();
+    for (int i = 0; i < packets_per_endpoint; i++)
+        for (uint8_t endpoint : { 0x81, 0x82 }) {
+            uint8_t payload[8] = { endpoint, uint8_t(i), uint8_t(i >> 8) };
+            if (!writer.append(endpoint, LIBUSB_TRANSFER_COMPLETED, payload, sizeof(payload), time))
+                return false;
+            time += chrono::microseconds(10);
+        }
+    return true;
+}
+
+static void runReplay(const char *name, const vector<uint8_t> &replay_endpoints, int expected_81, int expected_82,
+        int expected_skipped) {
+    Executor executor(2);
+    ReplayConfig replay_config;
+    replay_config.path = capture_path;
+    replay_config.max_speed = true;
+    replay_config.in_endpoints = replay_endpoints;
+    DeviceConfig config;
+    config.executor = &executor;
+    config.echo_seed_packets = 0;
+    replay_config.window = config.recv_queue_size / 2;
+    ReplayTransport *transport = new ReplayTransport(replay_config);
+    CHECK(transport->valid());
+    CHECK(transport->inEndpoints() == vector<uint8_t>({ 0x81, 0x82 }));
+    if (replay_endpoints.empty())
+        config.in_endpoints = transport->inEndpoints();
+    else
+        config.in_endpoints = replay_endpoints;
+
+    // Runs on one executor worker at a time
+    int received[2] = { 0, 0 };
+    bool in_order = true;
+    config.on_packets = [&](Device &device, Packet *packets, size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            Packet &packet = packets[i];
+            int index = packet.endpoint == 0x82;
+            if (packet.length != 8 || packet.data[0] != packet.endpoint
+                    || (packet.data[1] | packet.data[2] << 8) != received[index])
+                in_order = false;
+            received[index]++;
+            device.releaseBuffer(packet.data);
+        }
+        transport->consumed(count);
+    };
+    Device *device = new Device(unique_ptr<UsbTransport>(transport), config);
+
+    CHECK(waitFor([transport] {
+        return transport->finished();
+    }));
+    CHECK(waitFor([device] {
+        return device->metrics().recv_queue_depth == 0;
+    }));
+
+    mutex closed_mutex;
+    condition_variable closed_cv;
+    bool closed = false;
+    transport->unplug();
+    device->close([&]() {
+        unique_lock < mutex > lk(closed_mutex);
+        closed = true;
+        closed_cv.notify_all();
+    });
+    {
+        unique_lock < mutex > lk(closed_mutex);
+        CHECK(closed_cv.wait_for(lk, chrono::seconds(5), [&] {
+            return closed;
+        }));
+    }
+
+    CHECK(received[0] == expected_81);
+    CHECK(received[1] == expected_82);
+    CHECK(in_order);
+    CHECK(transport->skipped.load() == uint64_t(expected_skipped));
+    CHECK(transport->replayed.load() == uint64_t(expected_81 + expected_82));
+    delete device;
+}
+
+int main() {
+    Log::setLevel(LOG_LEVEL_ERROR);
+    const char *name = "capture";
+    CHECK(writeCapture());
+
+    runReplay("endpoints of the capture", vector<uint8_t>(), packets_per_endpoint, packets_per_endpoint, 0);
+    runReplay("EP81 only", { 0x81 }, packets_per_endpoint, 0, packets_per_endpoint);
+
+    remove(capture_path);
+    Log::flush();
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}
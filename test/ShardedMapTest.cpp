@@ -0,0 +1,168 @@
+// Inserts, replaces and removes devices in a ShardedMap from two writers
+// while readers look them up. A device is marked retired once its removal
+// has returned, that is once ReadEpoch says no reader can see it any more:
+// a lookup that started after that must not find it, and a reader inside
+// find() must never hold a retired one. A second run has more reader
+// threads than ReadEpoch has slots, so that some take the shared lock.
+
+#include <atomic>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "ShardedMap.hpp"
+
+using namespace std;
+
+static int failures = 0;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, name, #condition); \
+            failures++; \
+        } \
+    } while (0)
+
+static atomic<int> alive { 0 };
+// Counts removals, a device is retired at the value it was advanced to
+static atomic<uint64_t> retirements { 0 };
+
+struct Device {
+    int key;
+    atomic<uint64_t> retired { 0 };
+
+    explicit Device(int key) :
+            key(key) {
+        alive++;
+    }
+    ~Device() {
+        alive--;
+    }
+};
+
+static const int KEYS_PER_WRITER = 64;
+
+struct Counts {
+    atomic<uint64_t> found { 0 };
+    atomic<uint64_t> stale { 0 };
+    atomic<uint64_t> wrong_key { 0 };
+};
+
+static void retire(const shared_ptr<Device> &device) {
+    if (device)
+        device->retired = ++retirements;
+}
+
+static void write(ShardedMap<int, shared_ptr<Device>> &map, int writer, int operations) {
+    mt19937 random(writer);
+    for (int i = 0; i < operations; i++) {
+        int key = writer * 1000 + int(random() % KEYS_PER_WRITER);
+        switch (random() % 4) {
+        case 0:
+        case 1:
+            map.insert(key, make_shared<Device>(key));
+            break;
+        case 2:
+            retire(map.assign(key, make_shared<Device>(key)));
+            break;
+        default:
+            retire(map.erase(key));
+            break;
+        }
+        this_thread::yield();
+    }
+}
+
+static void read(const ShardedMap<int, shared_ptr<Device>> &map, int reader, int writers, Counts &counts,
+        atomic<int> &started, const atomic<bool> &stop) {
+    mt19937 random(100 + reader);
+    started++;
+    while (!stop) {
+        int key = int(random() % writers) * 1000 + int(random() % KEYS_PER_WRITER);
+        uint64_t start = retirements.load();
+        shared_ptr<Device> device = map.find(key);
+        if (device) {
+            counts.found++;
+            if (device->key != key)
+                counts.wrong_key++;
+            uint64_t retired = device->retired.load();
+            if (retired && retired <= start)
+                counts.stale++;
+        }
+        // Sometimes lets the writers run while the device is held
+        bool pause = random() % 8 == 0;
+        map.find(key, [&](const shared_ptr<Device> &device) {
+            if (pause)
+                this_thread::yield();
+            if (device->key != key)
+                counts.wrong_key++;
+            if (device->retired.load())
+                counts.stale++;
+        });
+        // Gives the writers a turn on a single core, a reader preempted in
+        // its read section holds them up for a time slice
+        this_thread::yield();
+    }
+}
+
+static void churn(const char *name, int readers, int operations) {
+    const int writers = 2;
+    uint64_t retired = retirements;
+    {
+        ShardedMap<int, shared_ptr<Device>> map;
+        Counts counts;
+        atomic<int> started { 0 };
+        atomic<bool> stop { false };
+        vector<thread> reader_threads;
+        for (int i = 0; i < readers; i++)
+            reader_threads.emplace_back([&, i] {
+                read(map, i, writers, counts, started, stop);
+            });
+        while (started < readers)
+            this_thread::yield();
+        vector<thread> writer_threads;
+        for (int i = 0; i < writers; i++)
+            writer_threads.emplace_back([&, i] {
+                write(map, i, operations);
+            });
+        for (auto &thread : writer_threads)
+            thread.join();
+        stop = true;
+        for (auto &thread : reader_threads)
+            thread.join();
+
+        CHECK(counts.found > 0);
+        CHECK(counts.stale == 0);
+        CHECK(counts.wrong_key == 0);
+        size_t entries = 0;
+        map.forEach([&](const int &key, const shared_ptr<Device> &device) {
+            CHECK(device->key == key);
+            CHECK(!device->retired);
+            entries++;
+        });
+        CHECK(entries == map.size());
+        CHECK(alive == int(entries));
+        printf("%s: %llu found, %llu removed\n", name, (unsigned long long) counts.found.load(),
+                (unsigned long long) (retirements - retired));
+    }
+    CHECK(alive == 0);
+}
+
+int main() {
+    churn("4 readers", 4, 20000);
+    // More readers than ReadEpoch has slots
+    churn("150 readers", 150, 2000);
+
+    const char *name = "main";
+    CHECK(alive == 0);
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}
@@ -0,0 +1,229 @@
+// Writes into a 4 KiB shared ring and reads it back with two readers in the
+// same process: a record that does not fit before the end is preceded by a
+// PAD record, a reader a full ring behind makes the writer drop packets, a
+// reader that detaches or whose process has gone stops holding the writer
+// back, and the readers drain what is left once the writer has closed.
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
+
+#include "SharedRing.hpp"
+
+using namespace std;
+
+static int failures = 0;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, name, #condition); \
+            failures++; \
+        } \
+    } while (0)
+
+static const size_t CAPACITY = 4096;
+// Takes 224 bytes with the record header, 18 fit in the ring and leave 64
+// bytes at the end
+static const uint16_t LENGTH = 200;
+
+// The packet carries its sequence number, and bytes derived from it
+static bool write(SharedRingWriter &writer, uint32_t sequence, uint16_t length = LENGTH) {
+    uint8_t data[1024];
+    memcpy(data, &sequence, sizeof(sequence));
+    for (size_t i = sizeof(sequence); i < length; i++)
+        data[i] = uint8_t(sequence + i);
+    return writer.write(uint8_t(0x81 + sequence % 2), data, length, sequence * 1000ull);
+}
+
+static bool valid(const SharedPacket &packet, uint32_t sequence, uint16_t length = LENGTH) {
+    if (packet.length != length || packet.endpoint != 0x81 + sequence % 2 || packet.received_ns != sequence * 1000ull)
+        return false;
+    uint32_t written;
+    memcpy(&written, packet.data, sizeof(written));
+    if (written != sequence)
+        return false;
+    for (size_t i = sizeof(sequence); i < length; i++)
+        if (packet.data[i] != uint8_t(sequence + i))
+            return false;
+    return true;
+}
+
+// Takes everything there is and checks it carries the given sequence numbers
+static void expect(const char *name, SharedRingReader &reader, uint32_t first, uint32_t count) {
+    SharedPacket packets[64];
+    size_t polled = reader.poll(packets, 64);
+    CHECK(polled == count);
+    for (size_t i = 0; i < polled && i < count; i++)
+        CHECK(valid(packets[i], first + uint32_t(i)));
+    reader.release();
+}
+
+int main() {
+    string ring_name = "usbecho-test-" + to_string(
+#ifdef _WIN32
+            0
+#else
+            getpid()
+#endif
+            );
+
+    {
+        const char *name = "wrap around";
+        unique_ptr<SharedRingWriter> writer(new SharedRingWriter(ring_name, CAPACITY));
+        CHECK(writer->valid());
+        SharedRingReader first, second;
+        CHECK(first.open(ring_name));
+        CHECK(second.open(ring_name));
+
+        for (uint32_t sequence = 0; sequence < 18; sequence++)
+            CHECK(write(*writer, sequence));
+        // The next one needs the 64 bytes at the end for a PAD record and its
+        // own 224 at the front, neither reader has released anything yet
+        CHECK(!write(*writer, 18));
+        CHECK(writer->dropped() == 1);
+
+        name = "lagging reader";
+        expect(name, first, 0, 18);
+        CHECK(!write(*writer, 18));
+        CHECK(writer->dropped() == 2);
+        CHECK(first.dropped() == 2);
+
+        SharedPacket packets[10];
+        CHECK(second.poll(packets, 10) == 10);
+        second.release();
+        name = "PAD record";
+        CHECK(write(*writer, 18));
+        expect(name, first, 18, 1);
+        expect(name, second, 10, 9);
+
+        name = "detached reader";
+        // The second reader stops reading, a ring later it holds the writer back
+        uint32_t sequence = 19;
+        while (write(*writer, sequence)) {
+            expect(name, first, sequence, 1);
+            sequence++;
+        }
+        CHECK(sequence > 19 && sequence < 19 + 19);
+        uint64_t dropped = writer->dropped();
+        second.detach();
+        CHECK(write(*writer, sequence));
+        expect(name, first, sequence, 1);
+        CHECK(writer->dropped() == dropped);
+
+        name = "reader slots";
+        // The detached reader's slot is free again, with the first reader there are 16
+        vector<unique_ptr<SharedRingReader>> readers;
+        for (int i = 1; i < SharedRingHeader::MAX_READERS; i++) {
+            readers.emplace_back(new SharedRingReader());
+            CHECK(readers.back()->open(ring_name));
+        }
+        SharedRingReader extra;
+        CHECK(!extra.open(ring_name));
+        readers.pop_back();
+        CHECK(extra.open(ring_name));
+        extra.detach();
+        readers.clear();
+
+#ifndef _WIN32
+        name = "reader process gone";
+        // A reader that exits without detaching is only found once it holds
+        // the writer back
+        pid_t child = fork();
+        if (!child) {
+            SharedRingReader reader;
+            _exit(reader.open(ring_name) ? 0 : 1);
+        }
+        int status = 0;
+        CHECK(waitpid(child, &status, 0) == child);
+        CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        sequence++;
+        for (uint32_t end = sequence + 100; sequence < end; sequence++) {
+            CHECK(write(*writer, sequence));
+            expect(name, first, sequence, 1);
+        }
+        CHECK(writer->dropped() == dropped);
+#endif
+
+        name = "closed";
+        sequence++;
+        for (uint32_t i = 0; i < 5; i++)
+            CHECK(write(*writer, sequence + i));
+        writer.reset();
+        CHECK(!first.closed());
+        expect(name, first, sequence, 5);
+        CHECK(first.closed());
+        // Readers keep their mapping, but no new one can open the ring
+        SharedRingReader late;
+        CHECK(!late.open(ring_name));
+    }
+
+    {
+        const char *name = "threads";
+        const uint32_t total = 200000;
+        unique_ptr<SharedRingWriter> writer(new SharedRingWriter(ring_name, CAPACITY));
+        CHECK(writer->valid());
+        SharedRingReader readers[2];
+        CHECK(readers[0].open(ring_name));
+        CHECK(readers[1].open(ring_name));
+
+        // Each reader sees the packets that were not dropped, in order
+        atomic<int> bad { 0 };
+        vector<uint32_t> seen[2];
+        vector<thread> threads;
+        for (int i = 0; i < 2; i++)
+            threads.emplace_back([&, i] {
+                SharedRingReader &reader = readers[i];
+                while (!reader.closed()) {
+                    SharedPacket packets[16];
+                    size_t count = reader.poll(packets, 16);
+                    for (size_t j = 0; j < count; j++) {
+                        uint32_t sequence;
+                        memcpy(&sequence, packets[j].data, sizeof(sequence));
+                        if (!valid(packets[j], sequence, uint16_t(4 + sequence % 300)))
+                            bad++;
+                        seen[i].push_back(sequence);
+                    }
+                    reader.release();
+                    if (!count)
+                        this_thread::yield();
+                }
+            });
+
+        vector<uint32_t> written;
+        for (uint32_t sequence = 0; sequence < total; sequence++) {
+            if (write(*writer, sequence, uint16_t(4 + sequence % 300)))
+                written.push_back(sequence);
+            else
+                // Lets the readers catch up on a single core
+                this_thread::yield();
+        }
+        uint64_t dropped = writer->dropped();
+        writer.reset();
+        for (auto &thread : threads)
+            thread.join();
+
+        CHECK(bad == 0);
+        CHECK(written.size() + dropped == total);
+        CHECK(seen[0] == written);
+        CHECK(seen[1] == written);
+        printf("%u packets, %llu dropped\n", total, (unsigned long long) dropped);
+    }
+
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}
@@ -0,0 +1,166 @@
+// Runs a coroutine that writes to OUT1 and reads the echo back from IN1 over
+// a LoopbackTransport, then closes the device while the coroutine is
+// suspended on a read that never completes. The coroutine must resume with
+// the read cancelled and be done before on_closed is called, and every
+// transfer must be back in the pool.
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <stdio.h>
+#include <string.h>
+
+#include "Device.hpp"
+#include "Executor.hpp"
+#include "Log.hpp"
+#include "LoopbackTransport.hpp"
+
+using namespace std;
+
+#ifdef DEVICE_COROUTINES
+
+static int failures = 0;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, name, #condition); \
+            failures++; \
+        } \
+    } while (0)
+
+// Polls until condition() holds, returns false after the timeout
+template<typename Condition>
+static bool waitFor(Condition condition, chrono::milliseconds timeout = chrono::milliseconds(5000)) {
+    auto end = chrono::steady_clock::now() + timeout;
+    while (!condition()) {
+        if (chrono::steady_clock::now() > end)
+            return false;
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    return true;
+}
+
+struct PingPong {
+    int round_trips = 0;
+    atomic<int> completed { 0 };
+    atomic<bool> mismatch { false };
+    // Set right before the read that never completes
+    atomic<bool> waiting { false };
+    atomic<bool> done { false };
+    enum libusb_transfer_status last_status = LIBUSB_TRANSFER_COMPLETED;
+};
+
+static UsbTask pingPong(Device &device, PingPong &state) {
+    uint8_t out[64];
+    uint8_t in[64];
+    for (int i = 0; i < state.round_trips; i++) {
+        memset(out, i & 0xFF, sizeof(out));
+        out[0] = uint8_t(i >> 8);
+        TransferResult written = co_await device.write(0x01, span<const uint8_t>(out, sizeof(out)));
+        if (!written) {
+            state.last_status = written.status;
+            state.done = true;
+            co_return;
+        }
+        TransferResult read = co_await device.read(0x81, span<uint8_t>(in, sizeof(in)));
+        if (!read) {
+            state.last_status = read.status;
+            state.done = true;
+            co_return;
+        }
+        if (read.length != sizeof(out) || memcmp(in, out, sizeof(out)))
+            state.mismatch = true;
+        state.completed++;
+    }
+
+    // Nothing is ever sent on OUT3, only close() ends this read
+    state.waiting = true;
+    TransferResult read = co_await device.read(0x83, span<uint8_t>(in, sizeof(in)));
+    state.last_status = read.status;
+    state.done = true;
+}
+
+static void runPingPong(const char *name, const LoopbackConfig &loopback_config, int round_trips) {
+    Executor executor(1);
+    DeviceConfig config;
+    config.executor = &executor;
+    // The coroutine does all the transfers
+    config.in_endpoints.clear();
+    config.echo_seed_packets = 0;
+
+    LoopbackTransport *transport = new LoopbackTransport(loopback_config);
+    Device *device = new Device(unique_ptr<UsbTransport>(transport), config);
+
+    PingPong state;
+    state.round_trips = round_trips;
+    auto begin = chrono::steady_clock::now();
+    pingPong(*device, state);
+    CHECK(waitFor([&state] {
+        return state.waiting.load() || state.done.load();
+    }));
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    CHECK(state.completed == round_trips);
+    CHECK(!state.mismatch);
+    CHECK(!state.done);
+
+    mutex closed_mutex;
+    condition_variable closed_cv;
+    int closed = 0;
+    bool done_before_closed = false;
+    device->close([&]() {
+        unique_lock < mutex > lk(closed_mutex);
+        done_before_closed = state.done;
+        closed++;
+        closed_cv.notify_all();
+    });
+    {
+        unique_lock < mutex > lk(closed_mutex);
+        CHECK(closed_cv.wait_for(lk, chrono::seconds(5), [&] {
+            return closed > 0;
+        }));
+    }
+    transport->flush();
+    CHECK(closed == 1);
+    CHECK(done_before_closed);
+    CHECK(state.last_status == LIBUSB_TRANSFER_CANCELLED);
+    const TransferPool &pool = device->getTransferPool();
+    CHECK(pool.available() == pool.capacity());
+    printf("%s: %d round trips, %.0f round trips/s\n", name, state.completed.load(),
+            seconds > 0 ? state.completed / seconds : 0.0);
+
+    delete device;
+}
+
+int main() {
+    // Closing cancels the read, which is expected
+    Log::setLevel(LOG_LEVEL_ERROR);
+
+    for (int i = 0; i < 20; i++) {
+        LoopbackConfig loopback_config;
+        runPingPong("no latency", loopback_config, 1000);
+        loopback_config.latency_us = 50;
+        runPingPong("latency", loopback_config, 100);
+    }
+
+    Log::flush();
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}
+
+#else
+
+// Skipped, see SKIP_RETURN_CODE in CMakeLists.txt
+int main() {
+    printf("Built without coroutine support\n");
+    return 77;
+}
+
+#endif